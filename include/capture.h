@@ -0,0 +1,42 @@
+#ifndef __CAPTURE__H__
+#define __CAPTURE__H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+/* 抓包记录的类型 */
+enum CaptureType { kCaptureOpen = 0, kCaptureData, kCaptureClose };
+
+/** 抓包文件由 8 字节的文件头 kCaptureMagic 和若干条记录组成，
+ * 每条记录为一个 CaptureRecord，其后紧跟 len 字节的数据，字段均为主机字节序 */
+static const char kCaptureMagic[8] = {'D', 'W', 'S', 'C', 'A', 'P', '1', '\n'};
+struct CaptureRecord {
+  uint64_t time_us;  // 距开始抓包的时间（微秒）
+  uint32_t conn;     // 连接编号，从 1 开始，不随 fd 复用
+  uint16_t type;     // CaptureType
+  uint16_t len;      // 数据长度，只有 kCaptureData 有数据
+};
+
+/** 抓包文件中的一个连接
+ * events[0] 为建立连接的时间，events[i] 为第 i 个请求第一个字节到达的时间，
+ * 抓包中有关闭记录时最后一项为关闭连接的时间，时间均为距开始抓包的微秒数 */
+struct CaptureSession {
+  vector<uint64_t> events;
+  vector<string> requests;  // 按 HTTP 报文边界切分出的请求
+};
+
+/* HTTP 请求报文在 data 中从 pos 开始的长度，报文不完整或 Content-Length
+ * 无效时返回 0 */
+size_t RequestLength(const string& data, size_t pos);
+
+/* 读取抓包文件，按连接编号（即建立连接的先后）把各连接追加到 sessions，
+ * truncated 返回抓包结束时不完整的请求字节数，文件无效时返回 false */
+bool LoadCapture(const char* file, vector<CaptureSession>* sessions,
+                 uint64_t* truncated);
+
+#endif  //!__CAPTURE__H__
@@ -22,8 +22,13 @@ class Cgi {
   Cgi() {}
   virtual ~Cgi() {}
 
+  /* 进程内共享的状态，子类需要时隐藏这两个函数 */
+  static void InitProcess() {}
+  static void ReleaseProcess() {}
+
   virtual void Init(int epollfd, int sockfd, const sockaddr_in& client_addr) = 0;
-  virtual void Process() = 0;
+  /* 返回 false 时连接已处理完毕或出错，由调用者关闭 */
+  virtual bool Process() = 0;
 };
 
 
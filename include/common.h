@@ -17,31 +17,66 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include <wait.h>
 
+#include <vector>
+
 #include "logger.h"
 
-#define MAX_FD 65535         // 最大文件描述符
 #define MAX_EVENT_NUM 10000  // 最大事件数
-#define TIMEOUT 600          // 超时时间
+#define TIMEOUT 600          // 空闲连接的超时时间（秒）
 
 enum TriggerMode { ET = 0, LT };
 
+/** 触发模式的策略，作为模板参数在编译期选定 I/O 的实现，
+ * 启动时按 --trigger 实例化一次，热路径中不再判断触发模式 */
+struct EtPolicy {
+  static const TriggerMode kMode = ET;
+  static const uint32_t kEpollFlag = EPOLLET;  // 附加的 epoll 事件标志
+  static const bool kDrain = true;  // 必须读写到 EAGAIN，否则不会再收到通知
+};
+struct LtPolicy {
+  static const TriggerMode kMode = LT;
+  static const uint32_t kEpollFlag = 0;
+  static const bool kDrain = false;  // 每个事件只读写一次，剩下的等下个事件
+};
+
 /* 设置非阻塞 io，成功返回 old_opt，错误返回 -1 */
 int SetNonBlocking(int fd);
 
+/* 以 events 将 fd 加入到 epoll 事件表中并设为非阻塞，
+ * data 为事件携带的数据（epoll_event.data.u64），为 0 时携带 fd，
+ * 成功返回 0，错误返回 -1 */
+int EpollAdd(int epollfd, int fd, uint32_t events, uint64_t data);
+
+/* 把 fd 监听的事件改为 events，data 同 EpollAdd，成功返回 0，错误返回 -1 */
+int EpollMod(int epollfd, int fd, uint32_t events, uint64_t data);
+
 /* 将文件描述符 fd 加入到 epoll 事件表中，监听读事件
+ * Io: 触发模式的策略，默认 ET
  * one_shot: 是否采用 one-shot 行为，默认 false
- * trigger_mode: 触发模式，0 为 ET，1 为 LT，默认 ET
+ * data: 同 EpollAdd
  * 成功返回 0，错误返回 -1 */
-int AddFd(int epollfd, int fd, bool one_shot = false,
-          TriggerMode trigger_mode = ET);
+template <typename Io = EtPolicy>
+inline int AddFd(int epollfd, int fd, bool one_shot = false,
+                 uint64_t data = 0) {
+  return EpollAdd(epollfd, fd,
+                  EPOLLIN | EPOLLRDHUP | Io::kEpollFlag |
+                      (one_shot ? (uint32_t)EPOLLONESHOT : 0),
+                  data);
+}
 
 /* 重设 one-shot，
  * ev 为附加监听事件，最终监听事件为 ev | EPOLLONESHOT | EPOLLRDHUP
- * trigger_mode: 触发模式，0 为 ET，1 为 LT，默认 ET */
-int ModFd(int epollfd, int fd, int ev, TriggerMode trigger_mode = ET);
+ * Io: 触发模式的策略，默认 ET
+ * data: 同 EpollAdd */
+template <typename Io = EtPolicy>
+inline int ModFd(int epollfd, int fd, int ev, uint64_t data = 0) {
+  return EpollMod(epollfd, fd, ev | EPOLLONESHOT | EPOLLRDHUP | Io::kEpollFlag,
+                  data);
+}
 
 /* 从 epoll 事件表中删除 fd，成功返回 0，出错返回 -1 */
 int RemoveFd(int epollfd, int fd);
@@ -52,4 +87,46 @@ int AddSig(int signum, void (*handler)(int), bool restart = true);
 /* 发送错误信息，成功返回 0，错误返回 -1 */
 int SendError(int connfd, const char* info);
 
+/* 解析形如 "0,2-5" 的 CPU 列表，按出现顺序追加到 cpus 中，
+ * 成功返回 0，格式错误或 CPU 编号超出范围返回 -1 */
+int ParseCpuList(const char* list, std::vector<int>* cpus);
+
+/* 把线程 thread 绑定到 cpu 上，成功返回 0，错误返回 -1 */
+int PinThread(pthread_t thread, int cpu);
+
+/* 返回 cpu 所在的 NUMA 节点，无法确定时返回 0 */
+int CpuNode(int cpu);
+
+/* TCP 套接字选项，为 0 或 false 的选项不设置，保持系统默认值 */
+struct SockOpts {
+  bool nodelay = false;   // TCP_NODELAY，关闭 Nagle 算法
+  bool cork = false;      // 写应答期间设置 TCP_CORK，只发送满的报文段
+  int fastopen = 0;       // 监听时为 TCP_FASTOPEN 的队列长度，
+                          // 连接时非 0 即设置 TCP_FASTOPEN_CONNECT
+  int notsent_lowat = 0;  // TCP_NOTSENT_LOWAT，发送缓冲区中未发送数据的上限
+  int sndbuf = 0;         // SO_SNDBUF
+  int rcvbuf = 0;         // SO_RCVBUF
+};
+
+/** 解析逗号分隔的套接字选项，按出现顺序设置到 opts 中，成功返回 0，
+ * 格式错误返回 -1。可用的选项：
+ *   nodelay, cork, fastopen[=N], lowat=N, sndbuf=N, rcvbuf=N
+ * 以及预设的组合：
+ *   none        清除之前的所有选项
+ *   latency     nodelay,lowat=16384,fastopen=256
+ *   throughput  cork,sndbuf=1048576,rcvbuf=1048576 */
+int ParseSockOpts(const char* list, SockOpts* opts);
+
+/* 把 opts 中的选项设置到 fd 上，listener 表示 fd 是监听描述符，
+ * 已接受的连接会继承监听描述符的选项。cork 由写应答的一方自行设置。
+ * 成功返回 0，错误返回 -1 */
+int SetSockOpts(int fd, const SockOpts& opts, bool listener);
+
+/* 返回单调时钟的当前时间，单位为微秒 */
+inline uint64_t NowUs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 #endif  //!__COMMON__H__
\ No newline at end of file
@@ -0,0 +1,34 @@
+#ifndef __CONN_LIMITER__H__
+#define __CONN_LIMITER__H__
+
+#include <netinet/in.h>
+
+#include <unordered_map>
+
+#include "locker.h"
+
+/** 每个客户端 IP 的并发连接数限制
+ * Admit 在主线程接收连接时调用，Release 在关闭连接的线程中调用，
+ * 可能是工作线程，所以计数表用锁保护；不限制时两者都直接返回 */
+class ConnLimiter {
+ public:
+  ConnLimiter() : __max_per_ip_(0) {}
+
+  /* max_per_ip 为 0 时不限制 */
+  void Init(int max_per_ip) { __max_per_ip_ = max_per_ip; }
+  /* 该 IP 的连接数未达上限时计数加一并返回 true */
+  bool Admit(in_addr_t ip);
+  /* 关闭由 Admit 接纳的连接 */
+  void Release(in_addr_t ip);
+
+  int max_per_ip() const { return __max_per_ip_; }
+
+ private:
+  int __max_per_ip_;
+  std::unordered_map<in_addr_t, int> __conns_;  // 各 IP 的连接数
+  Locker __locker_;
+};
+
+extern ConnLimiter g_conn_limiter;  // 客户连接的准入限制
+
+#endif  //!__CONN_LIMITER__H__
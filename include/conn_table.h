@@ -0,0 +1,148 @@
+#ifndef __CONN_TABLE__H__
+#define __CONN_TABLE__H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "locker.h"
+
+/** 连接表
+ * 连接保存在槽位中，槽位按块分配，空闲槽位用完时再分配一块，已有连接的地址
+ * 不会改变，所以工作线程持有的指针始终有效，连接数也不受描述符编号的限制。
+ * 每个槽位有一个代数，释放时加一，分配槽位时返回 (代数 << 32 | 槽位) 组成的
+ * 令牌，epoll 事件和定时器都只保存令牌。槽位释放或被复用后，旧令牌查不到
+ * 连接，迟到的事件和定时器会被丢弃，不会落到新连接上。
+ * 令牌的代数从 1 开始，所以不会与小于 2^32 的描述符或 0 相同 */
+template <typename T>
+class ConnTable {
+ public:
+  static const uint32_t kChunk = 1024;      // 每块的槽位数
+  static const uint32_t kMaxChunks = 4096;  // 最多约 400 万个槽位
+
+  ConnTable() : __chunk_num_(0), __free_(kNone), __size_(0) {}
+  ~ConnTable();
+
+  /* 不允许复制 */
+  ConnTable(const ConnTable& rhs) = delete;
+  ConnTable& operator=(const ConnTable& rhs) = delete;
+
+  /* 分配一个槽位，返回其令牌，槽位已用尽时返回 0，只能在主线程中调用 */
+  uint64_t Alloc();
+  /* 令牌仍有效时返回对应的连接，否则返回 NULL，只能在主线程中调用 */
+  T* Get(uint64_t token) const;
+  /* 令牌仍有效时在加锁的情况下调用 f(T*)，返回令牌是否有效，
+   * 期间其他线程不能释放该槽位 */
+  template <typename F>
+  bool Visit(uint64_t token, F f);
+  /* 令牌仍有效时释放槽位，并在加锁的情况下调用 f()，返回令牌是否有效，
+   * 可以在任意线程中调用，f 返回后槽位可能立即被复用 */
+  template <typename F>
+  bool Free(uint64_t token, F f);
+
+  size_t size() const { return __size_; }  // 使用中的槽位数
+  size_t capacity() const {                // 已分配的槽位数
+    return (size_t)__chunk_num_ * kChunk;
+  }
+
+ private:
+  static const uint32_t kNone = UINT32_MAX;  // 空闲链表的结尾
+
+  struct Slot {
+    T value;
+    std::atomic<uint32_t> gen;  // 代数
+    uint32_t next_free;         // 空闲时指向下一个空闲槽位
+  };
+
+  static uint32_t __Index(uint64_t token) { return (uint32_t)token; }
+  static uint32_t __Gen(uint64_t token) { return (uint32_t)(token >> 32); }
+  Slot* __Slot(uint32_t index) const {
+    return &__chunks_[index / kChunk][index % kChunk];
+  }
+  /* 令牌对应的槽位，令牌无效时返回 NULL */
+  Slot* __Find(uint64_t token) const;
+
+  /* 块指针只在主线程中追加，槽位交给其他线程之前块指针已经写好 */
+  Slot* __chunks_[kMaxChunks] = {};
+  std::atomic<uint32_t> __chunk_num_;
+  uint32_t __free_;  // 空闲链表的头
+  std::atomic<size_t> __size_;
+  Locker __locker_;  // 保护空闲链表与代数的修改
+};
+
+template <typename T>
+ConnTable<T>::~ConnTable() {
+  for (uint32_t i = 0; i < __chunk_num_; ++i) delete[] __chunks_[i];
+}
+
+template <typename T>
+uint64_t ConnTable<T>::Alloc() {
+  __locker_.Lock();
+  if (__free_ == kNone) {
+    uint32_t n = __chunk_num_;
+    if (n == kMaxChunks) {
+      __locker_.Unlock();
+      return 0;
+    }
+    Slot* chunk = new Slot[kChunk];
+    /* 倒序入链，先用编号小的槽位 */
+    for (uint32_t i = kChunk; i-- > 0;) {
+      chunk[i].gen = 1;
+      chunk[i].next_free = __free_;
+      __free_ = n * kChunk + i;
+    }
+    __chunks_[n] = chunk;
+    __chunk_num_ = n + 1;
+  }
+  uint32_t index = __free_;
+  Slot* slot = __Slot(index);
+  __free_ = slot->next_free;
+  ++__size_;
+  __locker_.Unlock();
+  return (uint64_t)slot->gen.load(std::memory_order_relaxed) << 32 | index;
+}
+
+template <typename T>
+typename ConnTable<T>::Slot* ConnTable<T>::__Find(uint64_t token) const {
+  uint32_t index = __Index(token);
+  if (index >= capacity()) return NULL;
+  Slot* slot = __Slot(index);
+  if (slot->gen.load(std::memory_order_acquire) != __Gen(token)) return NULL;
+  return slot;
+}
+
+template <typename T>
+T* ConnTable<T>::Get(uint64_t token) const {
+  Slot* slot = __Find(token);
+  return slot ? &slot->value : NULL;
+}
+
+template <typename T>
+template <typename F>
+bool ConnTable<T>::Visit(uint64_t token, F f) {
+  __locker_.Lock();
+  Slot* slot = __Find(token);
+  if (slot) f(&slot->value);
+  __locker_.Unlock();
+  return slot != NULL;
+}
+
+template <typename T>
+template <typename F>
+bool ConnTable<T>::Free(uint64_t token, F f) {
+  __locker_.Lock();
+  Slot* slot = __Find(token);
+  if (slot) {
+    uint32_t gen = __Gen(token) + 1;
+    slot->gen.store(gen == 0 ? 1 : gen, std::memory_order_release);
+    f();
+    slot->next_free = __free_;
+    __free_ = __Index(token);
+    --__size_;
+  }
+  __locker_.Unlock();
+  return slot != NULL;
+}
+
+#endif  //!__CONN_TABLE__H__
@@ -2,6 +2,10 @@
 #define __DUMMY_SERVER__H__
 
 #include <getopt.h>
+#include <limits.h>
+#include <netinet/tcp.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include <exception>
 #include <memory>
@@ -9,15 +13,17 @@
 #include <vector>
 
 #include "common.h"
+#include "conn_limiter.h"
 #include "http_conn.h"
+#include "metrics.h"
+#include "regist_batcher.h"
 #include "sql_connpool.h"
 #include "threadpool.h"
 #include "timer.h"
 
 using std::vector;
 
-extern vector<TimerClientData> g_timer_client_data;  // 定时器用的用户数据
-extern TimerHeap g_timer_heap;                       // 堆定时器
+extern TimerHeap g_timer_heap;  // 堆定时器
 
 class Config {
  public:
@@ -26,10 +32,25 @@ class Config {
   string sql_user_;           // 数据库用户名
   string sql_passwd_;         // 数据库密码
   string db_name_;            // 数据库名称
-  int sql_num_;               // 连接池中的连接数量
+  int sql_num_;               // 连接池中的最大连接数量
+  int sql_min_;               // 连接池中的最小连接数量
   TriggerMode trigger_mode_;  // epoll 触发模式
   bool verbose_;              // 是否输出信息
   string log_path_;           // 日志位置
+  string capture_file_;       // 抓包文件，为空时不抓包
+  vector<int> cpus_;          // 绑定的 CPU，第一个给事件循环，其余给工作线程
+  int backlog_;               // 监听队列长度
+  int max_conn_;              // 最大并发连接数，0 为不限制
+  int max_conn_per_ip_;       // 每个 IP 的最大并发连接数，0 为不限制
+  int max_queue_;             // 线程池队列中等待处理的最大请求数
+  int cgi_thread_num_;        // CGI 线程数
+  int max_cgi_queue_;         // CGI 线程池队列中等待处理的最大请求数
+  SockOpts sock_opts_;        // 监听描述符的套接字选项，连接会继承
+  int keepalive_timeout_;     // 保持连接时的空闲超时（秒），0 为不保持连接
+  int max_requests_;          // 每个连接最多处理的请求数，0 为不限制
+  int header_timeout_;        // 收齐请求行与头部的时限（秒）
+  int body_timeout_;          // 消息体与应答的宽限时间（秒）
+  int min_rate_;              // 读消息体与写应答的最低速率（字节/秒）
 
   Config(int argc, char** argv);
   ~Config() {}
@@ -40,29 +61,51 @@ class Config {
 };
 
 class DummyServer {
+ public:
+  static const int kAcceptBatch = 64;     // 每轮事件循环最多接收的连接数
+  static const int kDeferAcceptSecs = 5;  // TCP_DEFER_ACCEPT 的等待时间（秒）
+
  private:
+  /* 拒绝连接的原因 */
+  enum Reject_ { REJECT_GLOBAL, REJECT_PER_IP, REJECT_NUM };
+
+
   int __port_;                // 端口号
   char* __root_;              // 网站根目录
-  vector<HttpConn> __users_;  // 客户端数组
   int __thread_num_;          // 线程数
 
-  std::unique_ptr<Threadpool<HttpConn>> __pool_;
+  /* 各通道的线程池，LANE_INLINE 在主线程中处理，没有线程池 */
+  std::unique_ptr<Threadpool<HttpConn>> __lanes_[HttpConn::LANE_NUM];
 
   epoll_event __events_[MAX_EVENT_NUM];  // 触发事件数组
   int __epollfd_;                        // epoll 内核事件表描述符
   int __listenfd_;                       // 监听描述符
-  TriggerMode __trigger_mode_;           // 触发模式，暂时只支持 ET
+  int __backlog_;                        // 监听队列长度
+  SockOpts __sock_opts_;                 // 监听描述符的套接字选项
+  int __max_conn_;                       // 最大并发连接数
+  int __signalfd_;                       // 接收 SIGTERM、SIGINT
+  int __timerfd_;                        // 在最早的定时器到期时可读
+  uint64_t __timer_armed_;               // __timerfd_ 设定的到期时间，0 为未设定
+  TriggerMode __trigger_mode_;           // 客户连接的触发模式
 
   string __sql_user_;    // sql 用户名
   string __sql_passwd_;  // sql 密码
   string __db_name_;     // 数据库名称
-  int __sql_num;         // 连接池中的连接数量
-
-  /* 信号处理函数，sig 为待处理信号，信号处理函数必须为静态 */
-  static void __SigHandler(int sig);
+  int __sql_num;         // 连接池中的最大连接数量
+  int __sql_min_;        // 连接池中的最小连接数量
 
   volatile bool __stop_server_;
 
+  vector<int> __cpus_;      // 绑定的 CPU，为空时不绑定
+  vector<int> __cpu_node_;  // 各 CPU 所在的 NUMA 节点
+  int __loop_node_;         // 事件循环所在的 NUMA 节点
+  int __rx_counter_[2];     // 新连接的网卡接收队列是否与事件循环同节点的计数器编号
+  int __reject_counter_[REJECT_NUM];  // 各原因拒绝的连接数的计数器编号
+
+  int __queue_full_counter_[HttpConn::LANE_NUM];  // 各通道队列已满而以 503 拒绝的请求数的计数器编号
+  int __stale_events_counter_;  // 令牌已失效而丢弃的事件数的计数器编号
+  static int __timeout_counter_[HttpConn::STAGE_NUM];  // 各阶段超时关闭的连接数的计数器编号
+
  public:
   explicit DummyServer(const Config& config);
   ~DummyServer();
@@ -80,15 +123,28 @@ class DummyServer {
   TriggerMode trigger_mode() const { return __trigger_mode_; };
 
  private:
+  /* 事件循环及其处理函数按触发模式的策略 Io 实例化 */
+  template <typename Io>
+  void __Loop();
+  template <typename Io>
   void __AddClient();
+  void __Reject(int connfd, Reject_ reason);
   void __Listen();
   void __SignalProcess();
-  void __ReadFromClient(int sockfd);
-  void __WriteToClient(int sockfd);
+  void __TimerProcess();
+  void __ArmTimer();
+  void __CloseConn(HttpConn* conn);
+  template <typename Io>
+  void __ReadFromClient(HttpConn* conn);
+  template <typename Io>
+  void __WriteToClient(HttpConn* conn);
   void __SqlConnpool();
-  void __SetTimer(int sockfd, sockaddr_in client_addr);
-  static void __TimerCallback(TimerClientData* user_data);
-  void __ResetTimer(int sockfd);
+  void __InitMetrics();
+  void __PinLoop();
+  void __CountRxNode(int connfd);
+  void __SetTimer(HttpConn* conn);
+  static void __TimerCallback(uint64_t token);
+  static void __ResetTimer(HttpConn* conn);
 };
 
 #endif  //!__DUMMY_SERVER__H__
\ No newline at end of file
@@ -0,0 +1,52 @@
+#ifndef __HISTOGRAM__H__
+#define __HISTOGRAM__H__
+
+#include <stdint.h>
+
+#include <atomic>
+
+/** HDR 风格的直方图
+ * 数值按最高位分组，每组再线性地分成 kSubBuckets 个桶，
+ * 因此每个桶的相对误差不超过 1/kSubBuckets，且桶的数量是固定的。
+ * 桶计数为原子变量，多个线程可以同时 Record，也可以在记录的同时读取 */
+class Histogram {
+ public:
+  static const int kSubBucketBits = 4;
+  static const int kSubBuckets = 1 << kSubBucketBits;  // 每组的桶数
+  static const int kMaxBits = 40;  // 可记录的最大值为 2^40 - 1，超过的记入最后一个桶
+  static const int kBucketNum = (kMaxBits - kSubBucketBits + 1) * kSubBuckets;
+
+  Histogram() { Reset(); }
+
+  /* 不允许复制，需要快照时用 Merge */
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  /* 记录一个数值 */
+  void Record(uint64_t value);
+  /* 将 other 中的数据累加到本直方图中 */
+  void Merge(const Histogram& other);
+  void Reset();
+
+  /* 返回百分位数 p（0 ~ 100）处的数值，没有数据时返回 0 */
+  uint64_t Percentile(double p) const;
+
+  /* 取值函数 */
+  uint64_t count() const { return __count_.load(std::memory_order_relaxed); }
+  uint64_t sum() const { return __sum_.load(std::memory_order_relaxed); }
+  uint64_t max() const { return __max_.load(std::memory_order_relaxed); }
+  double mean() const { return count() ? (double)sum() / count() : 0; }
+
+ private:
+  /* 数值所在桶的下标 */
+  static int __Index(uint64_t value);
+  /* 下标为 idx 的桶所能表示的最大值 */
+  static uint64_t __Value(int idx);
+
+  std::atomic<uint64_t> __counts_[kBucketNum];
+  std::atomic<uint64_t> __count_;
+  std::atomic<uint64_t> __sum_;
+  std::atomic<uint64_t> __max_;
+};
+
+#endif  //!__HISTOGRAM__H__
@@ -4,11 +4,16 @@
 #include <netdb.h>
 
 #include <map>
+#include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "common.h"
+#include "conn_table.h"
 #include "locker.h"
+#include "metrics.h"
+#include "slab_pool.h"
 #include "sql_connpool.h"
 #include "timer.h"
 
@@ -16,8 +21,6 @@ using std::map;
 using std::string;
 using std::vector;
 
-extern vector<TimerClientData> g_timer_client_data;  // 定时器用的用户数据
-extern TimerHeap g_timer_heap;                       // 堆定时器
 
 /* 描述映射到内存中的文件 */
 class File {
@@ -30,6 +33,9 @@ class File {
 };
 
 class HttpConn {
+  friend class HttpConnBench;  // 微基准测试
+  friend class HttpConnTest;   // 回归测试
+
  public:
   static const int kFileNameLen_ = 200;   // 文件名最大长度
   static const int kReadBufSize_ = 2048;  // 读缓冲区大小
@@ -55,83 +61,289 @@ class HttpConn {
     FILE_REQUEST,
     INTERNAL_ERROR,
     CLOSED_CONNECTION,
-    CGI_REQUEST
+    CGI_REQUEST,
+    PENDING_REQUEST,  // 已交给其他线程异步处理，完成后再应答
+    STATS_REQUEST,    // 请求服务器的统计信息
+    HTTP_CODE_NUM
+  };
+  /* 请求的类别，用于分类统计延迟 */
+  enum Route_ {
+    ROUTE_OTHER,  // 请求行或头部有误，还没有确定类别
+    ROUTE_STATIC,
+    ROUTE_LOGIN,
+    ROUTE_REGISTER,
+    ROUTE_CGI,
+    ROUTE_STATS,
+    ROUTE_NUM
+  };
+  /* 请求处理的各个阶段 */
+  enum Phase_ {
+    PHASE_PARSE,    // 读完请求 -> 主线程解析完请求
+    PHASE_QUEUE,    // 解析完 -> 所在通道取出
+    PHASE_HANDLE,   // 取出 -> 文件查找、数据库、CGI 处理完毕
+    PHASE_RESPOND,  // 处理完毕 -> 应答填充完毕
+    PHASE_WRITE,    // 应答填充完毕 -> 最后一个字节写出
+    PHASE_TOTAL,    // 读完请求 -> 最后一个字节写出
+    PHASE_NUM
+  };
+  /* 连接所处的阶段，各阶段有各自的超时规则，见 Deadline() */
+  enum Stage_ {
+    STAGE_HEADER,  // 等待请求行与头部
+    STAGE_BODY,    // 等待消息体
+    STAGE_BUSY,    // 请求在队列中或正在处理
+    STAGE_DRAIN,   // 发送应答
+    STAGE_IDLE,    // 保持连接，等待下一个请求
+    STAGE_NUM
+  };
+  /* 处理请求的通道，各通道的线程与队列相互独立，慢的后端不会拖慢静态资源 */
+  enum Lane_ {
+    LANE_INLINE,  // 主线程直接处理：静态资源、出错的请求
+    LANE_APP,     // 通用线程池：登录、注册、统计信息
+    LANE_CGI,     // CGI 线程池：执行 Python 脚本
+    LANE_NUM
+  };
+  /* 可以按编号直接查找的请求头部，名称见 http_conn.cpp 中的 kHeaderNames */
+  enum Header_ {
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_AUTHORIZATION,
+    HEADER_CACHE_CONTROL,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_COOKIE,
+    HEADER_EXPECT,
+    HEADER_HOST,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_RANGE,
+    HEADER_ORIGIN,
+    HEADER_PRAGMA,
+    HEADER_RANGE,
+    HEADER_REFERER,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_UPGRADE,
+    HEADER_USER_AGENT,
+    HEADER_X_FORWARDED_FOR,
+    HEADER_NUM,
+    HEADER_OTHER = HEADER_NUM  // 其他头部
+  };
+  /* 一个请求头部，名称和值都指向读缓冲区，值不含两端的空白 */
+  struct HeaderField {
+    std::string_view name;
+    std::string_view value;
+    Header_ id;
   };
+  static const int kMaxHeaders = 32;  // 请求头部的最大数量
+  static const char kBusyResponse[];  // 预先生成的过载应答（503）
 
  public:
-  HttpConn() {}
+  HttpConn() : __buf_(NULL) {}
   ~HttpConn() {}
 
-  /* 初始化新接收的连接 */
-  void Init(int sockfd, const sockaddr_in& addr, TriggerMode trigger_mode = ET);
-  /* 关闭连接 */
+  /* 初始化新接收的连接，token 为连接在连接表中的令牌，
+   * 失败时关闭 sockfd 并释放槽位，返回 false */
+  template <typename Io>
+  bool Init(int sockfd, const sockaddr_in& addr, uint64_t token);
+  /* 关闭连接并释放槽位，之后连接可能立即被复用，不能再访问 */
   void CloseConn(bool real_close = true);
-  /* 处理客户请求 */
+  /* 超时时由主线程调用，只关闭 socket 的读写而不关闭描述符，
+   * 连接的持有者随后收到挂断事件或读写出错时再调用 CloseConn */
+  void Shutdown();
+  /* 过载时由主线程调用，发送 kBusyResponse 并关闭写端，之后应关闭连接 */
+  void SendBusy();
+  /* 读完数据后由主线程调用，解析请求并返回应在哪个通道处理，
+   * 请求不完整或有误时返回 LANE_INLINE */
+  Lane_ Prepare();
+  /* 由通道的工作线程调用，处理 Prepare() 解析好的请求并直接写应答，
+   * 写不完时注册可写事件交给主线程 */
   void Process();
+  /* 由主线程调用，处理 LANE_INLINE 的请求，应答已填充时返回 true，
+   * 此时没有注册可写事件，调用者应直接调用 Write() */
+  template <typename Io>
+  bool ProcessInline();
   /* 非阻塞读 */
+  template <typename Io>
   bool Read();
-  /* 非阻塞写 */
+  /* 非阻塞写，由持有连接的线程调用，返回 false 时调用者应关闭连接 */
+  template <typename Io>
   bool Write();
+  /* 选定工作线程写应答时使用的触发模式，在创建工作线程前调用 */
+  template <typename Io>
+  static void UseIoPolicy() {
+    __send_ = &HttpConn::__Send<Io>;
+  }
+  /* 注册请求写入数据库后，由 RegistBatcher 的写入线程回调 */
+  void RegistDone(const char* username, const char* passwd, bool ok);
   /* 将用户名密码加载到内存 */
   static void InitSqlResult();
   /* 将静态资源加载到内存 */
   static void InitStaticResource(const char* root);
   /* 释放缓存的资源 */
   static void ReleaseStaticResource();
+  /* 注册 HTTP 相关的统计指标 */
+  static void InitMetrics();
+  /* 已分配和借出的请求缓冲区数量 */
+  static size_t buffers_allocated() { return SlabPool<HttpBuf>::allocated(); }
+  static size_t buffers_in_use() { return SlabPool<HttpBuf>::in_use(); }
+  /* 按名称查找已知头部的编号，不区分大小写，未知的返回 HEADER_OTHER */
+  static Header_ LookupHeader(std::string_view name);
+
+  /* 当前请求中的头部，没有时返回空串，同名头部以最后一个为准 */
+  std::string_view Header(Header_ id) const {
+    return __header_index_[id] < 0
+               ? std::string_view()
+               : __buf_->headers[__header_index_[id]].value;
+  }
+  std::string_view Header(std::string_view name) const;
+
+  uint64_t token() const { return __token_; }
+  /* 缓冲区中有流水线发来的下一个请求，由可写事件交给主线程解析 */
+  bool pipelined() const { return __pipelined_; }
+  /* 空闲超时的定时器，只能在主线程中访问 */
+  TimerHeap::TimerPtr& timer() { return __timer_; }
+  /* 连接所处的阶段，可以在任意线程中调用 */
+  Stage_ stage() const {
+    return (Stage_)(__stage_.load(std::memory_order_acquire) >> kStageShift);
+  }
+  /* 当前阶段超时的时间（毫秒），可以在任意线程中调用 */
+  uint64_t Deadline() const;
 
  public:
   /* epoll 内核事件表，所有 socket 事件都注册到同一个事件表，所以设为静态 */
   static int epollfd_;
-  /* 统计用户数量 */
-  static int user_cnt_;
+  /* 是否在写应答期间设置 TCP_CORK，由 --sockopt 的 cork 选项决定 */
+  static bool cork_;
+  /* 统计用户数量，主线程与工作线程都会修改 */
+  static std::atomic<int> user_cnt_;
+  /* 保持连接时两个请求之间的最长空闲时间（秒），0 为不保持连接 */
+  static int keepalive_timeout_;
+  /* 每个连接最多处理的请求数，0 为不限制 */
+  static int max_requests_;
+  /* 从请求的第一个字节起，收齐请求行与头部的时限（秒） */
+  static int header_timeout_;
+  /* 消息体与应答的宽限时间（秒），之后要求不低于 min_rate_ 的平均速率 */
+  static int body_timeout_;
+  /* 读消息体与写应答的最低速率（字节/秒），0 为只限制两次读写之间的间隔 */
+  static int min_rate_;
 
  private:
+  /** 只在处理请求期间需要的缓冲区，收到请求的第一个字节时从 SlabPool 借用，
+   * 应答发送完毕（保持连接时即进入空闲）或关闭连接时归还，
+   * 因此占用的内存与正在处理的请求数成正比，而不是与连接数成正比 */
+  struct HttpBuf {
+    char read[kReadBufSize_ + 1];       // 读缓冲区，多一个字节用于补 '\0'
+    char write[kWriteBufSize];          // 写缓冲区
+    char cgiret[kWriteBufSize];         // cgi 返回数据的缓冲区
+    char real_file[kFileNameLen_];      // 客户端请求目标完整路径
+    HeaderField headers[kMaxHeaders];   // 按出现顺序排列的请求头部
+  };
+
   int __sockfd_;                   // 该 HTTP 连接的 socket
+  uint64_t __token_;               // 在连接表中的令牌，也是 epoll 事件携带的数据
+  TimerHeap::TimerPtr __timer_;    // 空闲超时的定时器
+  uint32_t __conn_id_;             // 连接编号，用于抓包
+  static std::atomic<uint32_t> __conn_seq_;  // 已分配的连接编号
   struct sockaddr_in __addr_;      // 客户端 socket 地址
-  char __read_buf[kReadBufSize_];  // 读缓冲区
+  HttpBuf* __buf_;                 // 借用的缓冲区，空闲时为 NULL
   int __read_idx_;     // 已读客户数据的最后一个字节的下个位置
   int __cur_idx_;      // 当前正在分析的字符位置
   int __start_line_;   // 当前正在解析的行的起始位置
+  int __colon_;        // 当前行中第一个 ':' 的位置，没有为 -1
   int __range_start_;  // Range 参数，从哪里开始传
   int __range_end_;    // Range 参数，到哪里结束
-  char __write_buf_[kWriteBufSize];   // 写缓冲区
   int __write_idx_;                   // 写缓冲区中待发送的字节数
   CheckState_ __check_state_;         // 主状态机所处状态
   Method_ __method_;                  // 请求方法
-  char __real_file_[kFileNameLen_];   // 客户端请求目标完整路径
   char* __url_;                       // 客户端请求目标的文件名
-  char* __version_;                   // HTTP 版本号，只支持 HTTP/1.1
-  char* __host_;                      // 主机名
+  char* __basename_;                  // real_file 中的文件名部分
+  char* __version_;                   // HTTP 版本号，支持 HTTP/1.1 和 HTTP/1.0
   int __content_length_;              // HTTP 请求消息体的长度
+  int __header_cnt_;                    // 请求头部的数量
+  int8_t __header_index_[HEADER_NUM];   // 已知头部在 __headers_ 中的位置
   bool __linger_;                     // 是否保持连接
+  bool __pipelined_;                  // 缓冲区中是否有待解析的流水线请求
+  char __next_char_;                  // 消息体之后被改为 '\0' 的字节
+  int __requests_;                    // 本连接已应答的请求数
+  /* 阶段在高 8 位，低位为进入该阶段的时间（毫秒），一次读出，
+   * 主线程检查超时时不会看到新阶段配旧时间 */
+  static const int kStageShift = 56;
+  std::atomic<uint64_t> __stage_;
+  std::atomic<uint64_t> __stage_bytes_;  // 本阶段读写的字节数
+  std::atomic<uint64_t> __active_ms_;    // 最后一次读写的时间（毫秒）
   struct iovec __iov_[2];             // 集中写
   int __iov_cnt_;                     // 被写内存块的数量
+  bool __corked_;                     // 是否设置了 TCP_CORK
   int __bytes_to_send_;               // 待发送字节数
   int __bytes_have_sent_;             // 已发送字节数
-  TriggerMode __trigger_mode_;        // epoll 触发模式
-  char __cgiret_buf_[kWriteBufSize];  // cgi 返回数据的缓冲区
+  string __stats_buf_;                // 统计信息
+
+  static int __code_counter_[HTTP_CODE_NUM];  // 各类请求结果的计数器编号
+  static int __bytes_counter_;                // 发送字节数的计数器编号
+  static int __write_wait_counter_;  // 写满发送缓冲区而等待可写的次数的计数器编号
+  static int __phase_hist_[ROUTE_NUM][PHASE_NUM];  // 各阶段延迟的直方图编号
 
-  string __sql_user_;
-  string __sql_passwd_;
-  string __sql_name_;
+  /* 各阶段开始时的时间戳（微秒），用于统计延迟 */
+  Route_ __route_;          // 请求类别
+  uint64_t __t_read_;       // 读完请求
+  uint64_t __t_dequeued_;   // 被所在通道取出
+  uint64_t __t_parsed_;     // 解析完请求
+  uint64_t __t_handled_;    // 处理完毕
+  uint64_t __t_queued_;     // 应答填充完毕
 
   static map<string, File> __resources_;  // 静态资源
   File* __request_file_;                  // 当前请求的文件
+  HttpCode_ __parse_ret_;                 // Prepare() 的解析结果
+  char* __content_;                       // 请求的消息体
 
  private:
   /* 初始化连接 */
   void __Init();
+  /* 进入新阶段，本阶段读写的字节数清零 */
+  void __SetStage(Stage_ stage, uint64_t now_ms) {
+    __stage_bytes_.store(0, std::memory_order_relaxed);
+    __stage_.store((uint64_t)stage << kStageShift | now_ms,
+                   std::memory_order_release);
+  }
+  /* 以连接的令牌重设 one-shot 事件 */
+  template <typename Io>
+  int __ModFd(int ev) {
+    return ModFd<Io>(epollfd_, __sockfd_, ev, __token_);
+  }
+  /* 借用、归还缓冲区 */
+  void __AttachBuf();
+  void __DetachBuf();
+  /* 应答发送完后重置解析状态，保留缓冲区中当前请求之后的数据 */
+  bool __KeepPipelined();
   /* 解析 HTTP 请求 */
   HttpCode_ __ProcessRead();
   /* 填充 HTTP 应答 */
   bool __ProcessWrite(HttpCode_ ret);
   /* 以下一组函数由 __ProcessRead() 调用以分析 HTTP 请求 */
-  HttpCode_ __ParseRequestLine(char* text);
-  HttpCode_ __ParseHeaders(char* text);
+  HttpCode_ __ParseRequestLine(char* text, char* end);
+  HttpCode_ __ParseHeaders(char* text, char* colon, char* end);
   HttpCode_ __ParseContent(char* text);
+  /* 解码 url，确定目标文件与请求类别，在主线程中调用 */
+  HttpCode_ __Route();
+  /* 按请求类别处理请求，在所在通道中调用 */
   HttpCode_ __DoRequest(char* text);
-  inline char* __GetLine() { return __read_buf + __start_line_; }
+  /* 处理 Prepare() 解析好的请求，不需要立即应答时返回 NO_REQUEST 或
+   * PENDING_REQUEST */
+  HttpCode_ __Handle();
+  /* 查找 __real_file_ 对应的静态资源 */
+  HttpCode_ __DoFile();
+  /* 根据处理结果填充应答，出错关闭连接时返回 false */
+  bool __Reply(HttpCode_ ret);
+  /* 在工作线程中填充应答并直接写 */
+  template <typename Io>
+  void __Send(HttpCode_ ret);
+  /* UseIoPolicy() 选定的 __Send 实例 */
+  static void (HttpConn::*__send_)(HttpCode_ ret);
+  inline char* __GetLine() { return __buf_->read + __start_line_; }
   LineState_ __ParseLine();
+  /* 抓包时记录刚读到的 n 字节 */
+  void __Capture(int n);
   /* 以下一组函数由 __ProcessWrite() 调用以填充 HTTP 应答 */
   bool __AddResponse(const char* format, ...);
   bool __AddContent(const char* content);
@@ -142,8 +354,13 @@ class HttpConn {
   bool __AddContentRange();
   bool __AddLinger();
   bool __AddBlankLine();
+  /* 设置或解除 TCP_CORK */
+  void __Cork(int on);
   /* 调整 __iov_ 内容 */
-  void __AdjustIov();
+  void __AdjustIov(int n);
+  /* 记录各阶段的延迟 */
+  void __RecordPhases();
+  void __RecordWrite();
   /* 登录、注册、提取用户名密码 */
   bool __Login(char* basename);
   bool __Regist(char* basename);
@@ -152,4 +369,6 @@ class HttpConn {
   HttpCode_ __RunPython(char* text);
 };
 
+extern ConnTable<HttpConn> g_conn_table;  // 所有客户连接
+
 #endif  //!__HTTP_CONN__H__
\ No newline at end of file
@@ -25,6 +25,17 @@ class Sem {
 
   bool Wait() { return sem_wait(&__sem_) == 0; }
 
+  /* 不阻塞，信号量为 0 时直接返回 false */
+  bool TryWait() { return sem_trywait(&__sem_) == 0; }
+
+  /* 最多等到 abstime（CLOCK_REALTIME 绝对时间），超时返回 false */
+  bool TimedWait(const struct timespec& abstime) {
+    int ret = 0;
+    while ((ret = sem_timedwait(&__sem_, &abstime)) != 0 && errno == EINTR) {
+    }
+    return ret == 0;
+  }
+
   bool Post() { return sem_post(&__sem_) == 0; }
 };
 
@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -16,6 +17,8 @@
 #include <string>
 #include <vector>
 
+#include "capture.h"
+
 using std::string;
 using std::vector;
 
@@ -44,13 +47,27 @@ class Logger {
   static void Error(const char* file, int line, const char* func,
                     const char* msg, ...);
 
+  /* 因异步 IO 资源不足而丢弃的日志条数 */
+  static uint64_t Dropped() { return GetLogger()->__dropped_; }
+
+  /* 开始抓包，之后的抓包记录写入 file */
+  static void InitCapture(const string& file);
+  /* 是否在抓包 */
+  static bool Capturing() { return GetLogger()->__capture_fd_ >= 0; }
+  /* 写入一条抓包记录，通过异步 IO 写入，但不会丢弃 */
+  static void Capture(uint32_t conn, CaptureType type, const char* data = NULL,
+                      size_t len = 0);
+
  private:
   void __InitImp(LogLevel loglev, string& file_path, bool verbose);
 
   void __WriteLog(LogLevel loglev, const char* file, int line, const char* func,
                   const char* msg);
 
-  AioBuf* __PrepareAiobuf(char* data);
+  AioBuf* __PrepareAiobuf(int fd, const char* data, size_t len);
+  /* 提交异步写，资源不足时丢弃 */
+  void __Submit(int fd, const char* data, size_t len);
+  void __SubmitCapture(const char* data, size_t len);
 
   static void __ThreadHandler(union sigval val);
 
@@ -64,6 +81,10 @@ class Logger {
   LogLevel __loglev_;  // 记录日志的级别
   bool __verbose_;     // 是否输出的标准输出（这里是同步 IO）
   int __fd_;           // 写入文件的描述符
+  int __capture_fd_;   // 抓包文件的描述符，-1 表示不抓包
+  uint64_t __capture_start_;  // 开始抓包的时间（微秒）
+  std::atomic<off_t> __capture_off_;  // 下一条抓包记录在文件中的位置
+  std::atomic<uint64_t> __dropped_;  // 丢弃的日志条数
 };
 
 #define LOGINFO(FMT, ...)                                               \
@@ -0,0 +1,116 @@
+#ifndef __METRICS__H__
+#define __METRICS__H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+#include "locker.h"
+
+using std::string;
+using std::vector;
+
+/** 指标注册表，按 Prometheus 文本格式输出
+ * 计数器：每个线程各有一份分片，只由本线程写入，读取时把所有分片相加，
+ *         因此热路径上的 Inc 没有原子读改写，也没有锁
+ * 仪表：取值时调用注册的回调函数
+ * 直方图：按 summary 类型输出分位数，分片直方图同样每个线程一份，取值时合并
+ * 所有指标需在启动阶段注册 */
+class Metrics {
+ public:
+  static const int kMaxCounters = 128;   // 分片计数器的最大数量
+  static const int kMaxHistograms = 64;  // 分片直方图的最大数量
+
+  /* 注册分片计数器，返回其编号，labels 形如 code="FILE_REQUEST" */
+  static int AddCounter(const string& name, const string& help,
+                        const string& labels = "");
+  /* 注册由回调取值的计数器 */
+  static void AddCounter(const string& name, const string& help,
+                         std::function<double()> getter,
+                         const string& labels = "");
+  /* 注册由回调取值的仪表 */
+  static void AddGauge(const string& name, const string& help,
+                       std::function<double()> getter,
+                       const string& labels = "");
+  /* 注册直方图，输出 p50、p90、p99、p999 以及 sum 和 count */
+  static void AddHistogram(const string& name, const string& help,
+                           const Histogram* histogram,
+                           const string& labels = "");
+  /* 注册分片直方图，返回其编号 */
+  static int AddHistogram(const string& name, const string& help,
+                          const string& labels);
+
+  /* 当前线程的分片计数器加 n */
+  static void Inc(int id, uint64_t n = 1) {
+    std::atomic<uint64_t>& c = __LocalShard()->counters[id];
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+  /* 所有线程中编号为 id 的计数器之和 */
+  static uint64_t Value(int id);
+
+  /* 在当前线程的分片直方图中记录一个数值 */
+  static void Record(int id, uint64_t value) {
+    std::atomic<Histogram*>& slot = __LocalShard()->histograms[id];
+    Histogram* h = slot.load(std::memory_order_relaxed);
+    if (h == nullptr) {
+      /* 直方图较大，第一次记录时才分配 */
+      h = new Histogram();
+      slot.store(h, std::memory_order_release);
+    }
+    h->Record(value);
+  }
+  /* 将所有线程中编号为 id 的直方图合并到 out 中 */
+  static void Merge(int id, Histogram* out);
+
+  /* 按 Prometheus 文本格式输出所有指标 */
+  static string Render();
+
+ private:
+  enum Type { kCounter, kGauge, kSummary };
+
+  /* 一条时间序列 */
+  struct Series {
+    string labels;
+    int id;                          // 分片计数器或直方图的编号，否则为 -1
+    std::function<double()> getter;  // 回调取值
+    const Histogram* histogram;      // 直方图
+  };
+
+  /* 同名的时间序列组成一个指标族 */
+  struct Family {
+    string name;
+    string help;
+    Type type;
+    vector<Series> series;
+  };
+
+  /* 线程的计数器分片，线程退出后分片仍保留，保证计数不丢失 */
+  struct Shard {
+    std::atomic<uint64_t> counters[kMaxCounters];
+    std::atomic<Histogram*> histograms[kMaxHistograms];
+    Shard() {
+      for (int i = 0; i < kMaxCounters; ++i) counters[i] = 0;
+      for (int i = 0; i < kMaxHistograms; ++i) histograms[i] = nullptr;
+    }
+  };
+
+  static Shard* __LocalShard() {
+    static thread_local Shard* shard = __NewShard();
+    return shard;
+  }
+  static Shard* __NewShard();
+  static void __Add(const string& name, const string& help, Type type,
+                    const Series& series);
+
+  static vector<Family> __families_;
+  static vector<Shard*> __shards_;
+  static int __counter_num_;
+  static int __histogram_num_;
+  static Locker __locker_;
+};
+
+#endif  //!__METRICS__H__
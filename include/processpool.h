@@ -3,6 +3,7 @@
 
 #include <atomic>
 #include <cassert>
+#include <memory>
 #include <vector>
 
 #include "common.h"
@@ -23,7 +24,11 @@ class process {
 static Locker __instance_locker = Locker();
 
 /** 进程池类模板
- * T: 处理逻辑任务的类
+ * T: 处理逻辑任务的类，需要实现：
+ *   static void InitProcess()     子进程启动时调用一次，初始化进程内共享的状态
+ *   static void ReleaseProcess()  子进程退出前调用一次
+ *   void Init(epollfd, sockfd, client_addr)  接收新连接后调用
+ *   bool Process()  连接可读时调用，返回 false 时由进程池关闭连接并回收对象
  */
 template <typename T>
 class Processpool {
@@ -31,6 +36,7 @@ class Processpool {
   static const int kMaxProcessNum = 16;  // 线程池最大子线程数量
   static const int kUserPerProcess = 65535;  // 每个子进程最多处理的客户端数量
   static const int kMaxEventNum = 10000;  // epoll 最多能处理的事件数
+  static const int kUserSlab = 64;  // 逻辑处理对象不够时一次分配的数量
 
   int __process_number_;  // 进程池中的进程总数
   int __idx_;             // 子进程在进程池中的序号，从 0 开始
@@ -39,6 +45,13 @@ class Processpool {
   volatile bool __stop_;  // 是否停止子进程
 
   vector<process> __sub_process_;  // 保存所有子进程的描述信息
+
+  /* 子进程中的逻辑处理对象，接收连接时才从空闲链表中取用，关闭连接时归还，
+   * 空闲链表为空时一次分配 kUserSlab 个，占用的内存与并发连接数的峰值成正比 */
+  vector<T*> __users_;       // 按描述符索引，没有连接的为 nullptr
+  vector<T*> __free_users_;  // 空闲的对象
+  vector<std::unique_ptr<T[]>> __user_slabs_;
+  int __user_cnt_;           // 使用中的对象数
   static std::atomic<Processpool*> __instance_;  // Processpool 实例，为原子对象
 
   /* 删除构造函数，通过 Create 方法来创建 Processpool 实例 */
@@ -86,6 +99,12 @@ class Processpool {
   void __Setup();
   void __RunParent();
   void __RunChild();
+  /* 为新连接取一个逻辑处理对象，已达 kUserPerProcess 时返回 nullptr */
+  T* __AllocUser(int sockfd);
+  /* 回收描述符对应的逻辑处理对象 */
+  void __FreeUser(int sockfd);
+  /* 关闭连接并回收其逻辑处理对象 */
+  void __CloseUser(int sockfd);
 };
 
 /* 初始化静态变量 */
@@ -112,7 +131,7 @@ static void SigHandler(int sig) {
  */
 template <typename T>
 Processpool<T>::Processpool(int listenfd, int process_number)
-    : __sub_process_(process_number) {
+    : __sub_process_(process_number), __user_cnt_(0) {
   __process_number_ = process_number;
   __idx_ = -1;
   __listenfd_ = listenfd;
@@ -189,9 +208,44 @@ void Processpool<T>::Run() {
   __RunParent();
 }
 
+template <typename T>
+T* Processpool<T>::__AllocUser(int sockfd) {
+  if (__user_cnt_ >= kUserPerProcess) return nullptr;
+  if (__free_users_.empty()) {
+    T* slab = new T[kUserSlab];
+    __user_slabs_.emplace_back(slab);
+    for (int i = kUserSlab; i-- > 0;) __free_users_.push_back(&slab[i]);
+  }
+  if ((int)__users_.size() <= sockfd) __users_.resize(sockfd + 1, nullptr);
+  T* user = __free_users_.back();
+  __free_users_.pop_back();
+  __users_[sockfd] = user;
+  ++__user_cnt_;
+  return user;
+}
+
+template <typename T>
+void Processpool<T>::__FreeUser(int sockfd) {
+  __free_users_.push_back(__users_[sockfd]);
+  __users_[sockfd] = nullptr;
+  --__user_cnt_;
+}
+
+template <typename T>
+void Processpool<T>::__CloseUser(int sockfd) {
+  /* 不能用 RemoveFd，它会 shutdown 连接，而执行代码的子进程还持有连接的副本，
+   * 只关闭本进程的描述符，连接在最后一个副本关闭时才断开 */
+  if (epoll_ctl(__epollfd_, EPOLL_CTL_DEL, sockfd, 0) < 0)
+    LOGWARN("epoll_ctl error");
+  if (close(sockfd) < 0) LOGWARN("close error");
+  __FreeUser(sockfd);
+}
+
 template <typename T>
 void Processpool<T>::__RunChild() {
   __Setup();
+  /* 进程内共享的状态只初始化一次，而不是每个逻辑处理对象各一次 */
+  T::InitProcess();
 
   /* 1 端为子进程端，0 端为父进程端，子进程通过 sktpipefd[1] 和父进程通信 */
   int sktpipefd = __sub_process_[__idx_].sktpipefd[1];
@@ -203,7 +257,6 @@ void Processpool<T>::__RunChild() {
   }
 
   epoll_event events[kMaxEventNum];
-  vector<T> users(kUserPerProcess);
   int n_events = 0;
   int ret = -1;
   while (!__stop_) {
@@ -229,14 +282,20 @@ void Processpool<T>::__RunChild() {
           int connfd =
               accept(__listenfd_, (sockaddr*)&client_addr, &client_addrlen);
           if (connfd < 0) continue;
+          T* user = __AllocUser(connfd);
+          if (user == nullptr) {
+            LOGWARN("too many users");
+            if (close(connfd)) LOGERR("close errro");
+            continue;
+          }
           if (AddFd(__epollfd_, connfd) < 0) {
             LOGWARN("AddFd error");
+            __FreeUser(connfd);
             if (close(connfd)) LOGERR("close errro");
             continue;
           }
-          /* 逻辑处理类 T 需要实现 Init 方法来初始化一个客户端连接
-           * 使用 connfd来索引逻辑处理对象 */
-          users[connfd].Init(__epollfd_, connfd, client_addr);
+          /* 使用 connfd 来索引逻辑处理对象 */
+          user->Init(__epollfd_, connfd, client_addr);
         }
       } else if (sockfd == sig_sktpipefd[0] &&
                  (events[i].events & EPOLLIN)) {  // 接收到信号
@@ -265,10 +324,13 @@ void Processpool<T>::__RunChild() {
           }
         }
       } else if (events[i].events & EPOLLIN) {  // 客户端的数据
-        users[sockfd].Process();
+        if (sockfd < (int)__users_.size() && __users_[sockfd] != nullptr &&
+            !__users_[sockfd]->Process())
+          __CloseUser(sockfd);
       }
     }
   }
+  T::ReleaseProcess();
   if (close(sktpipefd) < 0 || close(__epollfd_) < 0) {
     LOGERR("close error");
     exit(-1);
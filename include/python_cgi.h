@@ -12,14 +12,20 @@
 
 class PythonCgi : public Cgi {
  public:
-  PythonCgi() { Py_Initialize(); }
-  virtual ~PythonCgi() { Py_Finalize(); };
+  PythonCgi() {}
+  virtual ~PythonCgi() {}
+
+  /* 每个进程只初始化一次解释器，执行代码的子进程 fork 后直接使用 */
+  static void InitProcess() { Py_Initialize(); }
+  static void ReleaseProcess() { Py_Finalize(); }
 
   virtual void Init(int epollfd, int sockfd, const sockaddr_in& client_addr);
-  virtual void Process();
+  virtual bool Process();
 
  private:
-  int __content_length_;
+  int __content_length_;  // 代码的长度，由长度行给出
+  int __scan_idx_;        // 查找长度行结尾时下次开始的位置
+  int __code_idx_;        // 代码的起始位置，还没有读到长度行时为 -1
 };
 
 #endif  //!__COMPILER_CGI__H__
\ No newline at end of file
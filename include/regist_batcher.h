@@ -0,0 +1,85 @@
+#ifndef __REGIST_BATCHER__H__
+#define __REGIST_BATCHER__H__
+
+#include <atomic>
+#include <cassert>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "locker.h"
+#include "sql_connpool.h"
+
+using std::list;
+using std::string;
+using std::vector;
+
+class HttpConn;
+
+/* 一条等待写入数据库的注册请求 */
+struct RegistRequest {
+  string username;
+  string passwd;
+  HttpConn* conn;  // 等待结果的连接
+};
+
+/** 注册请求批量写入器（group commit）
+ * 工作线程把校验通过的注册请求放入队列后立即返回，写入线程每攒够 max_rows 条
+ * 或等待超过 flush_ms 毫秒，就用一个事务把整批请求提交到数据库，
+ * 提交完成后再逐个回调 HttpConn::RegistDone() 完成各个连接的应答 */
+class RegistBatcher {
+ public:
+  static const int kMaxRows = 64;       // 默认每批最多写入的行数
+  static const int kFlushInterval = 5;  // 默认攒批的最长等待时间（毫秒）
+
+  static RegistBatcher* GetInstance();
+
+ public:  // 静态方法
+  static void Init(int max_rows = kMaxRows, int flush_ms = kFlushInterval);
+  static void Stop();
+  /* 注册请求入队，提交完成后由写入线程回调 conn->RegistDone() */
+  static void Append(HttpConn* conn, const char* username, const char* passwd);
+
+  /* 取值函数，供统计使用 */
+  uint64_t batches() const { return __batches_; }      // 已提交批次数
+  uint64_t rows() const { return __rows_; }            // 已处理行数
+  uint64_t failed_rows() const { return __failed_; }   // 写入失败的行数
+  uint64_t max_batch() const { return __max_batch_; }  // 最大批次大小
+  uint64_t flush_us() const { return __flush_us_; }    // 提交累计耗时（微秒）
+  size_t pending() const { return __pending_cnt_; }    // 队列中等待的行数
+
+ private:
+  /* 单例模式，禁用构造函数 */
+  RegistBatcher();
+  RegistBatcher(const RegistBatcher&) = delete;
+  RegistBatcher& operator=(const RegistBatcher&) = delete;
+  ~RegistBatcher() {}
+
+  void __InitImp(int max_rows, int flush_ms);
+  void __StopImp();
+  void __AppendImp(HttpConn* conn, const char* username, const char* passwd);
+
+  static void* __Worker(void* arg);
+  void __Run();
+  /* 在一个事务中写入整批请求，ok[i] 为第 i 条是否成功 */
+  void __Flush(vector<RegistRequest>& batch, vector<bool>& ok);
+
+  int __max_rows_;                 // 每批最多写入的行数
+  int __flush_ms_;                 // 攒批的最长等待时间（毫秒）
+  pthread_t __thread_;             // 写入线程
+  bool __running_;                 // 写入线程是否已启动
+  volatile std::atomic<bool> __stop_;  // 是否停止写入线程
+  list<RegistRequest> __queue_;    // 等待写入的请求
+  Locker __queue_locker_;          // 对 __queue_ 的互斥锁
+  Sem __pending_;                  // 队列中的请求数
+
+  std::atomic<uint64_t> __batches_;
+  std::atomic<uint64_t> __rows_;
+  std::atomic<uint64_t> __failed_;
+  std::atomic<uint64_t> __max_batch_;
+  std::atomic<uint64_t> __flush_us_;
+  std::atomic<size_t> __pending_cnt_;
+};
+
+#endif  //!__REGIST_BATCHER__H__
@@ -0,0 +1,126 @@
+#ifndef __SLAB_POOL__H__
+#define __SLAB_POOL__H__
+
+#include <stddef.h>
+
+#include <atomic>
+#include <type_traits>
+
+#include "locker.h"
+
+/** 定长对象池
+ * 每个线程有一个本地空闲链表，取用和归还都不加锁；本地链表为空时从全局链表
+ * 一次取 kBatch 个，本地链表超过 2 * kBatch 个时把 kBatch 个还给全局链表，
+ * 全局链表也为空时一次分配 kSlab 个对象组成一个 slab。
+ * 空闲对象的前 8 个字节用作链表指针，对象不会被构造或析构，
+ * slab 分配后不再释放，占用的内存与同时借出的对象数的峰值成正比 */
+template <typename T>
+class SlabPool {
+ public:
+  static const int kBatch = 32;
+  static const int kSlab = 64;
+
+  /* 借出一个对象，内容是上一个使用者留下的 */
+  static T* Get();
+  /* 归还对象，可以在与 Get 不同的线程中调用 */
+  static void Put(T* obj);
+
+  static size_t allocated() { return __allocated_; }  // 已分配的对象数
+  static size_t in_use() { return __in_use_; }        // 借出的对象数
+
+ private:
+  static_assert(std::is_trivially_destructible<T>::value &&
+                    sizeof(T) >= sizeof(void*),
+                "SlabPool only holds plain buffers");
+
+  struct Node {
+    Node* next;
+  };
+  /* 线程的本地空闲链表，线程退出时其中的对象不再被使用 */
+  struct Local {
+    Node* head = nullptr;
+    int count = 0;
+  };
+
+  static Local& __LocalList() {
+    static thread_local Local local;
+    return local;
+  }
+  static void __Refill(Local& local);
+  static void __Spill(Local& local);
+
+  static Node* __global_;  // 全局空闲链表
+  static Locker __locker_;
+  static std::atomic<size_t> __allocated_;
+  static std::atomic<size_t> __in_use_;
+};
+
+template <typename T>
+typename SlabPool<T>::Node* SlabPool<T>::__global_ = nullptr;
+template <typename T>
+Locker SlabPool<T>::__locker_;
+template <typename T>
+std::atomic<size_t> SlabPool<T>::__allocated_(0);
+template <typename T>
+std::atomic<size_t> SlabPool<T>::__in_use_(0);
+
+template <typename T>
+T* SlabPool<T>::Get() {
+  Local& local = __LocalList();
+  if (local.head == nullptr) __Refill(local);
+  Node* node = local.head;
+  local.head = node->next;
+  --local.count;
+  __in_use_.fetch_add(1, std::memory_order_relaxed);
+  return reinterpret_cast<T*>(node);
+}
+
+template <typename T>
+void SlabPool<T>::Put(T* obj) {
+  Local& local = __LocalList();
+  Node* node = reinterpret_cast<Node*>(obj);
+  node->next = local.head;
+  local.head = node;
+  ++local.count;
+  __in_use_.fetch_sub(1, std::memory_order_relaxed);
+  if (local.count > 2 * kBatch) __Spill(local);
+}
+
+/* 从全局链表取 kBatch 个对象，不够时先分配新的 slab */
+template <typename T>
+void SlabPool<T>::__Refill(Local& local) {
+  __locker_.Lock();
+  if (__global_ == nullptr) {
+    T* slab = new T[kSlab];
+    for (int i = 0; i < kSlab; ++i) {
+      Node* node = reinterpret_cast<Node*>(&slab[i]);
+      node->next = __global_;
+      __global_ = node;
+    }
+    __allocated_ += kSlab;
+  }
+  for (int i = 0; i < kBatch && __global_ != nullptr; ++i) {
+    Node* node = __global_;
+    __global_ = node->next;
+    node->next = local.head;
+    local.head = node;
+    ++local.count;
+  }
+  __locker_.Unlock();
+}
+
+/* 把 kBatch 个对象还给全局链表 */
+template <typename T>
+void SlabPool<T>::__Spill(Local& local) {
+  Node* first = local.head;
+  Node* last = first;
+  for (int i = 1; i < kBatch; ++i) last = last->next;
+  local.head = last->next;
+  local.count -= kBatch;
+  __locker_.Lock();
+  last->next = __global_;
+  __global_ = first;
+  __locker_.Unlock();
+}
+
+#endif  //!__SLAB_POOL__H__
@@ -3,30 +3,47 @@
 
 #include <mysql/mysql.h>
 
+#include <atomic>
 #include <list>
 #include <string>
 
 #include "common.h"
+#include "histogram.h"
 #include "locker.h"
 
 using std::list;
 using std::string;
 
+/** 数据库连接池
+ * 连接数在 [min_conn, max_conn] 之间伸缩：没有空闲连接且未达上限时新建连接，
+ * 后台线程定期 mysql_ping 空闲连接，失效的重新连接，
+ * 空闲超过 kIdleTimeout 秒的连接在总数大于 min_conn 时关闭 */
 class SqlConnpool {
  public:
+  static const int kAcquireTimeout = 500;  // 默认获取连接的超时时间（毫秒）
+  static const int kIdleTimeout = 60;      // 空闲连接的回收时间（秒）
+  static const int kPingInterval = 10;     // 后台检查空闲连接的间隔（秒）
+
   static SqlConnpool* GetInstance();
 
   /* 取值函数 */
-  int max_conn();   // 返回最大连接数
-  int cur_conn();   // 返回已使用连接数
-  int free_conn();  // 返回空闲连接数
+  int max_conn();     // 返回最大连接数
+  int min_conn();     // 返回最小连接数
+  int cur_conn();     // 返回已使用连接数
+  int free_conn();    // 返回空闲连接数
+  int total_conn();   // 返回已建立的连接数
+  uint64_t timeouts() { return __timeouts_; }  // 获取连接超时的次数
+  /* 获取连接的等待时间（微秒） */
+  const Histogram& wait_histogram() { return __wait_us_; }
 
- public:                                       // 静态方法
-  static MYSQL* GetConnection();               // 获取数据库连接
+ public:  // 静态方法
+  /* 获取数据库连接，最多等待 timeout_ms 毫秒，超时返回 nullptr */
+  static MYSQL* GetConnection(int timeout_ms = kAcquireTimeout);
   static bool ReleaseConnection(MYSQL* conn);  // 释放连接
   static void DestroyPool();                   // 销毁连接池
   static void Init(const string& url, const string& user, const string& passwd,
-                   const string& db_name, int port, int max_conn);
+                   const string& db_name, int port, int min_conn,
+                   int max_conn);
 
  private:
   /* 单例模式，禁用构造函数 */
@@ -35,18 +52,42 @@ class SqlConnpool {
   SqlConnpool& operator=(const SqlConnpool&);
   ~SqlConnpool();
 
-  MYSQL* __GetConnectionImp();
+  /* 空闲连接及其最后一次被归还的时间 */
+  struct IdleConn {
+    MYSQL* conn;
+    time_t last_used;
+  };
+
+  MYSQL* __GetConnectionImp(int timeout_ms);
   bool __ReleaseConnectionImp(MYSQL* conn);
   void __DestroyPoolImp();
   void __InitImp(const string& url, const string& user, const string& passwd,
-                 const string& db_name, int port, int max_conn);
+                 const string& db_name, int port, int min_conn, int max_conn);
+
+  /* 建立一个新连接，失败返回 nullptr */
+  MYSQL* __Connect();
+  /* 取出一个空闲连接，调用前需已获得 __reserve_ */
+  MYSQL* __PopFree();
+
+  /* 后台维护线程：检查、重连、回收空闲连接 */
+  static void* __Keeper(void* arg);
+  void __Keep();
 
-  int __max_conn_;            // 最大连接数
-  int __cur_conn_;            // 已使用连接数
-  int __free_conn_;           // 空闲连接数
-  Locker __lock_;             // 锁
-  list<MYSQL*> __conn_list_;  // 连接池
-  Sem __reserve_;             // 信号量
+  int __max_conn_;                // 最大连接数
+  int __min_conn_;                // 最小连接数
+  int __total_conn_;              // 已建立的连接数（含正在新建的）
+  int __cur_conn_;                // 已使用连接数
+  int __free_conn_;               // 空闲连接数
+  int __port_;                    // 端口号
+  Locker __lock_;                 // 锁
+  list<IdleConn> __conn_list_;    // 空闲连接，最近归还的在前面
+  Sem __reserve_;                 // 信号量，值为空闲连接数
+  Sem __keeper_wake_;             // 用于提前唤醒维护线程
+  pthread_t __keeper_;            // 维护线程
+  bool __running_;                // 维护线程是否在运行
+  volatile std::atomic<bool> __stop_;  // 是否停止维护线程
+  std::atomic<uint64_t> __timeouts_;   // 获取连接超时的次数
+  Histogram __wait_us_;                // 获取连接的等待时间
 
  public:
   string url_;      // 主机地址
@@ -65,4 +106,4 @@ class ConnectionRaii {
   MYSQL* conn_raii;
 };
 
-#endif  //!__SQL_CONNPOOL__H__
\ No newline at end of file
+#endif  //!__SQL_CONNPOOL__H__
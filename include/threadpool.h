@@ -32,15 +32,20 @@ class Threadpool {
   void __Run();
 
  public:
-  Threadpool(int thread_number = 8, int max_request = 1000);
+  /* cpus 不为空时，第 i 个线程绑定到 cpus[i % cpus.size()] 上 */
+  Threadpool(int thread_number = 8, int max_request = 1000,
+             const vector<int>& cpus = vector<int>());
   ~Threadpool();
 
-  /* 往请求队列中添加任务 */
+  /* 往请求队列中添加任务，队列已满时返回 false，由调用者决定如何处理 */
   bool Append(T* request);
+  /* 请求队列中等待处理的任务数 */
+  size_t queue_size();
 };
 
 template <typename T>
-Threadpool<T>::Threadpool(int thread_number, int max_request)
+Threadpool<T>::Threadpool(int thread_number, int max_request,
+                          const vector<int>& cpus)
     : __threads_(thread_number) {
   __thread_number_ = thread_number;
   __max_requests_ = max_request;
@@ -55,6 +60,10 @@ Threadpool<T>::Threadpool(int thread_number, int max_request)
       LOGERR("pthread_create error");
       exit(-1);
     }
+    if (!cpus.empty() && PinThread(__threads_[i], cpus[i % cpus.size()]) < 0) {
+      LOGERR("PinThread error");
+      exit(-1);
+    }
     if (pthread_detach(__threads_[i]) < 0) {
       LOGERR("pthread_detach error");
       exit(-1);
@@ -69,16 +78,25 @@ Threadpool<T>::~Threadpool() {
 
 template <typename T>
 bool Threadpool<T>::Append(T* request) {
-  if (__jobs_.size() > __max_requests_) {
+  __jobs_locker_.Lock();
+  if (__jobs_.size() >= __max_requests_) {
+    __jobs_locker_.Unlock();
     return false;
   }
-  __jobs_locker_.Lock();
   __jobs_.push_back(request);
   __jobs_locker_.Unlock();
   __jobs_stat_.Post();
   return true;
 }
 
+template <typename T>
+size_t Threadpool<T>::queue_size() {
+  __jobs_locker_.Lock();
+  size_t size = __jobs_.size();
+  __jobs_locker_.Unlock();
+  return size;
+}
+
 template <typename T>
 void* Threadpool<T>::__Worker(void* arg) {
   Threadpool* pool = (Threadpool*)arg;
@@ -1,45 +1,48 @@
 #ifndef __TIMER__H__
 #define __TIMER__H__
 
-#include <netinet/in.h>
+#include <stdint.h>
 #include <time.h>
 
-#include <algorithm>
 #include <memory>
-#include <string>
+#include <utility>
 #include <vector>
 
-class Timer;
-
-struct TimerClientData {
-  sockaddr_in addr;
-  int epollfd;
-  int sockfd;
-  std::string str_data;
-  std::shared_ptr<Timer> timer;
-};
-
 class Timer {
  public:
-  time_t expire_;
-  void (*cb_func_)(TimerClientData*);
-  TimerClientData* user_data_;
+  uint64_t expire_;                // 到期时间，单调时钟的毫秒数
+  void (*cb_func_)(uint64_t);      // 到期时以 user_data_ 为参数调用
+  uint64_t user_data_;             // 用户数据，按值保存
 
-  Timer(int delay);
+  Timer(int delay_ms);
+
+ private:
+  friend class TimerHeap;
+  int __index_;  // 在堆中的位置，不在堆中时为 -1
 };
 
+/** 定时器最小堆
+ * 每个定时器记录自己在堆中的位置，删除与调整到期时间都是 O(log n)，
+ * 堆中只有仍然有效的定时器。不加锁，只能在拥有它的事件循环线程中使用 */
 class TimerHeap {
  public:
   typedef std::shared_ptr<Timer> TimerPtr;
 
   TimerHeap(size_t capacity);
-  TimerHeap(const std::vector<TimerPtr>& heap);
 
   void AddTimer(const TimerPtr& timer);
+  /* 删除定时器，不在堆中时什么也不做 */
   void DelTimer(const TimerPtr& timer);
+  /* 把定时器的到期时间改为 delay_ms 毫秒之后，不在堆中时加入堆 */
+  void AdjustTimer(const TimerPtr& timer, int delay_ms);
   const TimerPtr Top() const;
   void PopTimer();
+  /* 调用所有已到期定时器的回调函数 */
   void Tick();
+  /* 最早的到期时间，堆为空时返回 0 */
+  uint64_t NextExpire() const {
+    return __heap_.empty() ? 0 : __heap_[0]->expire_;
+  }
 
   size_t size() { return __heap_.size(); }
   size_t capacity() { return __heap_.capacity(); }
@@ -47,7 +50,20 @@ class TimerHeap {
  private:
   std::vector<TimerPtr> __heap_;
 
-  static bool __compare(const TimerPtr& lhs, const TimerPtr& rhs);
+  void __Remove(int index);
+  void __SiftUp(int index);
+  void __SiftDown(int index);
+  void __Place(int index, TimerPtr timer) {
+    timer->__index_ = index;
+    __heap_[index] = std::move(timer);
+  }
 };
 
-#endif  //!__TIMER__H__
\ No newline at end of file
+/* 单调时钟的当前时间，单位为毫秒 */
+inline uint64_t NowMs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+#endif  //!__TIMER__H__
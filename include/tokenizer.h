@@ -0,0 +1,34 @@
+#ifndef __TOKENIZER__H__
+#define __TOKENIZER__H__
+
+/** HTTP 请求报文的分词
+ * 按 CPU 支持的指令集在运行时选择实现：AVX2 每次比较 32 字节，
+ * SSE4.2 用 pcmpestri 每次比较 16 字节，否则逐字节比较，
+ * 各实现只读取 [begin, end) 内的字节，不足一次向量宽度的尾部逐字节处理 */
+struct Tokenizer {
+  const char* name;
+  /* 在 [begin, end) 中查找第一个 '\r' 或 '\n'，没有则返回 end；
+   * colon 不为 NULL 且 *colon 为 NULL 时，在同一遍扫描中
+   * 把行尾之前的第一个 ':' 记录到 *colon */
+  const char* (*find_line_end)(const char* begin, const char* end,
+                               const char** colon);
+  /* 在 [begin, end) 中查找第一个 ' ' 或 '\t'，没有则返回 end */
+  const char* (*find_space)(const char* begin, const char* end);
+};
+
+/* 当前使用的实现，启动时选择 CPU 支持的最快实现 */
+extern const Tokenizer* g_tokenizer;
+
+/* 按名称（"avx2"、"sse4.2"、"scalar"）查找实现，CPU 不支持时返回 NULL */
+const Tokenizer* GetTokenizer(const char* name);
+
+inline const char* FindLineEnd(const char* begin, const char* end,
+                               const char** colon = nullptr) {
+  return g_tokenizer->find_line_end(begin, end, colon);
+}
+
+inline const char* FindSpace(const char* begin, const char* end) {
+  return g_tokenizer->find_space(begin, end);
+}
+
+#endif  //!__TOKENIZER__H__
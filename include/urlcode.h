@@ -1,61 +1,124 @@
-#include <assert.h>
-
-#include <cstring>
-#include <string>
-
-inline unsigned char ToHex(unsigned char x) { return x > 9 ? x + 55 : x + 48; }
-
-inline unsigned char FromHex(unsigned char x) {
-  unsigned char y;
-  if (x >= 'A' && x <= 'Z')
-    y = x - 'A' + 10;
-  else if (x >= 'a' && x <= 'z')
-    y = x - 'a' + 10;
-  else if (x >= '0' && x <= '9')
-    y = x - '0';
-  else
-    assert(0);
-  return y;
+#ifndef __URLCODE__H__
+#define __URLCODE__H__
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* 按字节查询的表 */
+struct UrlTable {
+  int8_t v[256];
+};
+
+/* 十六进制字符对应的数值，其他字符为 -1 */
+constexpr UrlTable BuildHexTable() {
+  UrlTable t{};
+  for (int c = 0; c < 256; ++c) {
+    if (c >= '0' && c <= '9')
+      t.v[c] = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      t.v[c] = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      t.v[c] = c - 'A' + 10;
+    else
+      t.v[c] = -1;
+  }
+  return t;
+}
+
+/* 编码时原样保留的字符：字母、数字和 "-_.*" */
+constexpr UrlTable BuildUnreservedTable() {
+  UrlTable t{};
+  for (int c = 0; c < 256; ++c) {
+    t.v[c] = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+             (c >= 'A' && c <= 'Z') || c == '-' || c == '_' || c == '.' ||
+             c == '*';
+  }
+  return t;
 }
 
-inline int UrlEncode(const char* str, char* buf, size_t bufsize) {
-  size_t length = strlen(str);
-  size_t cur = 0;
-  for (size_t i = 0; i < length; i++, cur++) {
-    if (cur == bufsize - 1) return -1;
-    if (isalnum((unsigned char)str[i]) || (str[i] == '-') || (str[i] == '_') ||
-        (str[i] == '.') || (str[i] == '*'))
-      buf[cur] = str[i];
-    else if (str[i] == ' ')
-      buf[cur] = '+';
-    else {
-      if (cur == bufsize - 3) return -1;
-      buf[cur] = '%';
-      cur += 1;
-      buf[cur] = ToHex((unsigned char)str[i] >> 4);
-      cur += 1;
-      buf[cur] = ToHex((unsigned char)str[i] % 16);
+inline constexpr UrlTable kHexTable = BuildHexTable();
+inline constexpr UrlTable kUnreservedTable = BuildUnreservedTable();
+inline constexpr char kHexDigits[] = "0123456789ABCDEF";
+
+/** 解码 src 开始的 len 字节，'+' 解码为空格，结果写入容量为 bufsize 的 buf
+ * 并以 '\0' 结尾，返回解码后的长度；buf 不足，或 '%' 后不是两个十六进制字符
+ * 时返回 -1。buf 可以与 src 相同，即原地解码。
+ * 没有 '%' 和 '+' 的片段每次按 16 字节整块复制 */
+inline int UrlDecode(const char* src, size_t len, char* buf, size_t bufsize) {
+  if (bufsize == 0) return -1;
+  const char* end = src + len;
+  char* out = buf;
+  char* out_end = buf + bufsize - 1;  // 留出结尾的 '\0'
+#ifdef __SSE2__
+  const __m128i percent = _mm_set1_epi8('%');
+  const __m128i plus = _mm_set1_epi8('+');
+#endif
+  while (src < end) {
+#ifdef __SSE2__
+    if (end - src >= 16 && out_end - out >= 16) {
+      __m128i data = _mm_loadu_si128((const __m128i*)src);
+      int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(data, percent),
+                                                _mm_cmpeq_epi8(data, plus)));
+      if (mask == 0) {
+        /* 原地解码时 out <= src，先读后写不会覆盖还没读的数据 */
+        _mm_storeu_si128((__m128i*)out, data);
+        src += 16;
+        out += 16;
+        continue;
+      }
+      int n = __builtin_ctz(mask);
+      memmove(out, src, n);
+      src += n;
+      out += n;
+    }
+#endif
+    if (out == out_end) return -1;
+    if (*src == '%') {
+      if (end - src < 3) return -1;
+      int high = kHexTable.v[(unsigned char)src[1]];
+      int low = kHexTable.v[(unsigned char)src[2]];
+      if ((high | low) < 0) return -1;
+      *out++ = high << 4 | low;
+      src += 3;
+    } else {
+      *out++ = *src == '+' ? ' ' : *src;
+      ++src;
     }
   }
-  buf[cur] = '\0';
-  return 0;
+  *out = '\0';
+  return out - buf;
 }
 
-inline int UrlDecode(const char* str, char* buf, size_t bufsize) {
-  size_t length = strlen(str);
-  size_t cur = 0;
-  for (size_t i = 0; i < length; i++, cur++) {
-    if (cur == bufsize - 1) return -1;
-    if (str[i] == '+')
-      buf[cur] = ' ';
-    else if (str[i] == '%') {
-      assert(i + 2 < length);
-      unsigned char high = FromHex((unsigned char)str[++i]);
-      unsigned char low = FromHex((unsigned char)str[++i]);
-      buf[cur] = high * 16 + low;
-    } else
-      buf[cur] = str[i];
+/* 原地解码 str 开始的 len 字节，str[len] 必须可写，返回值同 UrlDecode */
+inline int UrlDecodeInPlace(char* str, size_t len) {
+  return UrlDecode(str, len, str, len + 1);
+}
+
+/** 编码 src 开始的 len 字节，空格编码为 '+'，结果写入容量为 bufsize 的 buf
+ * 并以 '\0' 结尾，返回编码后的长度，buf 不足时返回 -1 */
+inline int UrlEncode(const char* src, size_t len, char* buf, size_t bufsize) {
+  if (bufsize == 0) return -1;
+  char* out = buf;
+  char* out_end = buf + bufsize - 1;  // 留出结尾的 '\0'
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char c = src[i];
+    if (kUnreservedTable.v[c] || c == ' ') {
+      if (out == out_end) return -1;
+      *out++ = c == ' ' ? '+' : c;
+    } else {
+      if (out_end - out < 3) return -1;
+      out[0] = '%';
+      out[1] = kHexDigits[c >> 4];
+      out[2] = kHexDigits[c & 15];
+      out += 3;
+    }
   }
-  buf[cur] = '\0';
-  return 0;
+  *out = '\0';
+  return out - buf;
 }
+
+#endif  //!__URLCODE__H__
@@ -0,0 +1,716 @@
+#include <getopt.h>
+#include <libgen.h>
+#include <sched.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "capture.h"
+#include "common.h"
+#include "http_conn.h"
+#include "logger.h"
+#include "slab_pool.h"
+#include "threadpool.h"
+#include "timer.h"
+#include "tokenizer.h"
+#include "urlcode.h"
+
+using std::string;
+using std::vector;
+
+/** 热路径组件的微基准测试
+ * 每项测试先逐步加倍操作次数，直到一轮耗时超过 kCalibrateNs，
+ * 再按估计的速度运行约 min_time 秒，结果以 JSON 输出 ns/op 和 ops/sec */
+
+static const uint64_t kCalibrateNs = 10000000;  // 校准时一轮的最短耗时
+
+static double min_time = 1;          // 每项测试的运行时间（秒）
+static const char* filter = NULL;    // 只运行名称包含该字符串的测试
+static bool first_result = true;
+
+/* 单调时钟（纳秒） */
+static inline uint64_t NowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* 防止编译器优化掉没有被使用的结果 */
+static volatile uint64_t sink;
+
+/** 运行一项测试，body(n) 执行 n 次操作
+ * extra 为附加在结果中的 JSON 字段，在测试结束后调用 */
+static void Run(const string& name, std::function<void(uint64_t)> body,
+                std::function<string()> extra = nullptr) {
+  if (filter && name.find(filter) == string::npos) return;
+  fprintf(stderr, "running %s\n", name.c_str());
+
+  uint64_t n = 1, elapsed = 0;
+  for (;;) {
+    uint64_t start = NowNs();
+    body(n);
+    elapsed = NowNs() - start;
+    if (elapsed >= kCalibrateNs) break;
+    n *= elapsed > 0 && kCalibrateNs / elapsed < 10 ? 2 : 10;
+  }
+  uint64_t target = min_time * 1e9 * n / elapsed;
+  if (target > n) {
+    n = target;
+    uint64_t start = NowNs();
+    body(n);
+    elapsed = NowNs() - start;
+  }
+
+  double ns_per_op = (double)elapsed / n;
+  printf("%s\n    {\"name\": \"%s\", \"iterations\": %lu, "
+         "\"ns_per_op\": %.2f, \"ops_per_sec\": %.0f",
+         first_result ? "" : ",", name.c_str(), (unsigned long)n, ns_per_op,
+         1e9 / ns_per_op);
+  if (extra) printf(", %s", extra().c_str());
+  printf("}");
+  fflush(stdout);
+  first_result = false;
+}
+
+/* 访问 HttpConn 的私有成员，单独测试解析请求的各个步骤 */
+class HttpConnBench {
+ public:
+  HttpConnBench() : __conn_(new HttpConn()) { __conn_->__AttachBuf(); }
+
+  /* 像服务器读到一个新请求时那样初始化连接并填充读缓冲区 */
+  void Load(const string& request) {
+    __conn_->__Init();
+    memcpy(__conn_->__buf_->read, request.data(), request.size());
+    __conn_->__read_idx_ = request.size();
+    __conn_->__buf_->read[request.size()] = '\0';
+  }
+  /* 只重新填充读缓冲区，__ParseLine 会把行尾改为 '\0' */
+  void Refill(const string& request) {
+    memcpy(__conn_->__buf_->read, request.data(), request.size());
+    __conn_->__read_idx_ = request.size();
+    __conn_->__cur_idx_ = 0;
+    __conn_->__start_line_ = 0;
+    __conn_->__colon_ = -1;
+  }
+  /* 切分缓冲区中的所有行，返回行数 */
+  int ParseLines() {
+    int lines = 0;
+    while (__conn_->__ParseLine() == HttpConn::LINE_OK) {
+      __conn_->__start_line_ = __conn_->__cur_idx_;
+      __conn_->__colon_ = -1;
+      ++lines;
+    }
+    return lines;
+  }
+  /* 只解析请求行和头部，与 BaselineParser 对比 */
+  HttpConn::HttpCode_ Parse() { return __conn_->__ProcessRead(); }
+  /* 像服务器那样解析并处理请求，不包括填充应答 */
+  HttpConn::HttpCode_ ProcessRead() {
+    HttpConn::HttpCode_ ret = __conn_->__ProcessRead();
+    if (ret == HttpConn::GET_REQUEST) ret = __conn_->__Route();
+    if (ret == HttpConn::GET_REQUEST)
+      ret = __conn_->__DoRequest(__conn_->__content_);
+    return ret;
+  }
+  /* 让连接使用已加入 epoll 事件表的 fd，令牌为 1 */
+  void Attach(int fd) {
+    __conn_->__DetachBuf();
+    __conn_->__sockfd_ = fd;
+    __conn_->__token_ = 1;
+    __conn_->__Init();
+  }
+  /* 像主线程那样读一个请求，再写出 len 字节的应答并保持连接 */
+  template <typename Io>
+  bool RoundTrip(const char* response, int len) {
+    if (!__conn_->Read<Io>()) return false;
+    __conn_->__iov_[0].iov_base = (void*)response;
+    __conn_->__iov_[0].iov_len = len;
+    __conn_->__iov_cnt_ = 1;
+    __conn_->__bytes_to_send_ = len;
+    __conn_->__bytes_have_sent_ = 0;
+    __conn_->__linger_ = true;
+    return __conn_->Write<Io>();
+  }
+  /* 与 __DoFile 相同的查找方式 */
+  static File* Lookup(const char* file) {
+    if (HttpConn::__resources_.count(file) == 0) return NULL;
+    return &HttpConn::__resources_[file];
+  }
+
+ private:
+  std::unique_ptr<HttpConn> __conn_;
+};
+
+/* 没有抓包文件时使用的请求，取自浏览器访问示例页面时的实际请求 */
+static const char* kBrowserRequests[] = {
+    "GET / HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9006\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, "
+    "like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/"
+    "avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "\r\n",
+
+    "GET /wechat.png HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9006\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, "
+    "like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/"
+    "*;q=0.8\r\n"
+    "Referer: http://127.0.0.1:9006/picture.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "\r\n",
+
+    "GET /monster.png HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9006\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 "
+    "Firefox/118.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Range: bytes=0-65535\r\n"
+    "Referer: http://127.0.0.1:9006/picture.html\r\n"
+    "\r\n",
+
+    "POST /sqllogin HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9006\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Length: 28\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Origin: http://127.0.0.1:9006\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, "
+    "like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Referer: http://127.0.0.1:9006/login.html\r\n"
+    "\r\n"
+    "user=admin&password=admin123",
+
+    "GET /%E4%B8%AD%E6%96%87/%E9%A1%B5%E9%9D%A2.html?from=%E9%A6%96%E9%A1%B5 "
+    "HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9006\r\n"
+    "Connection: close\r\n"
+    "User-Agent: curl/7.81.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+};
+
+/** 请求是否可以在基准测试中重复解析
+ * 注册、运行 Python 和统计信息的请求会写数据库、创建进程或渲染全部指标，
+ * 不属于解析器的开销，跳过 */
+static bool Replayable(const string& request) {
+  size_t begin = request.find(' ');
+  if (begin == string::npos) return false;
+  size_t end = request.find_first_of(" ?", begin + 1);
+  if (end == string::npos) return false;
+  string url = request.substr(begin + 1, end - begin - 1);
+  if (url == "/__stats") return false;
+  string basename = url.substr(url.rfind('/') + 1);
+  return basename != "sqlregister" && basename != "run";
+}
+
+/* 从抓包文件中取出请求，超过读缓冲区大小的请求服务器无法处理，同样跳过 */
+static vector<string> LoadCorpus(const char* capture_file) {
+  vector<string> corpus;
+  if (capture_file == NULL) {
+    for (const char* request : kBrowserRequests) corpus.push_back(request);
+    return corpus;
+  }
+  vector<CaptureSession> sessions;
+  uint64_t truncated = 0;
+  if (!LoadCapture(capture_file, &sessions, &truncated)) {
+    fprintf(stderr, "Invalid capture file: %s\n", capture_file);
+    exit(1);
+  }
+  for (const auto& session : sessions) {
+    for (const auto& request : session.requests) {
+      if ((int)request.size() < HttpConn::kReadBufSize_ &&
+          Replayable(request)) {
+        corpus.push_back(request);
+      }
+    }
+  }
+  if (corpus.empty()) {
+    fprintf(stderr, "No usable request in %s\n", capture_file);
+    exit(1);
+  }
+  return corpus;
+}
+
+/** 改用分词器之前的请求解析器，作为解析测试的基准
+ * 逐字节查找行尾，用 strpbrk 切分请求行，用 strncasecmp 逐个比较头部名称，
+ * 与原来的 HttpConn 相同，只去掉了日志 */
+class BaselineParser {
+ public:
+  enum CheckState { REQUESTLINE, HEADER, CONTENT };
+  enum LineState { LINE_OK, LINE_BAD, LINE_OPEN };
+  enum HttpCode { NO_REQUEST, GET_REQUEST, BAD_REQUEST };
+
+  void Load(const string& request) {
+    memcpy(__buf_, request.data(), request.size());
+    __buf_[request.size()] = '\0';
+    __read_idx_ = request.size();
+    __cur_idx_ = 0;
+    __start_line_ = 0;
+    __check_state_ = REQUESTLINE;
+    __linger_ = false;
+    __content_length_ = 0;
+    __host_ = __url_ = __version_ = NULL;
+    __range_start_ = __range_end_ = 0;
+  }
+  /* 切分缓冲区中的所有行，返回行数 */
+  int ParseLines() {
+    int lines = 0;
+    while (__ParseLine() == LINE_OK) {
+      __start_line_ = __cur_idx_;
+      ++lines;
+    }
+    return lines;
+  }
+  /* 主状态机 */
+  HttpCode ProcessRead() {
+    LineState line_status = LINE_OK;
+    HttpCode ret = NO_REQUEST;
+    while ((__check_state_ == CONTENT && line_status == LINE_OK) ||
+           ((line_status = __ParseLine()) == LINE_OK)) {
+      char* text = __buf_ + __start_line_;
+      __start_line_ = __cur_idx_;
+      switch (__check_state_) {
+        case REQUESTLINE:
+          ret = __ParseRequestLine(text);
+          if (ret == BAD_REQUEST) return BAD_REQUEST;
+          break;
+        case HEADER:
+          ret = __ParseHeaders(text);
+          if (ret != NO_REQUEST) return ret;
+          break;
+        case CONTENT:
+          if (__read_idx_ >= __content_length_ + __cur_idx_) {
+            text[__content_length_] = '\0';
+            return GET_REQUEST;
+          }
+          line_status = LINE_OPEN;
+          break;
+      }
+    }
+    return NO_REQUEST;
+  }
+
+ private:
+  LineState __ParseLine() {
+    for (; __cur_idx_ < __read_idx_; ++__cur_idx_) {
+      char tmp = __buf_[__cur_idx_];
+      if (tmp == '\r') {
+        if (__cur_idx_ + 1 == __read_idx_) return LINE_OPEN;
+        if (__buf_[__cur_idx_ + 1] == '\n') {
+          __buf_[__cur_idx_++] = '\0';
+          __buf_[__cur_idx_++] = '\0';
+          return LINE_OK;
+        }
+        return LINE_BAD;
+      } else if (tmp == '\n') {
+        if (__cur_idx_ > 1 && __buf_[__cur_idx_ - 1] == '\r') {
+          __buf_[__cur_idx_ - 1] = '\0';
+          __buf_[__cur_idx_++] = '\0';
+          return LINE_OK;
+        }
+        return LINE_BAD;
+      }
+    }
+    return LINE_OPEN;
+  }
+  HttpCode __ParseRequestLine(char* text) {
+    __url_ = strpbrk(text, " \t");
+    if (!__url_) return BAD_REQUEST;
+    *(__url_++) = '\0';
+    if (strcasecmp(text, "GET") != 0 && strcasecmp(text, "POST") != 0)
+      return BAD_REQUEST;
+    __url_ += strspn(__url_, " \t");
+    __version_ = strpbrk(__url_, " \t");
+    if (!__version_) return BAD_REQUEST;
+    *(__version_++) = '\0';
+    __version_ += strspn(__version_, " \t");
+    if (strcasecmp(__version_, "HTTP/1.1") != 0) return BAD_REQUEST;
+    if (strncasecmp(__url_, "http://", 7) == 0) {
+      __url_ += 7;
+      __url_ = strchr(__url_, '/');
+    }
+    if (!__url_ || __url_[0] != '/') return BAD_REQUEST;
+    __check_state_ = HEADER;
+    return NO_REQUEST;
+  }
+  HttpCode __ParseHeaders(char* text) {
+    if (text[0] == '\0') {
+      if (__content_length_ != 0) {
+        __check_state_ = CONTENT;
+        return NO_REQUEST;
+      }
+      return GET_REQUEST;
+    } else if (strncasecmp(text, "Connection:", 11) == 0) {
+      text += 11;
+      text += strspn(text, " \t");
+      if (strcasecmp(text, "keep-alive") == 0) __linger_ = true;
+    } else if (strncasecmp(text, "Content-Length:", 15) == 0) {
+      text += 15;
+      text += strspn(text, " \t");
+      __content_length_ = atol(text);
+    } else if (strncasecmp(text, "Host:", 5) == 0) {
+      text += 5;
+      text += strspn(text, " \t");
+      __host_ = text;
+    } else if (strncasecmp(text, "Range:", 6) == 0) {
+      text += 6;
+      text += strspn(text, " \t");
+      text += strspn(text, "bytes=");
+      if (*text == '-') {
+        __range_start_ = -1;
+        __range_end_ = atol(text + 1);
+      } else {
+        __range_start_ = atol(text);
+        text += strcspn(text, "-") + 1;
+        __range_end_ = *text == '\0' ? -1 : atol(text);
+      }
+    }
+    return NO_REQUEST;
+  }
+
+  char __buf_[HttpConn::kReadBufSize_ + 1];
+  long __read_idx_, __cur_idx_, __start_line_;
+  CheckState __check_state_;
+  bool __linger_;
+  long __content_length_;
+  char *__host_, *__url_, *__version_;
+  long __range_start_, __range_end_;
+};
+
+/* 线程池测试用的空任务 */
+struct NopJob {
+  std::atomic<uint64_t>* done;
+  void Process() { done->fetch_add(1, std::memory_order_relaxed); }
+};
+
+static void NopCallback(uint64_t) {}
+
+static void BenchHttp(const vector<string>& corpus) {
+  HttpConnBench conn;
+  uint64_t bytes = 0;
+  for (const auto& request : corpus) bytes += request.size();
+  double avg_bytes = (double)bytes / corpus.size();
+  auto corpus_info = [&] {
+    char buf[128];
+    snprintf(buf, sizeof(buf),
+             "\"corpus_requests\": %zu, \"avg_request_bytes\": %.1f",
+             corpus.size(), avg_bytes);
+    return string(buf);
+  };
+
+  /* 原来的解析器，作为下面各项的基准 */
+  BaselineParser baseline;
+  Run("http_parse_line/baseline",
+      [&](uint64_t n) {
+        uint64_t lines = 0;
+        for (uint64_t i = 0; i < n; ++i) {
+          baseline.Load(corpus[i % corpus.size()]);
+          lines += baseline.ParseLines();
+        }
+        sink = lines;
+      },
+      corpus_info);
+  Run("http_parse_request/baseline",
+      [&](uint64_t n) {
+        uint64_t codes = 0;
+        for (uint64_t i = 0; i < n; ++i) {
+          baseline.Load(corpus[i % corpus.size()]);
+          codes += baseline.ProcessRead();
+        }
+        sink = codes;
+      },
+      corpus_info);
+
+  /* 分别使用 CPU 支持的各种分词实现，scalar 即逐字节扫描 */
+  const Tokenizer* best = g_tokenizer;
+  for (const char* name : {"scalar", "sse4.2", "avx2"}) {
+    g_tokenizer = GetTokenizer(name);
+    if (g_tokenizer == NULL) continue;
+    Run(string("http_parse_line/") + name,
+        [&](uint64_t n) {
+          uint64_t lines = 0;
+          for (uint64_t i = 0; i < n; ++i) {
+            conn.Refill(corpus[i % corpus.size()]);
+            lines += conn.ParseLines();
+          }
+          sink = lines;
+        },
+        corpus_info);
+
+    Run(string("http_parse_request/") + name,
+        [&](uint64_t n) {
+          uint64_t codes = 0;
+          for (uint64_t i = 0; i < n; ++i) {
+            conn.Load(corpus[i % corpus.size()]);
+            codes += conn.Parse();
+          }
+          sink = codes;
+        },
+        corpus_info);
+
+    Run(string("http_process_read/") + name,
+        [&](uint64_t n) {
+          uint64_t codes = 0;
+          for (uint64_t i = 0; i < n; ++i) {
+            conn.Load(corpus[i % corpus.size()]);
+            codes += conn.ProcessRead();
+          }
+          sink = codes;
+        },
+        corpus_info);
+  }
+  g_tokenizer = best;
+}
+
+/* 按浏览器请求中常见的头部名称查找编号，包括未知的头部 */
+static void BenchHeaderLookup() {
+  static const std::string_view names[] = {
+      "Host",   "Connection",      "User-Agent",      "Accept",
+      "Cookie", "Accept-Encoding", "Accept-Language", "Sec-Fetch-Mode",
+  };
+  Run("http_header_lookup", [&](uint64_t n) {
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+      total += HttpConn::LookupHeader(names[i % 8]);
+    }
+    sink = total;
+  });
+}
+
+static void BenchUrlcode() {
+  static const char* encoded[] = {
+      "/index.html",
+      "/%E4%B8%AD%E6%96%87/%E9%A1%B5%E9%9D%A2.html?from=%E9%A6%96%E9%A1%B5",
+      "/search?q=hello+world&lang=zh-CN&page=2",
+  };
+  static const char* plain[] = {
+      "/index.html",
+      "/中文/页面.html?from=首页",
+      "/search?q=hello world&lang=zh-CN&page=2",
+  };
+  size_t encoded_len[3], plain_len[3];
+  for (int i = 0; i < 3; ++i) {
+    encoded_len[i] = strlen(encoded[i]);
+    plain_len[i] = strlen(plain[i]);
+  }
+  char buf[HttpConn::kFileNameLen_];
+
+  Run("urldecode", [&](uint64_t n) {
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+      total += UrlDecode(encoded[i % 3], encoded_len[i % 3], buf, sizeof(buf));
+    }
+    sink = total;
+  });
+  Run("urlencode", [&](uint64_t n) {
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+      total += UrlEncode(plain[i % 3], plain_len[i % 3], buf, sizeof(buf));
+    }
+    sink = total;
+  });
+}
+
+/** 模拟 kConns 个连接轮流收到数据而推后定时器，
+ * 每 kTickEvery 次操作调用一次 Tick，每次有一个定时器到期后被重新加入，
+ * 覆盖了主线程每轮事件循环中定时器的全部开销 */
+static void BenchTimer() {
+  static const int kConns = 10000;
+  static const int kTickEvery = 1000;
+  static const int kDelayMs = 600 * 1000;
+  TimerHeap heap(kConns);
+  vector<TimerHeap::TimerPtr> timers(kConns);
+  for (int i = 0; i < kConns; ++i) {
+    timers[i] = std::make_shared<Timer>(kDelayMs);
+    timers[i]->cb_func_ = NopCallback;
+    heap.AddTimer(timers[i]);
+  }
+
+  Run("timer_reset_tick", [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; ++i) {
+      heap.AdjustTimer(timers[i % kConns], kDelayMs);
+      if (i % kTickEvery == kTickEvery - 1) {
+        heap.AdjustTimer(timers[(i * 7) % kConns], 0);
+        heap.Tick();
+        heap.AddTimer(timers[(i * 7) % kConns]);
+      }
+    }
+    sink = heap.size();
+  });
+}
+
+/** 主线程不断 Append 空任务，直到所有任务执行完，
+ * 测量的是请求队列的锁、信号量和唤醒工作线程的开销 */
+static void BenchThreadpool() {
+  static const int kThreads[] = {1, 2, 4, 8};
+  for (int threads : kThreads) {
+    /* 线程池的工作线程无法退出，测试结束后不释放 */
+    auto pool = new Threadpool<NopJob>(threads, 1 << 30);
+    std::atomic<uint64_t> done(0);
+    NopJob job{&done};
+    uint64_t appended = 0;
+    Run("threadpool_append_" + std::to_string(threads), [&](uint64_t n) {
+      for (uint64_t i = 0; i < n; ++i) {
+        while (!pool->Append(&job)) sched_yield();
+      }
+      appended += n;
+      while (done.load() < appended) sched_yield();
+    });
+  }
+}
+
+/* 日志线程满负荷时 aio 请求会失败，丢弃的条数一并输出 */
+static void BenchLogger() {
+  uint64_t dropped = 0;
+  Run("logger_warn",
+      [&](uint64_t n) {
+        uint64_t before = Logger::Dropped();
+        for (uint64_t i = 0; i < n; ++i) {
+          LOGWARN("bench %lu: GET /index.html 200", (unsigned long)i);
+        }
+        dropped = Logger::Dropped() - before;
+      },
+      [&] { return "\"dropped\": " + std::to_string(dropped); });
+}
+
+/* 请求缓冲区的借用和归还，每次连续借出 16 个再全部归还 */
+static void BenchSlabPool() {
+  struct Buffer {
+    char data[8192];
+  };
+  Buffer* held[16];
+  Run("slab_pool_get_put", [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; i += 16) {
+      for (int j = 0; j < 16; ++j) held[j] = SlabPool<Buffer>::Get();
+      for (int j = 0; j < 16; ++j) SlabPool<Buffer>::Put(held[j]);
+    }
+  });
+}
+
+static void BenchResources() {
+  static const char* files[] = {
+      "root/index.html", "root/picture.html", "root/wechat.png",
+      "root/welcome.html", "root/no_such_file.html",
+  };
+  Run("resources_lookup", [&](uint64_t n) {
+    uint64_t found = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+      found += HttpConnBench::Lookup(files[i % 5]) != NULL;
+    }
+    sink = found;
+  });
+}
+
+/* 在 socketpair 上按两种触发模式各跑一遍 Read/Write，
+ * 比较 ET 多出的一次 EAGAIN 读写与 LT 的差别 */
+template <typename Io>
+static void BenchConnIo(const char* name) {
+  static const char kRequest[] = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+  static char response[4096];
+  char drain[sizeof(response)];
+  int sv[2];
+  int epollfd = epoll_create(5);
+  if (epollfd < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    perror("BenchConnIo");
+    exit(1);
+  }
+  HttpConn::epollfd_ = epollfd;
+  if (AddFd<Io>(epollfd, sv[0], true, 1) < 0) exit(1);
+  HttpConnBench conn;
+  conn.Attach(sv[0]);
+  Run(string("conn_io/") + name, [&](uint64_t n) {
+    uint64_t ok = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+      if (write(sv[1], kRequest, sizeof(kRequest) - 1) < 0) exit(1);
+      ok += conn.RoundTrip<Io>(response, sizeof(response));
+      for (size_t got = 0; got < sizeof(response);) {
+        ssize_t r = read(sv[1], drain, sizeof(drain) - got);
+        if (r <= 0) exit(1);
+        got += r;
+      }
+    }
+    sink = ok;
+  });
+  close(sv[0]);
+  close(sv[1]);
+  close(epollfd);
+}
+
+void usage(const char* name) {
+  printf("Usage: %s [options] [filter]\n", name);
+  printf("  -t, --time <seconds>   time per benchmark, default 1\n");
+  printf("  -C, --corpus <file>    parse requests recorded by server -c "
+         "instead of the built-in browser requests\n");
+  printf("  -L, --log <path>       log directory, default /tmp\n");
+  printf("  filter                 only run benchmarks whose name contains "
+         "it\n");
+  printf("Run from the repository root so that root/ can be found.\n");
+}
+
+static struct option long_options[] = {
+    {"time", required_argument, NULL, 't'},
+    {"corpus", required_argument, NULL, 'C'},
+    {"log", required_argument, NULL, 'L'},
+    {NULL, 0, NULL, 0}};
+
+int main(int argc, char** argv) {
+  const char* corpus_file = NULL;
+  const char* log_path = "/tmp";
+  int c = 0;
+  while ((c = getopt_long(argc, argv, "t:C:L:", long_options, NULL)) != EOF) {
+    switch (c) {
+      case 't':
+        min_time = atof(optarg);
+        break;
+      case 'C':
+        corpus_file = optarg;
+        break;
+      case 'L':
+        log_path = optarg;
+        break;
+      default:
+        usage(basename(argv[0]));
+        return 1;
+    }
+  }
+  if (min_time <= 0 || argc - optind > 1) {
+    usage(basename(argv[0]));
+    return 1;
+  }
+  if (optind < argc) filter = argv[optind];
+
+  /* 与服务器一样格式化 info 日志，但只写出 warning 及以上的 */
+  Logger::Init(kWarning, log_path, false);
+  extern const char* doc_root;
+  HttpConn::InitStaticResource(doc_root);
+  HttpConn::InitMetrics();
+  vector<string> corpus = LoadCorpus(corpus_file);
+
+  printf("{\"benchmarks\": [");
+  BenchHttp(corpus);
+  BenchHeaderLookup();
+  BenchUrlcode();
+  BenchTimer();
+  BenchThreadpool();
+  BenchSlabPool();
+  BenchResources();
+  BenchConnIo<EtPolicy>("et");
+  BenchConnIo<LtPolicy>("lt");
+  BenchLogger();
+  printf("\n]}\n");
+  return 0;
+}
@@ -0,0 +1,99 @@
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <map>
+
+size_t RequestLength(const string& data, size_t pos) {
+  size_t end = data.find("\r\n\r\n", pos);
+  if (end == string::npos) return 0;
+  end += 4;
+  size_t len = end - pos;
+  /* 查找 Content-Length */
+  size_t line = data.find("\r\n", pos);
+  while (line + 2 < end) {
+    line += 2;
+    if (strncasecmp(data.c_str() + line, "Content-Length:", 15) == 0) {
+      const char* value = data.c_str() + line + 15;
+      value += strspn(value, " \t");
+      char* value_end = NULL;
+      long n = strtol(value, &value_end, 10);
+      /* 长度为负或不是数字时无法确定报文边界，按不完整处理，
+       * 之后的数据都计入截断的字节数 */
+      if (value_end == value || n < 0 || !strchr(" \t\r", *value_end))
+        return 0;
+      len += n;
+      break;
+    }
+    line = data.find("\r\n", line);
+  }
+  return pos + len <= data.size() ? len : 0;
+}
+
+bool LoadCapture(const char* file, vector<CaptureSession>* sessions,
+                 uint64_t* truncated) {
+  FILE* fp = fopen(file, "rb");
+  if (fp == NULL) return false;
+  char magic[sizeof(kCaptureMagic)];
+  if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+      memcmp(magic, kCaptureMagic, sizeof(magic)) != 0) {
+    fclose(fp);
+    return false;
+  }
+
+  /* 每个连接收到的数据，以及每段数据的起始位置和到达时间 */
+  struct Stream {
+    uint64_t open_us;
+    uint64_t close_us;
+    bool closed;
+    string data;
+    vector<std::pair<size_t, uint64_t>> chunks;
+  };
+  std::map<uint32_t, Stream> streams;
+  CaptureRecord record;
+  char buf[UINT16_MAX];
+  /* 服务器异常退出时文件末尾可能有不完整的记录，还可能有未写入的空洞
+   * （连接编号为 0），忽略之后的内容即可 */
+  while (fread(&record, sizeof(record), 1, fp) == 1) {
+    if (record.conn == 0) break;
+    if (record.len && fread(buf, record.len, 1, fp) != 1) break;
+    auto it = streams.find(record.conn);
+    if (it == streams.end()) {
+      /* 开始抓包前已经建立的连接从第一条记录算起 */
+      it = streams.emplace(record.conn, Stream{record.time_us, 0, false, "", {}}).first;
+    }
+    Stream& stream = it->second;
+    if (record.type == kCaptureData) {
+      stream.chunks.emplace_back(stream.data.size(), record.time_us);
+      stream.data.append(buf, record.len);
+    } else if (record.type == kCaptureClose) {
+      stream.close_us = record.time_us;
+      stream.closed = true;
+    }
+  }
+  fclose(fp);
+
+  *truncated = 0;
+  for (auto& item : streams) {
+    Stream& stream = item.second;
+    CaptureSession session;
+    session.events.push_back(stream.open_us);
+    size_t pos = 0, chunk = 0;
+    while (size_t len = RequestLength(stream.data, pos)) {
+      while (chunk + 1 < stream.chunks.size() &&
+             stream.chunks[chunk + 1].first <= pos) {
+        ++chunk;
+      }
+      session.events.push_back(stream.chunks[chunk].second);
+      session.requests.push_back(stream.data.substr(pos, len));
+      pos += len;
+    }
+    *truncated += stream.data.size() - pos;
+    if (stream.closed) session.events.push_back(stream.close_us);
+    sessions->push_back(std::move(session));
+  }
+  return true;
+}
@@ -6,74 +6,79 @@ void PythonCgi::Init(int epollfd, int sockfd, const sockaddr_in& client_addr) {
   __sockfd_ = sockfd;
   __addr_ = client_addr;
   __content_length_ = 0;
+  __scan_idx_ = 0;
+  __code_idx_ = -1;
   __ResetBuf();
 }
 
-void PythonCgi::Process() {
-  int idx = 0;
+/* 读取长度行与代码，在子进程中执行代码，输出直接写回客户端；
+ * 代码还没有读完时返回 true 等待更多数据，否则返回 false 由进程池关闭连接 */
+bool PythonCgi::Process() {
   int ret = -1;
 
   while (1) {
-    ret = recv(__sockfd_, __buf_ + __read_idx_, __kBufferSize_ - idx - 1, 0);
+    ret = recv(__sockfd_, __buf_ + __read_idx_,
+               __kBufferSize_ - __read_idx_ - 1, 0);
     if (ret < 0) {
-      /* 若读操作发生错误，则关闭客户端连接；若无数据可读，退出循环 */
+      /* 若读操作发生错误，则关闭客户端连接；若无数据可读，等待下次可读 */
       if (errno != EAGAIN) {
         LOGWARN("recv error");
-        if (RemoveFd(__epollfd_, __sockfd_) < 0) {
-          LOGWARN("RemoveFd error");
-        }
+        return false;
       }
-      break;
+      return true;
     } else if (ret > 0) {
       __read_idx_ += ret;
       // printf("user content is: %s\n", __buf_);
-      for (; idx < __read_idx_; ++idx) {
+      /* 长度行可能分多次到达，从上次停下的位置继续查找 */
+      for (; __code_idx_ < 0 && __scan_idx_ < __read_idx_; ++__scan_idx_) {
         /* 若遇到字符 "\r\n" 则长度信息接收完毕 */
-        if (idx >= 1 && (__buf_[idx - 1] == '\r' && __buf_[idx] == '\n')) {
-          __buf_[idx - 1] = '\0';
+        if (__scan_idx_ >= 1 && (__buf_[__scan_idx_ - 1] == '\r' &&
+                                 __buf_[__scan_idx_] == '\n')) {
+          __buf_[__scan_idx_ - 1] = '\0';
           __content_length_ = atoi(__buf_);
+          __code_idx_ = __scan_idx_ + 1;
           // printf("content length: %d\n", __content_length_);
-          break;
         }
       }
-      /* 若读完还没有遇到字符 '\r\n' 则继续接收 */
-      if (idx == __read_idx_) {
-        if (idx == __kBufferSize_ - 1) {
-          char msg[] = "content overflow\n";
-          printf("user content overflow\n");
-          if (send(__sockfd_, msg, sizeof(msg), 0) < 0) {
-            LOGWARN("send error");
-          }
-          if (RemoveFd(__epollfd_, __sockfd_) < 0) {
-            LOGWARN("RemoveFd error");
-          }
-          break;
+      /* 读满缓冲区还没有长度行，或代码放不下（解码时结尾还要补 '\0'） */
+      bool overflow = __code_idx_ < 0
+                          ? __read_idx_ == __kBufferSize_ - 1
+                          : __content_length_ < 0 ||
+                                __code_idx_ + __content_length_ >
+                                    __kBufferSize_ - 1;
+      if (overflow) {
+        char msg[] = "content overflow\n";
+        printf("user content overflow\n");
+        if (send(__sockfd_, msg, sizeof(msg), 0) < 0) {
+          LOGWARN("send error");
         }
-        continue;
+        return false;
       }
+      /* 若还没有读到长度行或代码还不完整则继续接收 */
+      if (__code_idx_ < 0 || __read_idx_ < __code_idx_ + __content_length_)
+        continue;
       ret = fork();
       if (ret == -1 || ret > 0) {
-        if (RemoveFd(__epollfd_, __sockfd_) < 0) {
-          LOGWARN("RemoveFd error");
-        }
-        /* 一条请求处理完毕，重置缓存 */
+        /* 一条请求处理完毕，重置缓存，子进程持有连接的副本，由它写完应答 */
         __ResetBuf();
-        break;
+        return false;
       } else {
         if (dup2(__sockfd_, STDOUT_FILENO) < 0 ||
             dup2(__sockfd_, STDERR_FILENO) < 0) {
           LOGERR("dup2 error");
           exit(-1);
         }
-        char decoded[__kBufferSize_];
-        memset(decoded, '\0', sizeof(decoded));
-        UrlDecode(__buf_ + idx + 1, decoded, __kBufferSize_);
-        PyRun_SimpleString(decoded);
+        /* 代码在缓冲区中原地解码 */
+        char *code = __buf_ + __code_idx_;
+        if (UrlDecodeInPlace(code, __content_length_) < 0) {
+          printf("invalid url encoding\n");
+          exit(0);
+        }
+        PyRun_SimpleString(code);
         exit(0);
       }
     } else {
-      if (RemoveFd(__epollfd_, __sockfd_) < 0) LOGWARN("RemoveFd error");
-      break;
+      return false;
     }
   }
 }
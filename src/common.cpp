@@ -1,5 +1,10 @@
 #include "common.h"
 
+#include <limits.h>
+#include <netinet/tcp.h>
+
+#include <string>
+
 /* 设置非阻塞 io，成功返回 old_opt，错误返回 -1 */
 int SetNonBlocking(int fd) {
   int old_opt = fcntl(fd, F_GETFL);
@@ -15,17 +20,11 @@ int SetNonBlocking(int fd) {
   return old_opt;
 }
 
-/* 将文件描述符 fd 加入到 epoll 事件表中，监听读事件
- * one_shot: 是否采用 one-shot 行为，默认 false
- * trigger_mode: 触发模式，0 为 ET，1 为 LT，默认 ET
- * 成功返回 0，错误返回 -1 */
-int AddFd(int epollfd, int fd, bool one_shot, TriggerMode trigger_mode) {
+/* 以 events 将 fd 加入到 epoll 事件表中并设为非阻塞，成功返回 0，错误返回 -1 */
+int EpollAdd(int epollfd, int fd, uint32_t events, uint64_t data) {
   epoll_event event;
-  event.data.fd = fd;
-  event.events = EPOLLIN | EPOLLRDHUP;
-
-  if (trigger_mode == 0) event.events |= EPOLLET;
-  if (one_shot) event.events |= EPOLLONESHOT;
+  event.data.u64 = data ? data : fd;
+  event.events = events;
 
   if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) < 0) {
     LOGERR("epoll_ctl error");
@@ -38,19 +37,14 @@ int AddFd(int epollfd, int fd, bool one_shot, TriggerMode trigger_mode) {
   return 0;
 }
 
-/* 重设 one-shot，
- * ev 为附加监听事件，最终监听事件为 ev | EPOLLONESHOT | EPOLLRDHUP
- * trigger_mode: 触发模式，0 为 ET，1 为 LT，默认 ET
- * 成功返回 0，错误返回 -1 */
-int ModFd(int epollfd, int fd, int ev, TriggerMode trigger_mode) {
+/* 把 fd 监听的事件改为 events，成功返回 0，错误返回 -1 */
+int EpollMod(int epollfd, int fd, uint32_t events, uint64_t data) {
   epoll_event event;
-  event.data.fd = fd;
-  event.events = ev | EPOLLONESHOT | EPOLLRDHUP;
-
-  if (trigger_mode == 0) event.events |= EPOLLET;
+  event.data.u64 = data ? data : fd;
+  event.events = events;
 
   if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) < 0) {
-    LOGERR("epoll_ct error");
+    LOGERR("epoll_ctl error");
     return -1;
   }
   return 0;
@@ -95,3 +89,136 @@ int SendError(int connfd, const char* info) {
   }
   return 0;
 }
+
+/* 解析形如 "0,2-5" 的 CPU 列表，按出现顺序追加到 cpus 中，
+ * 成功返回 0，格式错误或 CPU 编号超出范围返回 -1 */
+int ParseCpuList(const char* list, std::vector<int>* cpus) {
+  const char* p = list;
+  while (*p) {
+    char* end;
+    long first = strtol(p, &end, 10);
+    if (end == p) return -1;
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      last = strtol(p + 1, &end, 10);
+      if (end == p + 1) return -1;
+      p = end;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+    for (long cpu = first; cpu <= last; ++cpu) cpus->push_back(cpu);
+    if (*p == ',') {
+      ++p;
+    } else if (*p) {
+      return -1;
+    }
+  }
+  return cpus->empty() ? -1 : 0;
+}
+
+/* 解析逗号分隔的套接字选项，成功返回 0，格式错误返回 -1 */
+int ParseSockOpts(const char* list, SockOpts* opts) {
+  const char* p = list;
+  while (*p) {
+    const char* end = strchr(p, ',');
+    if (end == NULL) end = p + strlen(p);
+    std::string item(p, end);
+    std::string name = item.substr(0, item.find('='));
+    long value = -1;
+    if (name.size() < item.size()) {
+      char* num_end;
+      const char* num = item.c_str() + name.size() + 1;
+      value = strtol(num, &num_end, 10);
+      if (num_end == num || *num_end || value < 0 || value > INT_MAX)
+        return -1;
+    }
+    if (name == "none" && value < 0) {
+      *opts = SockOpts();
+    } else if (name == "latency" && value < 0) {
+      opts->nodelay = true;
+      opts->notsent_lowat = 16384;
+      opts->fastopen = 256;
+    } else if (name == "throughput" && value < 0) {
+      opts->cork = true;
+      opts->sndbuf = 1 << 20;
+      opts->rcvbuf = 1 << 20;
+    } else if (name == "nodelay" && value < 0) {
+      opts->nodelay = true;
+    } else if (name == "cork" && value < 0) {
+      opts->cork = true;
+    } else if (name == "fastopen") {
+      opts->fastopen = value < 0 ? 256 : value;
+    } else if (name == "lowat" && value >= 0) {
+      opts->notsent_lowat = value;
+    } else if (name == "sndbuf" && value >= 0) {
+      opts->sndbuf = value;
+    } else if (name == "rcvbuf" && value >= 0) {
+      opts->rcvbuf = value;
+    } else {
+      return -1;
+    }
+    p = *end ? end + 1 : end;
+  }
+  return 0;
+}
+
+/* 设置一个整数选项，value 为 0 时不设置 */
+static int SetIntOpt(int fd, int level, int name, int value, const char* str) {
+  if (value == 0) return 0;
+  if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+    LOGERR("setsockopt %s error", str);
+    return -1;
+  }
+  return 0;
+}
+
+/* 把 opts 中的选项设置到 fd 上，成功返回 0，错误返回 -1。
+ * 缓冲区大小要在 listen 或 connect 之前设置，窗口扩大因子在握手时确定 */
+int SetSockOpts(int fd, const SockOpts& opts, bool listener) {
+  if (SetIntOpt(fd, SOL_SOCKET, SO_SNDBUF, opts.sndbuf, "SO_SNDBUF") < 0 ||
+      SetIntOpt(fd, SOL_SOCKET, SO_RCVBUF, opts.rcvbuf, "SO_RCVBUF") < 0 ||
+      SetIntOpt(fd, IPPROTO_TCP, TCP_NODELAY, opts.nodelay, "TCP_NODELAY") <
+          0 ||
+      SetIntOpt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, opts.notsent_lowat,
+                "TCP_NOTSENT_LOWAT") < 0)
+    return -1;
+  if (listener)
+    return SetIntOpt(fd, IPPROTO_TCP, TCP_FASTOPEN, opts.fastopen,
+                     "TCP_FASTOPEN");
+  return SetIntOpt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, opts.fastopen != 0,
+                   "TCP_FASTOPEN_CONNECT");
+}
+
+/* 把线程 thread 绑定到 cpu 上，成功返回 0，错误返回 -1 */
+int PinThread(pthread_t thread, int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int ret = pthread_setaffinity_np(thread, sizeof(set), &set);
+  if (ret != 0) {
+    errno = ret;
+    LOGERR("pthread_setaffinity_np error");
+    return -1;
+  }
+  return 0;
+}
+
+/* 返回 cpu 所在的 NUMA 节点，无法确定时返回 0，
+ * 节点信息来自 /sys/devices/system/cpu/cpuN/ 下的 nodeM 链接 */
+int CpuNode(int cpu) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR* dir = opendir(path);
+  if (dir == NULL) return 0;
+  int node = 0;
+  dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "node", 4) == 0 &&
+        entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+      node = atoi(entry->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
@@ -0,0 +1,77 @@
+#include "histogram.h"
+
+/* 小于 kSubBuckets 的数值各占一个桶；其余数值按最高位 msb 分组，
+ * 组内按 msb 之后的 kSubBucketBits 位线性划分 */
+int Histogram::__Index(uint64_t value) {
+  if (value < (uint64_t)kSubBuckets) return (int)value;
+  int msb = 63 - __builtin_clzll(value);
+  if (msb >= kMaxBits) return kBucketNum - 1;
+  int group = msb - kSubBucketBits + 1;
+  int sub = (int)((value >> (msb - kSubBucketBits)) & (kSubBuckets - 1));
+  return group * kSubBuckets + sub;
+}
+
+uint64_t Histogram::__Value(int idx) {
+  if (idx < kSubBuckets) return idx;
+  int group = idx / kSubBuckets;
+  int sub = idx % kSubBuckets;
+  int shift = group - 1;
+  uint64_t lower = ((uint64_t)(kSubBuckets + sub)) << shift;
+  return lower + (1ULL << shift) - 1;
+}
+
+void Histogram::Record(uint64_t value) {
+  __counts_[__Index(value)].fetch_add(1, std::memory_order_relaxed);
+  __count_.fetch_add(1, std::memory_order_relaxed);
+  __sum_.fetch_add(value, std::memory_order_relaxed);
+  uint64_t cur = __max_.load(std::memory_order_relaxed);
+  while (value > cur &&
+         !__max_.compare_exchange_weak(cur, value, std::memory_order_relaxed)) {
+  }
+}
+
+void Histogram::Merge(const Histogram& other) {
+  for (int i = 0; i < kBucketNum; ++i) {
+    uint64_t n = other.__counts_[i].load(std::memory_order_relaxed);
+    if (n) __counts_[i].fetch_add(n, std::memory_order_relaxed);
+  }
+  __count_.fetch_add(other.count(), std::memory_order_relaxed);
+  __sum_.fetch_add(other.sum(), std::memory_order_relaxed);
+  uint64_t value = other.max();
+  uint64_t cur = __max_.load(std::memory_order_relaxed);
+  while (value > cur &&
+         !__max_.compare_exchange_weak(cur, value, std::memory_order_relaxed)) {
+  }
+}
+
+void Histogram::Reset() {
+  for (int i = 0; i < kBucketNum; ++i) {
+    __counts_[i].store(0, std::memory_order_relaxed);
+  }
+  __count_.store(0, std::memory_order_relaxed);
+  __sum_.store(0, std::memory_order_relaxed);
+  __max_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::Percentile(double p) const {
+  /* 以各桶计数之和为准，避免与 __count_ 不一致时越界 */
+  uint64_t total = 0;
+  for (int i = 0; i < kBucketNum; ++i) {
+    total += __counts_[i].load(std::memory_order_relaxed);
+  }
+  if (total == 0) return 0;
+  if (p < 0) p = 0;
+  if (p > 100) p = 100;
+  uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+  if (rank == 0) rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < kBucketNum; ++i) {
+    seen += __counts_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      uint64_t value = __Value(i);
+      uint64_t m = max();
+      return value < m ? value : m;
+    }
+  }
+  return max();
+}
@@ -1,10 +1,19 @@
 #include "logger.h"
 
+#include "common.h"
+
 const vector<string> Logger::__level_str_{"info", "debug", "warning", "error"};
 
-Logger::Logger() { __fd_ = -1; }
+Logger::Logger() {
+  __fd_ = -1;
+  __capture_fd_ = -1;
+  __capture_start_ = 0;
+  __capture_off_ = 0;
+  __dropped_ = 0;
+}
 
 Logger::~Logger() {
+  if (__capture_fd_ >= 0) close(__capture_fd_);
   if (close(__fd_)) {
     perror("file close error");
     exit(-1);
@@ -59,14 +68,14 @@ void Logger::__ThreadHandler(union sigval val) {
   free(aiobuf);
 }
 
-AioBuf* Logger::__PrepareAiobuf(char* data) {
+AioBuf* Logger::__PrepareAiobuf(int fd, const char* data, size_t len) {
   AioBuf* aiobuf = (AioBuf*)malloc(sizeof(AioBuf));
-  memset(aiobuf->data, '\0', kBufSize);
+  if (aiobuf == NULL) return NULL;
   memset(&aiobuf->aiocb, 0, sizeof(struct aiocb));
-  aiobuf->aiocb.aio_fildes = __fd_;
-  strcpy(aiobuf->data, data);
+  aiobuf->aiocb.aio_fildes = fd;
+  memcpy(aiobuf->data, data, len);
   aiobuf->aiocb.aio_buf = aiobuf->data;
-  aiobuf->aiocb.aio_nbytes = strlen(data);
+  aiobuf->aiocb.aio_nbytes = len;
   aiobuf->aiocb.aio_offset = 0;
   aiobuf->aiocb.aio_sigevent.sigev_notify = SIGEV_THREAD;
   aiobuf->aiocb.aio_sigevent.sigev_notify_function = __ThreadHandler;
@@ -107,13 +116,86 @@ void Logger::__WriteLog(LogLevel loglev, const char* file, int line,
     }
   }
 
-  if (__loglev_ <= loglev) {
-    AioBuf* aiobuf = __PrepareAiobuf(logmsg);
-    if (aio_write(&(aiobuf->aiocb)) < 0) {
+  if (__loglev_ <= loglev) __Submit(__fd_, logmsg, strlen(logmsg));
+}
+
+void Logger::__Submit(int fd, const char* data, size_t len) {
+  AioBuf* aiobuf = __PrepareAiobuf(fd, data, len);
+  if (aiobuf == NULL) {
+    ++__dropped_;
+    return;
+  }
+  if (aio_write(&(aiobuf->aiocb)) < 0) {
+    /* 异步 IO 请求过多时丢弃这条记录，不影响服务 */
+    if (errno == EAGAIN) {
+      free(aiobuf);
+      ++__dropped_;
+      return;
+    }
+    perror("aio write error");
+    exit(-1);
+  }
+}
+
+/* 抓包记录写到提交时预留的位置，各条记录在文件中的顺序与提交顺序一致，
+ * 异步 IO 资源不足时改为同步写，不丢弃记录 */
+void Logger::__SubmitCapture(const char* data, size_t len) {
+  off_t off = __capture_off_.fetch_add(len);
+  AioBuf* aiobuf = __PrepareAiobuf(__capture_fd_, data, len);
+  if (aiobuf != NULL) {
+    aiobuf->aiocb.aio_offset = off;
+    if (aio_write(&(aiobuf->aiocb)) == 0) return;
+    if (errno != EAGAIN) {
       perror("aio write error");
       exit(-1);
     }
+    free(aiobuf);
   }
+  if (pwrite(__capture_fd_, data, len, off) < 0) {
+    perror("capture file write error");
+    exit(-1);
+  }
+}
+
+void Logger::InitCapture(const string& file) {
+  Logger* logger = GetLogger();
+  /* 不能用 O_APPEND，否则 aio_offset 和 pwrite 的位置会被忽略 */
+  int fd = open(file.c_str(), O_CREAT | O_TRUNC | O_WRONLY,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0) {
+    perror("capture file open error");
+    exit(-1);
+  }
+  /* 文件头同步写入，保证在所有记录之前 */
+  if (write(fd, kCaptureMagic, sizeof(kCaptureMagic)) < 0) {
+    perror("capture file write error");
+    exit(-1);
+  }
+  logger->__capture_start_ = NowUs();
+  logger->__capture_off_ = sizeof(kCaptureMagic);
+  logger->__capture_fd_ = fd;
+}
+
+void Logger::Capture(uint32_t conn, CaptureType type, const char* data,
+                     size_t len) {
+  Logger* logger = GetLogger();
+  if (logger->__capture_fd_ < 0) return;
+  static const size_t kMaxData = kBufSize - sizeof(CaptureRecord);
+
+  char buf[kBufSize];
+  CaptureRecord* record = (CaptureRecord*)buf;
+  record->time_us = NowUs() - logger->__capture_start_;
+  record->conn = conn;
+  record->type = type;
+  /* 数据较长时拆成多条记录 */
+  do {
+    size_t n = len < kMaxData ? len : kMaxData;
+    record->len = n;
+    if (n > 0) memcpy(buf + sizeof(CaptureRecord), data, n);
+    logger->__SubmitCapture(buf, sizeof(CaptureRecord) + n);
+    data += n;
+    len -= n;
+  } while (len > 0);
 }
 
 void Logger::Init(LogLevel loglev, string file_path, bool verbose) {
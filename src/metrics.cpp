@@ -0,0 +1,148 @@
+#include "metrics.h"
+
+#include <sstream>
+
+#include "common.h"
+
+vector<Metrics::Family> Metrics::__families_;
+vector<Metrics::Shard*> Metrics::__shards_;
+int Metrics::__counter_num_ = 0;
+int Metrics::__histogram_num_ = 0;
+Locker Metrics::__locker_;
+
+Metrics::Shard* Metrics::__NewShard() {
+  Shard* shard = new Shard();
+  __locker_.Lock();
+  __shards_.push_back(shard);
+  __locker_.Unlock();
+  return shard;
+}
+
+void Metrics::__Add(const string& name, const string& help, Type type,
+                    const Series& series) {
+  __locker_.Lock();
+  for (auto& family : __families_) {
+    if (family.name == name) {
+      family.series.push_back(series);
+      __locker_.Unlock();
+      return;
+    }
+  }
+  __families_.push_back(Family{name, help, type, {series}});
+  __locker_.Unlock();
+}
+
+int Metrics::AddCounter(const string& name, const string& help,
+                        const string& labels) {
+  __locker_.Lock();
+  int id = __counter_num_++;
+  __locker_.Unlock();
+  if (id >= kMaxCounters) {
+    LOGERR("too many counters: %s", name.c_str());
+    exit(-1);
+  }
+  __Add(name, help, kCounter, Series{labels, id, nullptr, nullptr});
+  return id;
+}
+
+void Metrics::AddCounter(const string& name, const string& help,
+                         std::function<double()> getter,
+                         const string& labels) {
+  __Add(name, help, kCounter, Series{labels, -1, getter, nullptr});
+}
+
+void Metrics::AddGauge(const string& name, const string& help,
+                       std::function<double()> getter, const string& labels) {
+  __Add(name, help, kGauge, Series{labels, -1, getter, nullptr});
+}
+
+void Metrics::AddHistogram(const string& name, const string& help,
+                           const Histogram* histogram, const string& labels) {
+  __Add(name, help, kSummary, Series{labels, -1, nullptr, histogram});
+}
+
+int Metrics::AddHistogram(const string& name, const string& help,
+                          const string& labels) {
+  __locker_.Lock();
+  int id = __histogram_num_++;
+  __locker_.Unlock();
+  if (id >= kMaxHistograms) {
+    LOGERR("too many histograms: %s", name.c_str());
+    exit(-1);
+  }
+  __Add(name, help, kSummary, Series{labels, id, nullptr, nullptr});
+  return id;
+}
+
+void Metrics::Merge(int id, Histogram* out) {
+  __locker_.Lock();
+  for (Shard* shard : __shards_) {
+    Histogram* h = shard->histograms[id].load(std::memory_order_acquire);
+    if (h) out->Merge(*h);
+  }
+  __locker_.Unlock();
+}
+
+uint64_t Metrics::Value(int id) {
+  uint64_t sum = 0;
+  __locker_.Lock();
+  for (Shard* shard : __shards_) {
+    sum += shard->counters[id].load(std::memory_order_relaxed);
+  }
+  __locker_.Unlock();
+  return sum;
+}
+
+/* 拼接 name{labels} */
+static string SeriesName(const string& name, const string& labels,
+                         const string& extra = "") {
+  string ret = name;
+  if (labels.empty() && extra.empty()) return ret;
+  ret += "{" + labels;
+  if (!labels.empty() && !extra.empty()) ret += ",";
+  return ret + extra + "}";
+}
+
+string Metrics::Render() {
+  static const char* type_str[] = {"counter", "gauge", "summary"};
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+  /* 先复制一份注册信息，回调可能较慢，不在锁内执行 */
+  __locker_.Lock();
+  vector<Family> families = __families_;
+  __locker_.Unlock();
+
+  std::ostringstream out;
+  out.precision(15);  // 避免较大的计数以科学计数法输出
+  for (const auto& family : families) {
+    out << "# HELP " << family.name << " " << family.help << "\n";
+    out << "# TYPE " << family.name << " " << type_str[family.type] << "\n";
+    for (const auto& series : family.series) {
+      if (family.type == kSummary) {
+        const Histogram* h = series.histogram;
+        Histogram merged;
+        if (h == nullptr) {
+          Merge(series.id, &merged);
+          h = &merged;
+        }
+        for (double q : quantiles) {
+          std::ostringstream quantile;
+          quantile << "quantile=\"" << q << "\"";
+          out << SeriesName(family.name, series.labels, quantile.str()) << " "
+              << h->Percentile(q * 100) << "\n";
+        }
+        out << SeriesName(family.name + "_sum", series.labels) << " "
+            << h->sum() << "\n";
+        out << SeriesName(family.name + "_count", series.labels) << " "
+            << h->count() << "\n";
+      } else if (series.id >= 0) {
+        out << SeriesName(family.name, series.labels) << " "
+            << Value(series.id) << "\n";
+      } else {
+        out << SeriesName(family.name, series.labels) << " "
+            << series.getter() << "\n";
+      }
+    }
+  }
+  return out.str();
+}
@@ -0,0 +1,19 @@
+#include "conn_limiter.h"
+
+bool ConnLimiter::Admit(in_addr_t ip) {
+  if (__max_per_ip_ == 0) return true;
+  __locker_.Lock();
+  int& conns = __conns_[ip];
+  bool ok = conns < __max_per_ip_;
+  if (ok) ++conns;
+  __locker_.Unlock();
+  return ok;
+}
+
+void ConnLimiter::Release(in_addr_t ip) {
+  if (__max_per_ip_ == 0) return;
+  __locker_.Lock();
+  auto it = __conns_.find(ip);
+  if (it != __conns_.end() && --it->second <= 0) __conns_.erase(it);
+  __locker_.Unlock();
+}
@@ -1,12 +1,29 @@
 #include "dummy_server.h"
 
-vector<TimerClientData> g_timer_client_data(MAX_FD);  // 定时器用的用户数据
-TimerHeap g_timer_heap(MAX_FD);                       // 堆定时器
+ConnTable<HttpConn> g_conn_table;  // 所有客户连接
+ConnLimiter g_conn_limiter;        // 客户连接的准入限制
+TimerHeap g_timer_heap(ConnTable<HttpConn>::kChunk);  // 堆定时器
+
+int DummyServer::__timeout_counter_[HttpConn::STAGE_NUM];
 
 Config::Config(int argc, char** argv) {
   verbose_ = false;
   log_path_ = "./";
+  sql_min_ = -1;
+  backlog_ = 1024;
+  max_conn_ = 0;
+  max_conn_per_ip_ = 0;
+  max_queue_ = 1000;
+  cgi_thread_num_ = 2;
+  max_cgi_queue_ = 100;
+  keepalive_timeout_ = 15;
+  max_requests_ = 1000;
+  header_timeout_ = 20;
+  body_timeout_ = 20;
+  min_rate_ = 500;
   ParseArg(argc, argv);
+  /* 不指定最小连接数时，连接池大小固定为 sql_num_ */
+  if (sql_min_ < 0) sql_min_ = sql_num_;
 }
 
 extern int optind, opterr, optopt;
@@ -17,11 +34,26 @@ static struct option long_options[] = {
     {"passwd", required_argument, NULL, 'p'},
     {"dbname", required_argument, NULL, 'd'},
     {"sqlnum", required_argument, NULL, 's'},
+    {"sqlmin", required_argument, NULL, 'm'},
     {"port", required_argument, NULL, 'P'},
     {"threadnum", required_argument, NULL, 't'},
     {"trigger", required_argument, NULL, 'T'},
     {"verbose", no_argument, NULL, 'v'},
-    {"logpath", required_argument, NULL, 'L'}};
+    {"logpath", required_argument, NULL, 'L'},
+    {"capture", required_argument, NULL, 'c'},
+    {"cpus", required_argument, NULL, 'a'},
+    {"backlog", required_argument, NULL, 'b'},
+    {"maxconn", required_argument, NULL, 'n'},
+    {"maxperip", required_argument, NULL, 'i'},
+    {"queue", required_argument, NULL, 'q'},
+    {"cgithreads", required_argument, NULL, 'g'},
+    {"cgiqueue", required_argument, NULL, 'Q'},
+    {"sockopt", required_argument, NULL, 'o'},
+    {"keepalive", required_argument, NULL, 'k'},
+    {"maxrequests", required_argument, NULL, 'r'},
+    {"headertimeout", required_argument, NULL, 'H'},
+    {"bodytimeout", required_argument, NULL, 'B'},
+    {"minrate", required_argument, NULL, 'M'}};
 
 void Config::ParseArg(int argc, char** argv) {
   int index;
@@ -30,8 +62,8 @@ void Config::ParseArg(int argc, char** argv) {
     usage();
     exit(-1);
   }
-  while (EOF != (c = getopt_long(argc, argv, "u:p:d:s:P:t:T:vL:", long_options,
-                                 &index))) {
+  while (EOF != (c = getopt_long(argc, argv, "u:p:d:s:m:P:t:T:vL:c:a:b:n:i:q:g:Q:o:k:r:H:B:M:",
+                                 long_options, &index))) {
     switch (c) {
       case 'u':
         sql_user_ = optarg;
@@ -45,6 +77,9 @@ void Config::ParseArg(int argc, char** argv) {
       case 's':
         sql_num_ = atoi(optarg);
         break;
+      case 'm':
+        sql_min_ = atoi(optarg);
+        break;
       case 'P':
         port_ = atoi(optarg);
         break;
@@ -60,6 +95,56 @@ void Config::ParseArg(int argc, char** argv) {
       case 'L':
         log_path_ = optarg;
         break;
+      case 'c':
+        capture_file_ = optarg;
+        break;
+      case 'a':
+        if (ParseCpuList(optarg, &cpus_) < 0) {
+          fprintf(stderr, "Invalid cpu list: %s\n", optarg);
+          usage();
+          exit(-1);
+        }
+        break;
+      case 'b':
+        backlog_ = atoi(optarg);
+        break;
+      case 'n':
+        max_conn_ = atoi(optarg);
+        break;
+      case 'i':
+        max_conn_per_ip_ = atoi(optarg);
+        break;
+      case 'q':
+        max_queue_ = atoi(optarg);
+        break;
+      case 'g':
+        cgi_thread_num_ = atoi(optarg);
+        break;
+      case 'Q':
+        max_cgi_queue_ = atoi(optarg);
+        break;
+      case 'o':
+        if (ParseSockOpts(optarg, &sock_opts_) < 0) {
+          fprintf(stderr, "Invalid socket options: %s\n", optarg);
+          usage();
+          exit(-1);
+        }
+        break;
+      case 'k':
+        keepalive_timeout_ = atoi(optarg);
+        break;
+      case 'r':
+        max_requests_ = atoi(optarg);
+        break;
+      case 'H':
+        header_timeout_ = atoi(optarg);
+        break;
+      case 'B':
+        body_timeout_ = atoi(optarg);
+        break;
+      case 'M':
+        min_rate_ = atoi(optarg);
+        break;
       case '?':
         fprintf(stderr, "Unknown option: %c\n", optopt);
         usage();
@@ -75,59 +160,130 @@ void Config::usage() {
           "   -u|--user       MySQL user name\n"
           "   -p|--passwd     MySQL user password\n"
           "   -d|--dbname     MySQL database name\n"
-          "   -s|--sqlnum     MySQL connection number of connection pool\n"
+          "   -s|--sqlnum     MySQL max connection number of connection pool\n"
+          "   -m|--sqlmin     MySQL min connection number of connection pool\n"
+          "                   (default: same as sqlnum)\n"
           "   -P|--port       Server port\n"
-          "   -t|--threadnum  Number thread of thread pool\n"
+          "   -t|--threadnum  Number thread of thread pool for login,\n"
+          "                   register and stats requests\n"
           "   -T|--trigger    Trigger mode of epoll, ET=0 LT=1\n"
           "   -v|--verbose    output information\n"
-          "   -L|--logpath    log path\n");
+          "   -L|--logpath    log path\n"
+          "   -c|--capture    record incoming requests to the file, for\n"
+          "                   replaying with stress --replay\n"
+          "   -a|--cpus       pin the event loop to the first cpu of the list\n"
+          "                   and the workers to the rest, e.g. 0,2-5\n"
+          "   -b|--backlog    listen backlog (default: 1024)\n"
+          "   -n|--maxconn    max concurrent connections, more are answered\n"
+          "                   with 503 (default: unlimited)\n"
+          "   -i|--maxperip   max concurrent connections per client IP\n"
+          "                   (default: unlimited)\n"
+          "   -q|--queue      max requests waiting for a worker, more are\n"
+          "                   answered with 503 (default: 1000)\n"
+          "   -g|--cgithreads number of threads running python (default: 2)\n"
+          "   -Q|--cgiqueue   max python requests waiting for a thread, more\n"
+          "                   are answered with 503 (default: 100)\n"
+          "   -o|--sockopt    TCP options of the listen socket, inherited by\n"
+          "                   connections: a comma separated list of nodelay,\n"
+          "                   cork, fastopen[=N], lowat=N, sndbuf=N, rcvbuf=N\n"
+          "                   or the profiles none, latency and throughput,\n"
+          "                   e.g. latency,sndbuf=262144 (default: none)\n"
+          "   -k|--keepalive  seconds an idle persistent connection is kept\n"
+          "                   open, 0 closes after each response (default: 15)\n"
+          "   -r|--maxrequests max requests served on one connection,\n"
+          "                   0 for unlimited (default: 1000)\n"
+          "   -H|--headertimeout seconds to receive the request line and\n"
+          "                   headers from their first byte (default: 20)\n"
+          "   -B|--bodytimeout seconds of grace for receiving the body and\n"
+          "                   sending the response (default: 20)\n"
+          "   -M|--minrate    after the grace, bytes per second the body and\n"
+          "                   the response must average, 0 only limits the\n"
+          "                   gap between reads or writes (default: 500)\n");
 }
 
-static int __sig_sktpipefd_[2];  // 统一事件源，传输信号
-
 DummyServer::DummyServer(const Config& config)
     : __port_(config.port_),
-      __users_(MAX_FD),
-      __pool_(new Threadpool<HttpConn>(config.thread_num_)),
+      __backlog_(config.backlog_),
+      __sock_opts_(config.sock_opts_),
+      __max_conn_(config.max_conn_ > 0 ? config.max_conn_ : INT_MAX),
       __trigger_mode_(config.trigger_mode_),
       __sql_user_(config.sql_user_),
       __sql_passwd_(config.sql_passwd_),
       __db_name_(config.db_name_),
-      __sql_num(config.sql_num_) {
+      __sql_num(config.sql_num_),
+      __sql_min_(config.sql_min_),
+      __cpus_(config.cpus_),
+      __loop_node_(-1) {
+  /* 由 signalfd 接收的信号必须在所有线程中屏蔽，所以在创建任何线程之前屏蔽 */
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+    LOGERR("pthread_sigmask error");
+    exit(-1);
+  }
+  __signalfd_ = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (__signalfd_ < 0) {
+    LOGERR("signalfd error");
+    exit(-1);
+  }
+  /* 只有一个 CPU 时工作线程与事件循环共用 */
+  vector<int> worker_cpus(__cpus_.size() > 1 ? __cpus_.begin() + 1
+                                             : __cpus_.begin(),
+                          __cpus_.end());
+  if (__trigger_mode_ == LT) {
+    HttpConn::UseIoPolicy<LtPolicy>();
+  } else {
+    HttpConn::UseIoPolicy<EtPolicy>();
+  }
+  HttpConn::keepalive_timeout_ = std::max(config.keepalive_timeout_, 0);
+  HttpConn::max_requests_ = std::max(config.max_requests_, 0);
+  HttpConn::header_timeout_ = std::max(config.header_timeout_, 1);
+  HttpConn::body_timeout_ = std::max(config.body_timeout_, 1);
+  HttpConn::min_rate_ = std::max(config.min_rate_, 0);
+  /* 静态资源在主线程中处理，CGI 单独一组线程，不会占满处理其他请求的线程 */
+  __lanes_[HttpConn::LANE_APP].reset(new Threadpool<HttpConn>(
+      config.thread_num_, config.max_queue_, worker_cpus));
+  __lanes_[HttpConn::LANE_CGI].reset(new Threadpool<HttpConn>(
+      config.cgi_thread_num_, config.max_cgi_queue_, worker_cpus));
+
+  g_conn_limiter.Init(config.max_conn_per_ip_);
+
   extern const char* doc_root;
   HttpConn::InitStaticResource(doc_root);
 }
 
 DummyServer::~DummyServer() {
-  if (close(__epollfd_) < 0 || close(__listenfd_) < 0) {
+  /* 最后一批注册的 RegistDone 还会写应答并重设事件，要在关闭 epoll 之前完成 */
+  RegistBatcher::Stop();
+  if (close(__epollfd_) < 0 || close(__listenfd_) < 0 ||
+      close(__signalfd_) < 0 || close(__timerfd_) < 0) {
     LOGERR("close error");
     exit(-1);
   }
   HttpConn::ReleaseStaticResource();
 }
 
-/* 信号处理函数，sig 为待处理信号 */
-void DummyServer::__SigHandler(int sig) {
-  // 保存 errno，防止在其他函数读取 errno 前触发了信号处理函数
-  int errno_copy = errno;
-  int msg = sig;
-  if (send(__sig_sktpipefd_[1], (char*)&msg, 1, 0) < 0) {
-    LOGERR("send error");
-    exit(-1);
-  }
-  errno = errno_copy;
-}
-
 /* 创建监听事件与 epoll 内核事件表 */
 void DummyServer::__Listen() {
   /* 创建监听描述符 */
-  __listenfd_ = socket(AF_INET, SOCK_STREAM, 0);
+  __listenfd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
   if (__listenfd_ < 0) {
     LOGERR("socket error");
     exit(-1);
   }
-  struct linger tmp = {1, 0};
-  setsockopt(__listenfd_, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+  int reuse = 1;
+  setsockopt(__listenfd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  /* 收到数据后才完成 accept，只建立连接而不发请求的客户端不占用连接 */
+  int defer = kDeferAcceptSecs;
+  setsockopt(__listenfd_, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
+  /* 已接受的连接继承监听描述符的选项，不必每个连接再设置一次 */
+  if (SetSockOpts(__listenfd_, __sock_opts_, true) < 0) {
+    LOGERR("SetSockOpts error");
+    exit(-1);
+  }
+  HttpConn::cork_ = __sock_opts_.cork;
 
   struct sockaddr_in addr;
   bzero(&addr, sizeof(addr));
@@ -138,7 +294,7 @@ void DummyServer::__Listen() {
     LOGERR("bind error");
     exit(-1);
   }
-  if (listen(__listenfd_, 5) < 0) {
+  if (listen(__listenfd_, __backlog_) < 0) {
     LOGERR("listen error");
     exit(-1);
   }
@@ -149,198 +305,408 @@ void DummyServer::__Listen() {
     LOGERR("epoll_create error");
     exit(-1);
   }
-  if (AddFd(__epollfd_, __listenfd_, false, __trigger_mode_) < 0) {
+  /* 监听描述符采用 LT 模式，每轮最多接收 kAcceptBatch 个连接，
+   * 剩下的留到下一轮，不会因为连接突增而饿死已有连接的事件 */
+  if (AddFd<LtPolicy>(__epollfd_, __listenfd_) < 0) {
     LOGERR("AddFd error");
     exit(-1);
   }
   HttpConn::epollfd_ = __epollfd_;
 
-  /* 统一事件源 */
-  if (socketpair(AF_UNIX, SOCK_STREAM, 0, __sig_sktpipefd_) < 0) {
-    LOGERR("socketpair error");
-    exit(-1);
-  }
-  if (SetNonBlocking(__sig_sktpipefd_[1]) < 0) {  // 非阻塞写
-    LOGERR("SetNonBlocking error");
+  /* 统一事件源：信号与定时器都作为描述符加入 epoll，
+   * 每次可读时都会读完，所以采用 LT 模式 */
+  __timerfd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (__timerfd_ < 0) {
+    LOGERR("timerfd_create error");
     exit(-1);
   }
-  if (AddFd(__epollfd_, __sig_sktpipefd_[0], false, __trigger_mode_) < 0) {
+  __timer_armed_ = 0;
+  if (AddFd<LtPolicy>(__epollfd_, __signalfd_) < 0 ||
+      AddFd<LtPolicy>(__epollfd_, __timerfd_) < 0) {
     LOGERR("AddFd error");
     exit(-1);
   }
 
-  if (AddSig(SIGTERM, __SigHandler, false) < 0 ||
-      AddSig(SIGINT, __SigHandler, false) < 0 ||
-      AddSig(SIGALRM, __SigHandler, true) || AddSig(SIGPIPE, SIG_IGN) < 0) {
+  if (AddSig(SIGPIPE, SIG_IGN) < 0) {
     LOGERR("AddSig error");
     exit(-1);
   }
-  alarm(TIMEOUT);
 }
 
 /* 启动服务器 */
 void DummyServer::Start() {
   __SqlConnpool();
+  __InitMetrics();
+  __PinLoop();
   __Listen();
 
   __stop_server_ = false;
+  /* 按触发模式实例化事件循环，循环内不再判断触发模式 */
+  if (__trigger_mode_ == LT) {
+    __Loop<LtPolicy>();
+  } else {
+    __Loop<EtPolicy>();
+  }
+}
 
+template <typename Io>
+void DummyServer::__Loop() {
   while (!__stop_server_) {
+    __ArmTimer();
     int num = epoll_wait(__epollfd_, __events_, MAX_EVENT_NUM, -1);
     if (num < 0 && (errno != EINTR)) {
       LOGERR("epoll_wait error");
       exit(-1);
     }
     for (int i = 0; i < num; ++i) {
-      int sockfd = __events_[i].data.fd;
+      /* 监听描述符、signalfd 与 timerfd 携带 fd，客户连接携带令牌 */
+      uint64_t data = __events_[i].data.u64;
 
-      if (sockfd == __listenfd_) {
+      if (data == (uint64_t)__listenfd_) {
         /* 新连接 */
-        __AddClient();
-      } else if (__events_[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-        /* 异常，移除定时器，关闭连接 */
-        __users_[sockfd].CloseConn();
-      } else if ((sockfd == __sig_sktpipefd_[0]) &&
-                 (__events_[i].events & EPOLLIN)) {
+        __AddClient<Io>();
+        continue;
+      }
+      if (data == (uint64_t)__signalfd_) {
         __SignalProcess();
-      } else if (__events_[i].events & EPOLLIN) {
-        __ReadFromClient(sockfd);
+        continue;
+      }
+      if (data == (uint64_t)__timerfd_) {
+        __TimerProcess();
+        continue;
+      }
+      /* 同一批事件中，前面的事件可能已经关闭了连接，槽位还可能被新连接复用 */
+      HttpConn* conn = g_conn_table.Get(data);
+      if (conn == NULL) {
+        Metrics::Inc(__stale_events_counter_);
+        continue;
+      }
+      if (__events_[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        /* 异常，移除定时器，关闭连接 */
+        __CloseConn(conn);
+      } else if (__events_[i].events & EPOLLIN || conn->pipelined()) {
+        /* 流水线请求在缓冲区中，通过可写事件转到这里 */
+        __ReadFromClient<Io>(conn);
       } else if (__events_[i].events & EPOLLOUT) {
-        __WriteToClient(sockfd);
+        __WriteToClient<Io>(conn);
       }
     }
   }
 }
 
+template <typename Io>
 void DummyServer::__AddClient() {
-  struct sockaddr_in client_addr;
-  socklen_t client_addrlen = sizeof(client_addr);
-  if (__trigger_mode_ == ET) {
-    while (1) {
-      int connfd =
-          accept(__listenfd_, (sockaddr*)&client_addr, &client_addrlen);
-      if (connfd < 0) {
-        if (errno != EAGAIN) LOGERR("accept error");
-        return;
-      }
-      if (HttpConn::user_cnt_ >= MAX_FD) {
-        if (SendError(connfd, "Internal server busy") < 0)
-          LOGWARN("SendError error");
-        return;
-      }
-      /* 将新用户加入用户数组 */
-      __users_[connfd].Init(connfd, client_addr);
-      /* 设置定时器 */
-      __SetTimer(connfd, client_addr);
-    }
-  } else {
-    int connfd = accept(__listenfd_, (sockaddr*)&client_addr, &client_addrlen);
+  for (int i = 0; i < kAcceptBatch; ++i) {
+    struct sockaddr_in client_addr;
+    socklen_t client_addrlen = sizeof(client_addr);
+    int connfd = accept4(__listenfd_, (sockaddr*)&client_addr, &client_addrlen,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (connfd < 0) {
-      if (errno != EAGAIN) LOGERR("accept error");
+      if (errno != EAGAIN && errno != ECONNABORTED) LOGWARN("accept4 error");
       return;
     }
-    if (HttpConn::user_cnt_ >= MAX_FD) {
-      if (SendError(connfd, "Internal server busy") < 0)
-        LOGWARN("SendError error");
-      return;
+    if (HttpConn::user_cnt_ >= __max_conn_) {
+      __Reject(connfd, REJECT_GLOBAL);
+      continue;
     }
-    /* 将新用户加入用户数组 */
-    __users_[connfd].Init(connfd, client_addr);
+    if (!g_conn_limiter.Admit(client_addr.sin_addr.s_addr)) {
+      __Reject(connfd, REJECT_PER_IP);
+      continue;
+    }
+    /* 将新用户加入连接表 */
+    uint64_t token = g_conn_table.Alloc();
+    if (token == 0) {
+      g_conn_limiter.Release(client_addr.sin_addr.s_addr);
+      __Reject(connfd, REJECT_GLOBAL);
+      continue;
+    }
+    HttpConn* conn = g_conn_table.Get(token);
+    if (!conn->Init<Io>(connfd, client_addr, token)) continue;
+    if (__loop_node_ >= 0) __CountRxNode(connfd);
     /* 设置定时器 */
-    __SetTimer(connfd, client_addr);
+    __SetTimer(conn);
   }
 }
 
+/** 以 503 拒绝连接。关闭时接收缓冲区中有未读数据，内核会发送 RST，客户端可能
+ * 丢弃还没读的应答，所以先读掉已经到达的请求（TCP_DEFER_ACCEPT 保证通常已经到达），
+ * 这只能减少 RST，不能避免之后才到达的数据引起的 RST。
+ * 发送应答后先 shutdown(SHUT_WR)，让 FIN 紧跟在应答之后发出 */
+void DummyServer::__Reject(int connfd, Reject_ reason) {
+  Metrics::Inc(__reject_counter_[reason]);
+  char buf[2048];
+  if (recv(connfd, buf, sizeof(buf), 0) < 0 && errno != EAGAIN)
+    LOGWARN("recv error");
+  if (send(connfd, HttpConn::kBusyResponse, strlen(HttpConn::kBusyResponse),
+           MSG_NOSIGNAL) < 0)
+    LOGWARN("send error");
+  shutdown(connfd, SHUT_WR);
+  if (close(connfd) < 0) LOGWARN("close error");
+}
+
 void DummyServer::__SignalProcess() {
-  int ret = -1;
-  char signals[1024];
-  ret = recv(__sig_sktpipefd_[0], signals, sizeof(signals), 0);
-  if (ret <= 0) {
-    LOGERR("recv error");
-    exit(-1);
-  } else {
-    for (int i = 0; i < ret; ++i) {
-      switch (signals[i]) {
-        case SIGALRM:
-          g_timer_heap.Tick();
-          alarm(TIMEOUT);
-          break;
-        case SIGTERM:
-        case SIGINT:
-          printf("Stop server now...\n");
-          if (close(__sig_sktpipefd_[0]) < 0 ||
-              close(__sig_sktpipefd_[1]) < 0) {
-            LOGERR("close error");
-            exit(-1);
-          }
-          __stop_server_ = true;
-          break;
-        default:
-          break;
-      }
+  signalfd_siginfo info;
+  while (read(__signalfd_, &info, sizeof(info)) == sizeof(info)) {
+    switch (info.ssi_signo) {
+      case SIGTERM:
+      case SIGINT:
+        printf("Stop server now...\n");
+        __stop_server_ = true;
+        break;
+      default:
+        break;
     }
   }
+  if (errno != EAGAIN) {
+    LOGERR("read error");
+    exit(-1);
+  }
 }
 
-void DummyServer::__ReadFromClient(int sockfd) {
-  /* Proactor 模式，父线程负责读写，子线程负责处理逻辑 */
-  /* 根据读的结果，决定是添加任务还是关闭连接 */
-  if (__users_[sockfd].Read()) {
-    __ResetTimer(sockfd);
-    __pool_->Append(&__users_[sockfd]);
-  } else {
-    __users_[sockfd].CloseConn();
+/* 最早的定时器到期，__timerfd_ 可能提前触发，Tick 只处理真正到期的定时器 */
+void DummyServer::__TimerProcess() {
+  uint64_t expirations;
+  if (read(__timerfd_, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN) {
+    LOGERR("read error");
+    exit(-1);
+  }
+  __timer_armed_ = 0;
+  g_timer_heap.Tick();
+}
+
+/** 让 __timerfd_ 在最早的定时器到期时可读，每轮事件处理前调用。
+ * 只在需要更早唤醒时才重新设定：最早的定时器被推后时保留原来的设定，
+ * 到时 Tick 什么也不做再重新设定，这样推后定时器不需要系统调用 */
+void DummyServer::__ArmTimer() {
+  uint64_t next = g_timer_heap.NextExpire();
+  if (next == 0 || (__timer_armed_ != 0 && __timer_armed_ <= next)) return;
+  itimerspec spec;
+  bzero(&spec, sizeof(spec));
+  spec.it_value.tv_sec = next / 1000;
+  spec.it_value.tv_nsec = next % 1000 * 1000000;
+  if (timerfd_settime(__timerfd_, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+    LOGERR("timerfd_settime error");
+    exit(-1);
+  }
+  __timer_armed_ = next;
+}
+
+/** 把事件循环绑定到第一个 CPU 上。
+ * 连接表与请求缓冲区都在主线程中第一次写入，按首次访问分配，
+ * 所以绑定之后它们都分配在事件循环所在的节点上。
+ * 数据库相关的线程在此之前创建，不受绑定影响 */
+void DummyServer::__PinLoop() {
+  if (__cpus_.empty()) return;
+  if (PinThread(pthread_self(), __cpus_[0]) < 0) {
+    LOGERR("PinThread error");
+    exit(-1);
+  }
+  int cpu_num = sysconf(_SC_NPROCESSORS_CONF);
+  __cpu_node_.resize(cpu_num);
+  for (int i = 0; i < cpu_num; ++i) __cpu_node_[i] = CpuNode(i);
+  __loop_node_ = CpuNode(__cpus_[0]);
+  LOGINFO("event loop on cpu %d, node %d", __cpus_[0], __loop_node_);
+  for (size_t i = 1; i < __cpus_.size(); ++i) {
+    if (CpuNode(__cpus_[i]) != __loop_node_)
+      LOGWARN("worker cpu %d is not on node %d", __cpus_[i], __loop_node_);
   }
 }
 
-void DummyServer::__WriteToClient(int sockfd) {
+/* 统计新连接的数据包是否由事件循环所在节点上的 CPU 接收，
+ * 用于检查网卡中断与接收队列的亲和性是否与 --cpus 一致 */
+void DummyServer::__CountRxNode(int connfd) {
+  int cpu = -1;
+  socklen_t len = sizeof(cpu);
+  if (getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 ||
+      cpu < 0 || cpu >= (int)__cpu_node_.size())
+    return;
+  Metrics::Inc(__rx_counter_[__cpu_node_[cpu] == __loop_node_ ? 0 : 1]);
+}
+
+/* 在主线程中关闭连接，同时删除定时器 */
+void DummyServer::__CloseConn(HttpConn* conn) {
+  g_timer_heap.DelTimer(conn->timer());
+  conn->CloseConn();
+}
+
+template <typename Io>
+void DummyServer::__ReadFromClient(HttpConn* conn) {
+  /* Proactor 模式，父线程负责读写和解析，子线程负责处理逻辑 */
+  /* 根据读的结果，决定是处理请求还是关闭连接 */
+  if (!conn->Read<Io>()) {
+    __CloseConn(conn);
+    return;
+  }
+  HttpConn::Lane_ lane = conn->Prepare();
+  /* 按解析后所处的阶段重设，头部的时限不会因读到数据而推后 */
+  __ResetTimer(conn);
+  if (lane == HttpConn::LANE_INLINE) {
+    /* 应答已填充好时直接写，大多数应答一次就能写完 */
+    if (conn->ProcessInline<Io>()) __WriteToClient<Io>(conn);
+  } else if (!__lanes_[lane]->Append(conn)) {
+    /* 队列已满，立即以 503 应答并关闭，而不是让连接一直等到超时 */
+    Metrics::Inc(__queue_full_counter_[lane]);
+    conn->SendBusy();
+    __CloseConn(conn);
+  }
+}
+
+template <typename Io>
+void DummyServer::__WriteToClient(HttpConn* conn) {
   /* Proactor 模式，父线程负责读写，子线程负责处理逻辑 */
   /* 根据写的结果，决定是添加任务还是关闭连接 */
-  if (__users_[sockfd].Write()) {
-    __ResetTimer(sockfd);
+  if (conn->Write<Io>()) {
+    __ResetTimer(conn);
   } else {
-    __users_[sockfd].CloseConn();
+    __CloseConn(conn);
   }
 }
 
 void DummyServer::__SqlConnpool() {
   SqlConnpool::Init("localhost", __sql_user_, __sql_passwd_, __db_name_, 3306,
-                    __sql_num);
+                    __sql_min_, __sql_num);
   HttpConn::InitSqlResult();
+  RegistBatcher::Init();
 }
 
-/* 设置 TimerClientData 数据和定时器 */
-void DummyServer::__SetTimer(int sockfd, sockaddr_in client_addr) {
-  g_timer_client_data[sockfd].addr = client_addr;
-  g_timer_client_data[sockfd].epollfd = __epollfd_;
-  g_timer_client_data[sockfd].sockfd = sockfd;
-  auto timer = std::make_shared<Timer>(TIMEOUT);
-  timer->user_data_ = &g_timer_client_data[sockfd];
-  timer->cb_func_ = __TimerCallback;
-  g_timer_client_data[sockfd].timer = timer;
-  g_timer_heap.AddTimer(timer);
-}
+/* 注册统计指标，可通过 /__stats 查看 */
+void DummyServer::__InitMetrics() {
+  HttpConn::InitMetrics();
 
-void DummyServer::__TimerCallback(TimerClientData* timer_client_data) {
-  if (epoll_ctl(timer_client_data->epollfd, EPOLL_CTL_DEL,
-                timer_client_data->sockfd, NULL) < 0) {
-    LOGERR("epoll_ctl error");
-    exit(-1);
+  static const char* lane_str[HttpConn::LANE_NUM] = {"inline", "app", "cgi"};
+  for (int i = HttpConn::LANE_APP; i < HttpConn::LANE_NUM; ++i) {
+    Threadpool<HttpConn>* pool = __lanes_[i].get();
+    Metrics::AddGauge(
+        "dummy_threadpool_queue_depth",
+        "Requests waiting in the thread pool queue, by lane",
+        [pool] { return (double)pool->queue_size(); },
+        string("lane=\"") + lane_str[i] + "\"");
+    __queue_full_counter_[i] = Metrics::AddCounter(
+        "dummy_threadpool_rejected_total",
+        "Requests answered with 503 because the lane's queue was full",
+        string("lane=\"") + lane_str[i] + "\"");
   }
-  if (close(timer_client_data->sockfd) < 0) {
-    LOGERR("close error");
-    exit(-1);
+  Metrics::AddGauge("dummy_timers", "Timers in the timer heap",
+                    [] { return (double)g_timer_heap.size(); });
+  Metrics::AddGauge(
+      "dummy_conn_slots", "Connection table slots, by state",
+      [] { return (double)g_conn_table.capacity(); }, "state=\"allocated\"");
+  Metrics::AddGauge(
+      "dummy_conn_slots", "Connection table slots, by state",
+      [] { return (double)g_conn_table.size(); }, "state=\"in_use\"");
+  __rx_counter_[0] = Metrics::AddCounter(
+      "dummy_accepted_rx_node_total",
+      "Accepted connections by whether their packets arrive on the event "
+      "loop's NUMA node, counted when --cpus is set",
+      "node=\"local\"");
+  __rx_counter_[1] = Metrics::AddCounter(
+      "dummy_accepted_rx_node_total",
+      "Accepted connections by whether their packets arrive on the event "
+      "loop's NUMA node, counted when --cpus is set",
+      "node=\"remote\"");
+  static const char* reject_str[REJECT_NUM] = {"global", "per_ip"};
+  for (int i = 0; i < REJECT_NUM; ++i) {
+    __reject_counter_[i] = Metrics::AddCounter(
+        "dummy_rejected_connections_total",
+        "Connections answered with 503 at accept, by limit",
+        string("limit=\"") + reject_str[i] + "\"");
   }
-  --HttpConn::user_cnt_;
+  static const char* stage_str[HttpConn::STAGE_NUM] = {
+      "header", "body", "busy", "drain", "idle"};
+  for (int i = 0; i < HttpConn::STAGE_NUM; ++i) {
+    __timeout_counter_[i] = Metrics::AddCounter(
+        "dummy_timeouts_total",
+        "Connections closed for missing the deadline of their stage",
+        string("stage=\"") + stage_str[i] + "\"");
+  }
+  __stale_events_counter_ = Metrics::AddCounter(
+      "dummy_stale_events_total",
+      "Epoll events dropped because their connection was already closed");
+  Metrics::AddGauge(
+      "dummy_request_buffers", "Per-request I/O buffers, by state",
+      [] { return (double)HttpConn::buffers_allocated(); },
+      "state=\"allocated\"");
+  Metrics::AddGauge(
+      "dummy_request_buffers", "Per-request I/O buffers, by state",
+      [] { return (double)HttpConn::buffers_in_use(); }, "state=\"in_use\"");
+  Metrics::AddCounter("dummy_log_dropped_total",
+                      "Log lines dropped because aio was out of resources",
+                      [] { return (double)Logger::Dropped(); });
+
+  SqlConnpool* sql = SqlConnpool::GetInstance();
+  Metrics::AddGauge(
+      "dummy_sql_connections", "SQL pool connections, by state",
+      [sql] { return (double)sql->free_conn(); }, "state=\"free\"");
+  Metrics::AddGauge(
+      "dummy_sql_connections", "SQL pool connections, by state",
+      [sql] { return (double)sql->cur_conn(); }, "state=\"used\"");
+  Metrics::AddCounter("dummy_sql_acquire_timeouts_total",
+                      "SQL connection acquisitions that timed out",
+                      [sql] { return (double)sql->timeouts(); });
+  Metrics::AddHistogram("dummy_sql_acquire_wait_microseconds",
+                        "Time spent waiting for a SQL connection",
+                        &sql->wait_histogram());
+
+  RegistBatcher* batcher = RegistBatcher::GetInstance();
+  Metrics::AddCounter("dummy_regist_batches_total",
+                      "Registration batches committed",
+                      [batcher] { return (double)batcher->batches(); });
+  Metrics::AddCounter("dummy_regist_rows_total",
+                      "Registration rows written in batches",
+                      [batcher] { return (double)batcher->rows(); });
+  Metrics::AddCounter("dummy_regist_failed_rows_total",
+                      "Registration rows that failed to commit",
+                      [batcher] { return (double)batcher->failed_rows(); });
+  Metrics::AddGauge("dummy_regist_max_batch_rows",
+                    "Largest registration batch so far",
+                    [batcher] { return (double)batcher->max_batch(); });
+  Metrics::AddCounter("dummy_regist_flush_seconds_total",
+                      "Time spent committing registration batches",
+                      [batcher] { return batcher->flush_us() / 1e6; });
+  Metrics::AddGauge("dummy_regist_pending",
+                    "Registrations waiting for the next batch",
+                    [batcher] { return (double)batcher->pending(); });
+}
+
+/** 设置定时器，槽位中上一个连接的定时器可以直接复用；
+ * 上一个连接若在工作线程中关闭，其定时器还在堆中，令牌也已失效，一并重设 */
+void DummyServer::__SetTimer(HttpConn* conn) {
+  TimerHeap::TimerPtr& timer = conn->timer();
+  if (timer == nullptr) {
+    timer = std::make_shared<Timer>(0);
+    timer->cb_func_ = __TimerCallback;
+  }
+  timer->user_data_ = conn->token();
+  __ResetTimer(conn);
 }
 
-/* 若连接还是活动状态，则重设定时器 */
-void DummyServer::__ResetTimer(int sockfd) {
-  auto old_timer = g_timer_client_data[sockfd].timer;
-  g_timer_heap.DelTimer(old_timer);
-  auto new_timer = std::make_shared<Timer>(TIMEOUT);
-  new_timer->user_data_ = old_timer->user_data_;
-  new_timer->cb_func_ = __TimerCallback;
-  g_timer_client_data[sockfd].timer = new_timer;
-  g_timer_heap.AddTimer(new_timer);
-}
\ No newline at end of file
+/** 到期时再按连接最后一次读写的时间判断是否真的超时，没有超时则重新设定。
+ * 连接可能正在被工作线程处理，所以只关闭读写，由持有者关闭连接；
+ * 连接已在工作线程中关闭时令牌失效，什么也不做 */
+void DummyServer::__TimerCallback(uint64_t token) {
+  g_conn_table.Visit(token, [](HttpConn* conn) {
+    if (NowMs() >= conn->Deadline()) {
+      Metrics::Inc(__timeout_counter_[conn->stage()]);
+      conn->Shutdown();
+    } else {
+      __ResetTimer(conn);
+    }
+  });
+}
+
+/** 按连接当前阶段的超时时间设定定时器。请求交给工作线程后，阶段会在工作线程
+ * 中变为发送应答和空闲，超时时间随之提前，但工作线程不能操作定时器，所以此时
+ * 最迟每隔宽限时间或 keep-alive 超时检查一次 */
+void DummyServer::__ResetTimer(HttpConn* conn) {
+  uint64_t now = NowMs();
+  uint64_t expire = conn->Deadline();
+  HttpConn::Stage_ stage = conn->stage();
+  if (stage == HttpConn::STAGE_BUSY || stage == HttpConn::STAGE_DRAIN) {
+    int check = HttpConn::body_timeout_;
+    if (HttpConn::keepalive_timeout_ > 0)
+      check = std::min(check, HttpConn::keepalive_timeout_);
+    expire = std::min<uint64_t>(expire, now + check * 1000ULL);
+  }
+  g_timer_heap.AdjustTimer(conn->timer(), expire > now ? expire - now : 0);
+}
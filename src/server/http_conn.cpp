@@ -1,5 +1,10 @@
 #include "http_conn.h"
 
+#include <netinet/tcp.h>
+
+#include "conn_limiter.h"
+#include "regist_batcher.h"
+#include "tokenizer.h"
 #include "urlcode.h"
 
 /* 定义 HTTP 响应的状态信息 */
@@ -27,39 +32,90 @@ const char *error_500_title = "Internal Error";
 const char *error_500_form =
     "There was an unusual problem serving the request file.\n";
 
+const char HttpConn::kBusyResponse[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+
+/* 统计信息的 URL */
+const char *stats_url = "/__stats";
+
 /* 网站根目录 */
 const char *doc_root = "root/";
 const char *default_page = "index.html";
 
-int HttpConn::user_cnt_ = 0;
+std::atomic<int> HttpConn::user_cnt_(0);
+std::atomic<uint32_t> HttpConn::__conn_seq_(0);
 int HttpConn::epollfd_ = -1;
-
-static map<string, string> users;  // 所用用户名和密码
-static Locker locker;              // 用户名数据加锁
+bool HttpConn::cork_ = false;
+int HttpConn::keepalive_timeout_ = 15;
+int HttpConn::max_requests_ = 1000;
+int HttpConn::header_timeout_ = 20;
+int HttpConn::body_timeout_ = 20;
+int HttpConn::min_rate_ = 500;
+void (HttpConn::*HttpConn::__send_)(HttpCode_) = &HttpConn::__Send<EtPolicy>;
+int HttpConn::__code_counter_[HTTP_CODE_NUM];
+int HttpConn::__bytes_counter_ = -1;
+int HttpConn::__write_wait_counter_ = -1;
+int HttpConn::__phase_hist_[ROUTE_NUM][PHASE_NUM];
+
+static map<string, string> users;       // 所用用户名和密码
+static std::set<string> pending_users;  // 正在写入数据库的用户名
+static Locker locker;                   // 用户名数据加锁
 
 map<string, File> HttpConn::__resources_;
 
+/* 描述符在释放槽位时关闭，与定时器的 Shutdown 互斥，
+ * 保证 Shutdown 不会作用到复用了同一个描述符的其他连接上 */
 void HttpConn::CloseConn(bool real_close) {
   if (real_close && (__sockfd_ != -1)) {
     if (RemoveFd(epollfd_, __sockfd_) < 0) LOGWARN("RemoveFd error");
-    g_timer_heap.DelTimer(g_timer_client_data[__sockfd_].timer);  // 删除定时器
+    Logger::Capture(__conn_id_, kCaptureClose);
+    int sockfd = __sockfd_;
     __sockfd_ = -1;
     --user_cnt_;
+    __DetachBuf();
+    g_conn_limiter.Release(__addr_.sin_addr.s_addr);
+    g_conn_table.Free(__token_, [sockfd] {
+      if (close(sockfd) < 0) LOGWARN("close error");
+    });
   }
 }
 
-void HttpConn::Init(int sockfd, const sockaddr_in &addr,
-                    TriggerMode trigger_mode) {
-  if (AddFd(epollfd_, sockfd, true, trigger_mode) < 0) {
+void HttpConn::Shutdown() {
+  if (__sockfd_ != -1) shutdown(__sockfd_, SHUT_RDWR);
+}
+
+void HttpConn::SendBusy() {
+  if (send(__sockfd_, kBusyResponse, sizeof(kBusyResponse) - 1,
+           MSG_NOSIGNAL) < 0)
+    LOGWARN("send error");
+  /* 先发 FIN，已排队的应答发送完后对方才会读到结束 */
+  shutdown(__sockfd_, SHUT_WR);
+}
+
+template <typename Io>
+bool HttpConn::Init(int sockfd, const sockaddr_in &addr, uint64_t token) {
+  if (AddFd<Io>(epollfd_, sockfd, true, token) < 0) {
     LOGWARN("AddFd error");
-    if (close(sockfd) < 0) LOGERR("close error");
-    return;
+    g_conn_limiter.Release(addr.sin_addr.s_addr);
+    g_conn_table.Free(token, [sockfd] {
+      if (close(sockfd) < 0) LOGERR("close error");
+    });
+    return false;
   }
   __sockfd_ = sockfd;
+  __token_ = token;
   __addr_ = addr;
-  __trigger_mode_ = trigger_mode;
+  __conn_id_ = ++__conn_seq_;
+  Logger::Capture(__conn_id_, kCaptureOpen);
   ++user_cnt_;
+  __requests_ = 0;
+  __active_ms_ = NowMs();
+  __SetStage(STAGE_HEADER, __active_ms_);
   __Init();
+  return true;
 }
 
 void HttpConn::__Init() {
@@ -67,109 +123,170 @@ void HttpConn::__Init() {
   __linger_ = false;
   __method_ = GET;
   __url_ = 0;
+  __basename_ = 0;
+  __route_ = ROUTE_OTHER;
   __version_ = 0;
   __content_length_ = 0;
-  __host_ = 0;
+  __header_cnt_ = 0;
+  memset(__header_index_, -1, sizeof(__header_index_));
   __start_line_ = 0;
   __cur_idx_ = 0;
+  __colon_ = -1;
   __read_idx_ = 0;
+  __pipelined_ = false;
   __write_idx_ = 0;
   __request_file_ = NULL;
   __range_start_ = 0;
   __range_end_ = -1;
   __bytes_to_send_ = 0;
   __bytes_have_sent_ = 0;
-  memset(__read_buf, '\0', kReadBufSize_);
-  memset(__write_buf_, '\0', kWriteBufSize);
-  memset(__real_file_, '\0', kFileNameLen_);
+  __corked_ = false;
 }
 
-/* 从状态机 */
+void HttpConn::__AttachBuf() {
+  if (__buf_ == NULL) __buf_ = SlabPool<HttpBuf>::Get();
+}
+
+/* 缓冲区中还有流水线请求时不能归还，由 __KeepPipelined() 判断 */
+void HttpConn::__DetachBuf() {
+  if (__buf_ == NULL) return;
+  SlabPool<HttpBuf>::Put(__buf_);
+  __buf_ = NULL;
+  /* 统计信息可能较大，不随空闲连接保留 */
+  if (__stats_buf_.capacity() > 0) string().swap(__stats_buf_);
+}
+
+/** 客户端可能不等应答就发出下一个请求，这些数据在当前请求之后，
+ * 把它们移到缓冲区开头，有则返回 true，此时缓冲区不能归还 */
+bool HttpConn::__KeepPipelined() {
+  int end = __cur_idx_;
+  if (__check_state_ == CHECK_STATE_CONTENT) {
+    end += __content_length_;
+    /* __ParseContent() 把消息体之后的一个字节改成了 '\0' */
+    if (end < __read_idx_) __buf_->read[end] = __next_char_;
+  }
+  int left = __read_idx_ - end;
+  __Init();
+  if (left <= 0) return false;
+  memmove(__buf_->read, __buf_->read + end, left);
+  __read_idx_ = left;
+  __buf_->read[__read_idx_] = '\0';
+  return true;
+}
+
+/* 从状态机，行尾和行内第一个 ':' 在同一遍扫描中找出 */
 HttpConn::LineState_ HttpConn::__ParseLine() {
-  char tmp;
-  for (; __cur_idx_ < __read_idx_; ++__cur_idx_) {
-    tmp = __read_buf[__cur_idx_];
-    if (tmp == '\r') {
-      if ((__cur_idx_ + 1) == __read_idx_) {
-        /* 还需要继续读 */
-        return LINE_OPEN;
-      } else if (__read_buf[__cur_idx_ + 1] == '\n') {
-        /* 一行读完了，将 '\r\n' 变为 '\0\0' */
-        __read_buf[__cur_idx_++] = '\0';
-        __read_buf[__cur_idx_++] = '\0';
-        return LINE_OK;
-      }
-      /* 请求有问题 */
-      return LINE_BAD;
-    } else if (tmp == '\n') {
-      if (__cur_idx_ > 1 && __read_buf[__cur_idx_ - 1] == '\r') {
-        /* 一行读完了，将 '\r\n' 变为 '\0\0' */
-        __read_buf[__cur_idx_ - 1] = '\0';
-        __read_buf[__cur_idx_++] = '\0';
-        return LINE_OK;
-      }
-      return LINE_BAD;
+  const char *colon = NULL;
+  const char *end = __buf_->read + __read_idx_;
+  const char *p = FindLineEnd(__buf_->read + __cur_idx_, end,
+                              __colon_ < 0 ? &colon : NULL);
+  if (colon) __colon_ = colon - __buf_->read;
+  __cur_idx_ = p - __buf_->read;
+  if (p == end) {
+    /* 还要继续读 */
+    return LINE_OPEN;
+  }
+  if (*p == '\r') {
+    if ((__cur_idx_ + 1) == __read_idx_) {
+      /* 还需要继续读 */
+      return LINE_OPEN;
+    } else if (__buf_->read[__cur_idx_ + 1] == '\n') {
+      /* 一行读完了，将 '\r\n' 变为 '\0\0' */
+      __buf_->read[__cur_idx_++] = '\0';
+      __buf_->read[__cur_idx_++] = '\0';
+      return LINE_OK;
     }
+    /* 请求有问题 */
+    return LINE_BAD;
   }
-  /* 还要继续读 */
-  return LINE_OPEN;
+  if (__cur_idx_ > 1 && __buf_->read[__cur_idx_ - 1] == '\r') {
+    /* 一行读完了，将 '\r\n' 变为 '\0\0' */
+    __buf_->read[__cur_idx_ - 1] = '\0';
+    __buf_->read[__cur_idx_++] = '\0';
+    return LINE_OK;
+  }
+  return LINE_BAD;
 }
 
 /* 循环读取客户数据，直到无数据可读或对方关闭连接 */
+template <typename Io>
 bool HttpConn::Read() {
+  __AttachBuf();
+  /* 读完后缓冲区中的数据都会被解析，包括流水线请求 */
+  __pipelined_ = false;
   if (__read_idx_ >= kReadBufSize_) {
     /* 缓存区溢出 */
     return false;
   }
 
-  int bytes_read = 0;
-  if (__trigger_mode_ == ET) {
-    while (1) {
-      bytes_read = recv(__sockfd_, __read_buf + __read_idx_,
-                        kReadBufSize_ - __read_idx_, 0);
-      if (bytes_read == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          /* 非阻塞 */
-          break;
-        }
-        LOGWARN("recv error");
-        if (SendError(__sockfd_, "Internal read error") < 0)
-          LOGWARN("SendError error");
-        return false;
-      } else if (bytes_read == 0) {
-        /* 对方关闭连接 */
-        return false;
-      } else {
-        __read_idx_ += bytes_read;
-      }
-    }
-  } else {
-    bytes_read = recv(__sockfd_, __read_buf + __read_idx_,
-                      kReadBufSize_ - __read_idx_, 0);
+  /* ET 读到 EAGAIN 或缓冲区满为止，LT 只读一次 */
+  int total = 0;
+  do {
+    int bytes_read = recv(__sockfd_, __buf_->read + __read_idx_,
+                          kReadBufSize_ - __read_idx_, 0);
     if (bytes_read == -1) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
         /* 非阻塞 */
-        return true;
+        break;
       }
-      LOGERR("recv error");
-      if (SendError(__sockfd_, "Internal read error") < 0)
-        LOGWARN("SendError error");
+      LOGWARN("recv error");
       return false;
     } else if (bytes_read == 0) {
       /* 对方关闭连接 */
       return false;
-    } else {
-      __read_idx_ += bytes_read;
     }
+    __Capture(bytes_read);
+    __read_idx_ += bytes_read;
+    total += bytes_read;
+  } while (Io::kDrain && __read_idx_ < kReadBufSize_);
+  /* 缓冲区不再每次清零，在数据末尾补 '\0' 供字符串函数使用 */
+  __buf_->read[__read_idx_] = '\0';
+  __t_read_ = NowUs();
+  if (total > 0) {
+    uint64_t now = __t_read_ / 1000;
+    __active_ms_ = now;
+    /* 下一个请求的第一个字节，开始计算头部的时限 */
+    if (stage() == STAGE_IDLE) __SetStage(STAGE_HEADER, now);
+    __stage_bytes_ += total;
   }
   return true;
 }
 
-/* 解析 HTTP 请求行，获取请求方法、目标 URL、HTTP 版本号 */
-HttpConn::HttpCode_ HttpConn::__ParseRequestLine(char *text) {
+/** 头部有固定的时限，不因读到数据而推后，一个字节一个字节地发送头部的
+ * 慢速连接在时限到达后即被关闭；消息体与应答在宽限时间之后，每读写
+ * min_rate_ 字节才能再延长一秒，即要求平均速率不低于 min_rate_ */
+uint64_t HttpConn::Deadline() const {
+  uint64_t stage = __stage_.load(std::memory_order_acquire);
+  uint64_t start = stage & ((1ULL << kStageShift) - 1);
+  switch ((Stage_)(stage >> kStageShift)) {
+    case STAGE_HEADER:
+      return start + header_timeout_ * 1000ULL;
+    case STAGE_BODY:
+    case STAGE_DRAIN:
+      if (min_rate_ == 0)
+        return __active_ms_.load(std::memory_order_relaxed) +
+               body_timeout_ * 1000ULL;
+      return start + body_timeout_ * 1000ULL +
+             __stage_bytes_.load(std::memory_order_relaxed) * 1000 / min_rate_;
+    case STAGE_IDLE:
+      return start + keepalive_timeout_ * 1000ULL;
+    default:
+      return start + TIMEOUT * 1000ULL;
+  }
+}
+
+/* 抓包时记录刚读到的 n 字节 */
+void HttpConn::__Capture(int n) {
+  if (Logger::Capturing()) {
+    Logger::Capture(__conn_id_, kCaptureData, __buf_->read + __read_idx_, n);
+  }
+}
+
+/* 解析 HTTP 请求行，获取请求方法、目标 URL、HTTP 版本号，end 为行尾 */
+HttpConn::HttpCode_ HttpConn::__ParseRequestLine(char *text, char *end) {
   /* 在 text 中找到第一个 ' ' 或 '\t' 出现的位置 */
-  __url_ = strpbrk(text, " \t");
-  if (!__url_) {
+  __url_ = (char *)FindSpace(text, end);
+  if (__url_ == end) {
     /* 没找到分隔符 */
     return BAD_REQUEST;
   }
@@ -188,13 +305,18 @@ HttpConn::HttpCode_ HttpConn::__ParseRequestLine(char *text) {
   /* 将 __url 前进到下一字段，下字段内容即为 url */
   __url_ += strspn(__url_, " \t");  // 返回第一个不含 ' ' 或 '\t' 的下标
   /* 最后一字段为 HTTP 版本号，将 __version 指向最后一段 */
-  __version_ = strpbrk(__url_, " \t");
-  if (!__version_) {
+  __version_ = (char *)FindSpace(__url_, end);
+  if (__version_ == end) {
     return BAD_REQUEST;
   }
   *(__version_++) = '\0';
   __version_ += strspn(__version_, " \t");
-  if (strcasecmp(__version_, "HTTP/1.1") != 0) {
+  /* HTTP/1.1 默认保持连接，HTTP/1.0 默认不保持，可被 Connection 头部改变 */
+  if (strcasecmp(__version_, "HTTP/1.1") == 0) {
+    __linger_ = true;
+  } else if (strcasecmp(__version_, "HTTP/1.0") == 0) {
+    __linger_ = false;
+  } else {
     return BAD_REQUEST;
   }
 
@@ -212,55 +334,151 @@ HttpConn::HttpCode_ HttpConn::__ParseRequestLine(char *text) {
   return NO_REQUEST;
 }
 
-/* 解析 HTTP 请求的一个头部信息 */
-HttpConn::HttpCode_ HttpConn::__ParseHeaders(char *text) {
+/* 不区分大小写比较 */
+static inline bool EqualsIgnoreCase(std::string_view s, std::string_view expect) {
+  return s.size() == expect.size() &&
+         strncasecmp(s.data(), expect.data(), s.size()) == 0;
+}
+
+/* 已知头部的小写名称，顺序与 Header_ 一致 */
+static constexpr std::string_view kHeaderNames[HttpConn::HEADER_NUM] = {
+    "accept",          "accept-encoding",   "accept-language",
+    "authorization",   "cache-control",     "connection",
+    "content-length",  "content-type",      "cookie",
+    "expect",          "host",              "if-modified-since",
+    "if-none-match",   "if-range",          "origin",
+    "pragma",          "range",             "referer",
+    "transfer-encoding", "upgrade",         "user-agent",
+    "x-forwarded-for",
+};
+
+/** 已知头部名称的完美哈希：长度、首字符和末字符（转为小写）的组合对槽数取模，
+ * 系数是离线搜索得到的，增加头部后如有冲突，编译时 static_assert 会失败 */
+static constexpr size_t kHeaderSlots = 64;
+static constexpr size_t HeaderHash(std::string_view name) {
+  return (name.size() + 4 * (name.front() | 0x20) + (name.back() | 0x20)) %
+         kHeaderSlots;
+}
+
+/* 哈希槽到头部编号的映射，空槽为 -1 */
+struct HeaderSlots {
+  int8_t id[kHeaderSlots];
+  bool perfect;  // 没有冲突
+};
+
+static constexpr HeaderSlots BuildHeaderSlots() {
+  HeaderSlots slots{};
+  for (auto &id : slots.id) id = -1;
+  slots.perfect = true;
+  for (int i = 0; i < HttpConn::HEADER_NUM; ++i) {
+    size_t h = HeaderHash(kHeaderNames[i]);
+    if (slots.id[h] != -1) slots.perfect = false;
+    slots.id[h] = i;
+  }
+  return slots;
+}
+
+static constexpr HeaderSlots kHeaderSlotTable = BuildHeaderSlots();
+static_assert(kHeaderSlotTable.perfect, "header name hash has collisions");
+
+HttpConn::Header_ HttpConn::LookupHeader(std::string_view name) {
+  if (name.empty()) return HEADER_OTHER;
+  int id = kHeaderSlotTable.id[HeaderHash(name)];
+  if (id < 0 || !EqualsIgnoreCase(name, kHeaderNames[id])) return HEADER_OTHER;
+  return (Header_)id;
+}
+
+std::string_view HttpConn::Header(std::string_view name) const {
+  Header_ id = LookupHeader(name);
+  if (id != HEADER_OTHER) return Header(id);
+  for (int i = __header_cnt_ - 1; i >= 0; --i) {
+    if (EqualsIgnoreCase(__buf_->headers[i].name, name)) return __buf_->headers[i].value;
+  }
+  return std::string_view();
+}
+
+/** 解析 HTTP 请求的一个头部信息，colon 为 __ParseLine 找到的 ':'，end 为行尾
+ * 所有头部都记录到 __buf_->headers 中，这里只处理影响解析和应答的几个 */
+HttpConn::HttpCode_ HttpConn::__ParseHeaders(char *text, char *colon,
+                                             char *end) {
   /* 空行表示头部字段解析完毕 */
   if (text[0] == '\0') {
     /* 如果 HTTP 请求有消息体，则还需读取 __content_length_ 字节的消息体，
      * 且状态转换为 CHECK_STATE_CONTENT 状态 */
     if (__content_length_ != 0) {
+      /* 消息体必须能放进读缓冲区的剩余空间 */
+      if (__content_length_ > kReadBufSize_ - __cur_idx_) return BAD_REQUEST;
       __check_state_ = CHECK_STATE_CONTENT;
       return NO_REQUEST;
     }
     /* 已获得一个完整的 HTTP 请求 */
     return GET_REQUEST;
-  } else if (strncasecmp(text, "Connection:", 11) == 0) {
-    /* 处理 Connection 字段 */
-    text += 11;
-    text += strspn(text, " \t");
-    if (strcasecmp(text, "keep-alive") == 0) {
-      __linger_ = true;
+  }
+  if (colon == NULL) {
+    /* 没有 ':' 的行不是头部，忽略 */
+    return NO_REQUEST;
+  }
+  if (__header_cnt_ == kMaxHeaders) {
+    return BAD_REQUEST;
+  }
+  char *value = colon + 1;
+  value += strspn(value, " \t");
+  while (end > value && (end[-1] == ' ' || end[-1] == '\t')) --end;
+  HeaderField &field = __buf_->headers[__header_cnt_];
+  field.name = std::string_view(text, colon - text);
+  field.value = std::string_view(value, end - value);
+  field.id = LookupHeader(field.name);
+  if (field.id != HEADER_OTHER) __header_index_[field.id] = __header_cnt_;
+  ++__header_cnt_;
+
+  switch (field.id) {
+    case HEADER_CONNECTION:
+      /* 值是以 ',' 分隔的选项列表，close 优先于 keep-alive */
+      for (std::string_view list = field.value; !list.empty();) {
+        size_t comma = list.find(',');
+        std::string_view opt = list.substr(0, comma);
+        list = comma == std::string_view::npos ? std::string_view()
+                                               : list.substr(comma + 1);
+        while (!opt.empty() && (opt.front() == ' ' || opt.front() == '\t'))
+          opt.remove_prefix(1);
+        while (!opt.empty() && (opt.back() == ' ' || opt.back() == '\t'))
+          opt.remove_suffix(1);
+        if (EqualsIgnoreCase(opt, "close")) {
+          __linger_ = false;
+          break;
+        }
+        if (EqualsIgnoreCase(opt, "keep-alive")) __linger_ = true;
+      }
+      break;
+    case HEADER_CONTENT_LENGTH: {
+      /* 只接受十进制数字，负数会让消息体的结尾落在读缓冲区之前，
+       * 过大的值截断为 int 后可能变成看似合法的长度 */
+      char *num_end;
+      long n = strtol(value, &num_end, 10);
+      if (num_end == value || num_end != end || n < 0 || n > kReadBufSize_)
+        return BAD_REQUEST;
+      __content_length_ = n;
+      break;
     }
-  } else if (strncasecmp(text, "Content-Length:", 15) == 0) {
-    /* 处理 Content-Length 字段 */
-    text += 15;
-    text += strspn(text, " \t");
-    __content_length_ = atol(text);
-  } else if (strncasecmp(text, "Host:", 5) == 0) {
-    /* 处理 Host 字段 */
-    text += 5;
-    text += strspn(text, " \t");
-    __host_ = text;
-  } else if (strncasecmp(text, "Range:", 6) == 0) {
-    /* 处理 Range 字段 */
-    text += 6;
-    text += strspn(text, " \t");
-    text += strspn(text, "bytes=");
-    if (*text == '-') {
-      ++text;
-      __range_start_ = -1;
-      __range_end_ = atol(text);
-    } else {
-      __range_start_ = atol(text);
-      text += strcspn(text, "-") + 1;
-      if (*text == '\0') {
-        __range_end_ = -1;
+    case HEADER_RANGE:
+      /* 形如 bytes=起始-结束，起始或结束可以省略 */
+      value += strspn(value, "bytes=");
+      if (*value == '-') {
+        ++value;
+        __range_start_ = -1;
+        __range_end_ = atol(value);
       } else {
-        __range_end_ = atol(text);
+        __range_start_ = atol(value);
+        value += strcspn(value, "-") + 1;
+        if (*value == '\0') {
+          __range_end_ = -1;
+        } else {
+          __range_end_ = atol(value);
+        }
       }
-    }
-  } else {
-    LOGINFO("unknown header: %s", text);
+      break;
+    default:
+      break;
   }
   return NO_REQUEST;
 }
@@ -268,6 +486,7 @@ HttpConn::HttpCode_ HttpConn::__ParseHeaders(char *text) {
 /* 判断 HTTP 请求的消息体是否完整读入 */
 HttpConn::HttpCode_ HttpConn::__ParseContent(char *text) {
   if (__read_idx_ >= (__content_length_ + __cur_idx_)) {
+    __next_char_ = text[__content_length_];
     text[__content_length_] = '\0';
     return GET_REQUEST;
   }
@@ -283,27 +502,32 @@ HttpConn::HttpCode_ HttpConn::__ProcessRead() {
          ((line_status = __ParseLine()) == LINE_OK)) {
     text = __GetLine();
     __start_line_ = __cur_idx_;
-    LOGINFO("got 1 http line: %s", text);
+    /* 行尾的 "\r\n" 已改为 "\0\0" */
+    char *line_end = __buf_->read + __cur_idx_ - 2;
+    char *colon = __colon_ >= 0 ? __buf_->read + __colon_ : NULL;
+    __colon_ = -1;
     switch (__check_state_) {
       case CHECK_STATE_REQUESTLINE:
-        ret = __ParseRequestLine(text);
+        ret = __ParseRequestLine(text, line_end);
         if (ret == BAD_REQUEST) {
           return BAD_REQUEST;
         }
         break;
       case CHECK_STATE_HEADER:
-        ret = __ParseHeaders(text);
+        ret = __ParseHeaders(text, colon, line_end);
         if (ret == BAD_REQUEST) {
           return BAD_REQUEST;
         }
         if (ret == GET_REQUEST) {
-          return __DoRequest(text);
+          __content_ = text;
+          return GET_REQUEST;
         }
         break;
       case CHECK_STATE_CONTENT:
         ret = __ParseContent(text);
         if (ret == GET_REQUEST) {
-          return __DoRequest(text);
+          __content_ = text;
+          return GET_REQUEST;
         }
         line_status = LINE_OPEN;
         break;
@@ -315,45 +539,87 @@ HttpConn::HttpCode_ HttpConn::__ProcessRead() {
   return NO_REQUEST;
 }
 
-/* 得到完整 HTTP 请求后，分析目标文件属性，将其映射到内存地址 __file_addr_ 处 */
-HttpConn::HttpCode_ HttpConn::__DoRequest(char *text) {
-  strcpy(__real_file_, doc_root);
+/* 得到完整 HTTP 请求后，解码 url，确定目标文件与请求类别，
+ * 在主线程中调用，所以只做不会阻塞的工作 */
+HttpConn::HttpCode_ HttpConn::__Route() {
+  __route_ = ROUTE_STATIC;
+  if (strcmp(__url_, stats_url) == 0) {
+    __route_ = ROUTE_STATS;
+    return GET_REQUEST;
+  }
+
+  strcpy(__buf_->real_file, doc_root);
   int len = strlen(doc_root);
-  char buf[kFileNameLen_ - len];
-  /* url 解码 */
-  if (UrlDecode(__url_, buf, kFileNameLen_ - len) < 0) {
+  /* url 在读缓冲区中原地解码，解码后再分类，编码过的 url 不会被分错通道 */
+  int url_len = UrlDecodeInPlace(__url_, strlen(__url_));
+  if (url_len < 0) {
     return BAD_REQUEST;
   }
   /* 获取请求参数 */
-  char *arg = strchr(buf, '?');
-  if (arg) *(arg++) = '\0';
+  char *arg = (char *)memchr(__url_, '?', url_len);
+  if (arg) {
+    *(arg++) = '\0';
+    url_len = arg - 1 - __url_;
+  }
+  if (url_len >= kFileNameLen_ - len) {
+    return BAD_REQUEST;
+  }
 
-  strncpy(__real_file_ + len - 1, buf, kFileNameLen_ - len);
+  strncpy(__buf_->real_file + len - 1, __url_, kFileNameLen_ - len);
 
   if (__method_ == POST) {
-    char *basename = strrchr(__real_file_, '/');
+    char *basename = strrchr(__buf_->real_file, '/');
     ++basename;
+    __basename_ = basename;
     if (strcmp(basename, "sqllogin") == 0) {
-      __Login(basename);
+      __route_ = ROUTE_LOGIN;
     } else if (strcmp(basename, "sqlregister") == 0) {
-      __Regist(basename);
-    } else if (strcmp(basename, "login") == 0) {  // 进入登录页面
-      strcpy(basename, "login.html");
-    } else if (strcmp(basename, "register") == 0) {  // 进入注册页面
-      strcpy(basename, "register.html");
+      __route_ = ROUTE_REGISTER;
     } else if (strcmp(basename, "run") == 0) {
-      return __RunPython(text);
+      __route_ = ROUTE_CGI;
     }
   }
+  return GET_REQUEST;
+}
+
+/* 按 __Route() 确定的类别处理请求，找到目标文件或生成应答内容 */
+HttpConn::HttpCode_ HttpConn::__DoRequest(char *text) {
+  switch (__route_) {
+    case ROUTE_STATS:
+      __stats_buf_ = Metrics::Render();
+      return STATS_REQUEST;
+    case ROUTE_LOGIN:
+      __Login(__basename_);
+      break;
+    case ROUTE_REGISTER:
+      /* 校验通过的注册请求交给 RegistBatcher，提交后再应答 */
+      if (__Regist(__basename_)) return PENDING_REQUEST;
+      break;
+    case ROUTE_CGI:
+      return __RunPython(text);
+    default:
+      if (__method_ != POST) break;
+      if (strcmp(__basename_, "login") == 0) {  // 进入登录页面
+        strcpy(__basename_, "login.html");
+      } else if (strcmp(__basename_, "register") == 0) {  // 进入注册页面
+        strcpy(__basename_, "register.html");
+      }
+      break;
+  }
 
-  if (strcmp(__real_file_, "root/") == 0) {
+  if (strcmp(__buf_->real_file, "root/") == 0) {
     /* 返回 default_page */
-    strcat(__real_file_, default_page);
+    strcat(__buf_->real_file, default_page);
   }
-  if (__resources_.count(__real_file_) == 0) {
+  return __DoFile();
+}
+
+/* 查找 __buf_->real_file 对应的静态资源，并根据 Range 字段确定发送范围 */
+HttpConn::HttpCode_ HttpConn::__DoFile() {
+  if (__resources_.count(__buf_->real_file) == 0) {
     return NO_RESOURCE;
   }
-  __request_file_ = &__resources_[__real_file_];
+  __request_file_ = &__resources_[__buf_->real_file];
   if (!(__request_file_->file_stat_.st_mode & S_IROTH)) {
     return FORBIDDEN_REQUEST;
   }
@@ -382,51 +648,65 @@ bool HttpConn::__Login(char *basename) {
   char password[31];
   if (!__GetUserPasswd(username, password)) return false;
 
-  if (users.find(username) != users.end() && users[username] == password) {
-    strcpy(basename, "welcome.html");
-    return true;
-  }
-  strcpy(basename, "login_error.html");
-  return false;
+  /* RegistDone 会在写入线程中插入新用户，查找时也要加锁 */
+  locker.Lock();
+  auto it = users.find(username);
+  bool ok = it != users.end() && it->second == password;
+  locker.Unlock();
+  strcpy(basename, ok ? "welcome.html" : "login_error.html");
+  return ok;
 }
 
+/* 校验注册请求，校验通过则交给 RegistBatcher 批量写入数据库并返回 true */
 bool HttpConn::__Regist(char *basename) {
   /* 提取 POST 参数 */
   char username[51];
   char password[31];
-  if (!__GetUserPasswd(username, password)) return false;
+  if (!__GetUserPasswd(username, password)) {
+    strcpy(basename, "register_error.html");
+    return false;
+  }
 
-  char sql_statement[300];
-  sprintf(sql_statement,
-          "INSERT INTO user(username, passwd) VALUES('%s', '%s')", username,
-          password);
-  if (users.count(username)) {
+  /* 用户名已存在，或者同名用户正在注册中 */
+  locker.Lock();
+  if (users.count(username) || pending_users.count(username)) {
+    locker.Unlock();
     strcpy(basename, "register_error.html");
     return false;
   }
-  MYSQL *mysql;
-  ConnectionRaii conn(mysql);
+  pending_users.insert(username);
+  locker.Unlock();
+
+  RegistBatcher::Append(this, username, password);
+  return true;
+}
+
+/* 注册请求所在批次提交完成，更新用户缓存并完成应答 */
+void HttpConn::RegistDone(const char *username, const char *passwd, bool ok) {
   locker.Lock();
-  int result = mysql_query(mysql, sql_statement);
-  users.insert(std::make_pair(username, password));
+  pending_users.erase(username);
+  if (ok) users.insert(std::make_pair(username, passwd));
   locker.Unlock();
 
-  if (!result) {
-    strcpy(basename, "login.html");
-    return true;
-  }
-  strcpy(basename, "register_error.html");
-  return false;
+  strcpy(__basename_, ok ? "login.html" : "register_error.html");
+  HttpCode_ ret = __DoFile();
+  __t_handled_ = NowUs();
+  (this->*__send_)(ret);
 }
 
 bool HttpConn::__GetUserPasswd(char *username, char *passwd) {
-  char *tmp = strpbrk(&__read_buf[__cur_idx_], "=");
+  char *tmp = strpbrk(&__buf_->read[__cur_idx_], "=");
   if (tmp == nullptr) {
     username[0] = '\0';
     return false;
   }
+  /* 用户名最长 50 字节，密码最长 30 字节，与调用者的缓冲区大小一致 */
   int i = 0;
   for (; *(++tmp) != '&'; ++i) {
+    if (*tmp == '\0' || i == 50) {
+      username[0] = '\0';
+      return false;
+    }
     username[i] = *tmp;
   }
   username[i] = '\0';
@@ -436,6 +716,10 @@ bool HttpConn::__GetUserPasswd(char *username, char *passwd) {
     return false;
   }
   for (i = 0; *(++tmp) != '\0'; ++i) {
+    if (i == 30) {
+      passwd[0] = '\0';
+      return false;
+    }
     passwd[i] = *tmp;
   }
   passwd[i] = '\0';
@@ -477,13 +761,13 @@ HttpConn::HttpCode_ HttpConn::__RunPython(char *text) {
   }
 
   int content_length = 0;
-  ret = recv(cgisockfd, __cgiret_buf_ + content_length, kWriteBufSize, 0);
+  ret = recv(cgisockfd, __buf_->cgiret + content_length, kWriteBufSize, 0);
   if (ret < 0) {
     LOGWARN("recv error");
     return INTERNAL_ERROR;
   }
   content_length += ret;
-  __cgiret_buf_[content_length] = '\0';
+  __buf_->cgiret[content_length] = '\0';
   if (close(cgisockfd) < 0) {
     LOGERR("close error");
     exit(-1);
@@ -504,110 +788,115 @@ void HttpConn::ReleaseStaticResource() {
   }
 }
 
-/* 每次调用 writev 都需要调整 __iov_ */
-void HttpConn::__AdjustIov() {
-  if (__bytes_have_sent_ > __write_idx_) {
-    __iov_[0].iov_len = 0;
-    __iov_[1].iov_base = __request_file_->addr_ + __range_start_ +
-                         (__bytes_have_sent_ - __write_idx_);
-    __iov_[1].iov_len = __bytes_to_send_;
-  } else {
-    __iov_[0].iov_base = __write_buf_ + __bytes_have_sent_;
-    __iov_[0].iov_len = __write_idx_ - __bytes_have_sent_;
+/* 每次调用 writev 后都需要按写出的 n 字节调整 __iov_，
+ * 应答体可能是文件、cgi 输出或统计信息，所以只移动 iov 本身 */
+void HttpConn::__AdjustIov(int n) {
+  for (int i = 0; i < __iov_cnt_ && n > 0; ++i) {
+    size_t len = (size_t)n < __iov_[i].iov_len ? n : __iov_[i].iov_len;
+    __iov_[i].iov_base = (char *)__iov_[i].iov_base + len;
+    __iov_[i].iov_len -= len;
+    n -= len;
   }
 }
 
-/* 写 HTTP 响应 */
+/* 设置或解除 TCP_CORK，解除时立即发出剩余的不满一个报文段的数据 */
+void HttpConn::__Cork(int on) {
+  if (setsockopt(__sockfd_, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) < 0)
+    LOGWARN("setsockopt TCP_CORK error");
+  __corked_ = on;
+}
+
+/* 写 HTTP 响应，可能在工作线程中调用，所以重设 one-shot 事件必须是最后一步，
+ * 之后连接就交给了主线程 */
+template <typename Io>
 bool HttpConn::Write() {
-  int tmp = 0;
   if (__bytes_to_send_ == 0) {
-    if (ModFd(epollfd_, __sockfd_, EPOLLIN, __trigger_mode_) < 0) {
+    __Init();
+    __DetachBuf();
+    __SetStage(STAGE_IDLE, NowMs());
+    if (__ModFd<Io>(EPOLLIN) < 0) {
       LOGWARN("ModFd error");
       return false;
     }
-    __Init();
     return true;
   }
-  if (__trigger_mode_ == ET) {
-    while (1) {
-      tmp = writev(__sockfd_, __iov_, __iov_cnt_);
-      if (tmp < 0) {
-        if (errno == EAGAIN) {
-          /* 若写缓冲区没有空间，则等待缓冲区可写，在此期间无法接收客户端请求 */
-          if (ModFd(epollfd_, __sockfd_, EPOLLOUT, __trigger_mode_) < 0) {
-            LOGWARN("ModFd error");
-            return false;
-          }
-          return true;
-        }
-        LOGERR("writev error");
-        if (SendError(__sockfd_, "Internal write error") < 0)
-          LOGWARN("SendError error");
-        return false;
-      }
-      __bytes_to_send_ -= tmp;
-      __bytes_have_sent_ += tmp;
-      __AdjustIov();
-
-      if (__bytes_to_send_ <= 0) {
-        /* HTTP 响应发送成功，根据 Connection 字段决定是否立即关闭连接 */
-        if (__linger_) {
-          __Init();
-          if (ModFd(epollfd_, __sockfd_, EPOLLIN, __trigger_mode_) < 0) {
-            LOGWARN("ModFd error");
-            return false;
-          }
-          return true;
-        } else {
-          if (ModFd(epollfd_, __sockfd_, EPOLLIN, __trigger_mode_) < 0)
-            LOGWARN("ModFd error");
-          return false;
-        }
-      }
-    }
-  } else {
-    tmp = writev(__sockfd_, __iov_, __iov_cnt_);
+  if (__bytes_have_sent_ == 0 && stage() != STAGE_DRAIN)
+    __SetStage(STAGE_DRAIN, NowMs());
+  /* ET 写到 EAGAIN 或写完为止，LT 只写一次 */
+  do {
+    int tmp = writev(__sockfd_, __iov_, __iov_cnt_);
     if (tmp < 0) {
       if (errno == EAGAIN) {
         /* 若写缓冲区没有空间，则等待缓冲区可写，在此期间无法接收客户端请求 */
-        if (ModFd(epollfd_, __sockfd_, EPOLLOUT, __trigger_mode_) < 0) {
-          LOGWARN("ModFd error");
-          return false;
-        }
-        return true;
+        Metrics::Inc(__write_wait_counter_);
+        break;
       }
       LOGERR("writev error");
-      if (SendError(__sockfd_, "Internal write error") < 0)
-        LOGWARN("SendError error");
       return false;
     }
+    Metrics::Inc(__bytes_counter_, tmp);
+    __active_ms_ = NowMs();
+    __stage_bytes_ += tmp;
     __bytes_to_send_ -= tmp;
     __bytes_have_sent_ += tmp;
-    __AdjustIov();
-
-    if (__bytes_to_send_ <= 0) {
-      /* HTTP 响应发送成功，根据 Connection 字段决定是否立即关闭连接 */
-      if (__linger_) {
-        __Init();
-        if (ModFd(epollfd_, __sockfd_, EPOLLIN, __trigger_mode_) < 0) {
-          LOGWARN("ModFd error");
-          return false;
-        }
-        return true;
-      } else {
-        if (ModFd(epollfd_, __sockfd_, EPOLLIN, __trigger_mode_) < 0)
-          LOGWARN("ModFd error");
-        return false;
-      }
-    } else {
-      if (ModFd(epollfd_, __sockfd_, EPOLLIN, __trigger_mode_) < 0) {
-        LOGWARN("ModFd error");
-        return false;
-      }
-      return true;
+    __AdjustIov(tmp);
+    /* 一次没写完时才设置 TCP_CORK，剩下的按整报文段发出 */
+    if (cork_ && !__corked_ && __bytes_to_send_ > 0) __Cork(1);
+  } while (Io::kDrain && __bytes_to_send_ > 0);
+
+  if (__bytes_to_send_ > 0) {
+    /* 还没写完，等待可写 */
+    if (__ModFd<Io>(EPOLLOUT) < 0) {
+      LOGWARN("ModFd error");
+      return false;
     }
+    return true;
   }
-  return false;
+  /* HTTP 响应发送成功，根据 Connection 字段决定是否立即关闭连接 */
+  if (__corked_) __Cork(0);
+  __RecordWrite();
+  if (!__linger_) {
+    /* 先发 FIN，已排队的应答发送完后对方才会读到结束 */
+    shutdown(__sockfd_, SHUT_WR);
+    return false;
+  }
+  if (__KeepPipelined()) {
+    /* 下一个请求已经到达，套接字可写，注册的可写事件会立即触发，
+     * 由主线程解析并分派，工作线程不能直接分派 */
+    __pipelined_ = true;
+    __SetStage(STAGE_HEADER, __active_ms_);
+    if (__ModFd<Io>(EPOLLOUT) < 0) {
+      LOGWARN("ModFd error");
+      return false;
+    }
+    return true;
+  }
+  __DetachBuf();
+  /* 进入空闲，主线程的定时器据此改用 keep-alive 超时 */
+  __SetStage(STAGE_IDLE, __active_ms_);
+  if (__ModFd<Io>(EPOLLIN) < 0) {
+    LOGWARN("ModFd error");
+    return false;
+  }
+  return true;
+}
+
+/* 记录从读完请求到应答填充完毕之间各阶段的延迟，在处理请求的线程中调用 */
+void HttpConn::__RecordPhases() {
+  int *hist = __phase_hist_[__route_];
+  Metrics::Record(hist[PHASE_PARSE], __t_parsed_ - __t_read_);
+  Metrics::Record(hist[PHASE_QUEUE], __t_dequeued_ - __t_parsed_);
+  Metrics::Record(hist[PHASE_HANDLE], __t_handled_ - __t_dequeued_);
+  Metrics::Record(hist[PHASE_RESPOND], __t_queued_ - __t_handled_);
+}
+
+/* 记录写应答阶段与整个请求的延迟，在写完应答的线程中调用，
+ * 可能是主线程，也可能是直接写应答的工作线程，记入该线程的直方图分片 */
+void HttpConn::__RecordWrite() {
+  uint64_t now = NowUs();
+  int *hist = __phase_hist_[__route_];
+  Metrics::Record(hist[PHASE_WRITE], now - __t_queued_);
+  Metrics::Record(hist[PHASE_TOTAL], now - __t_read_);
 }
 
 /* 往写缓冲区中写入待发送的数据 */
@@ -618,7 +907,7 @@ bool HttpConn::__AddResponse(const char *format, ...) {
 
   va_list arg_list;
   va_start(arg_list, format);
-  int len = vsnprintf(__write_buf_ + __write_idx_,
+  int len = vsnprintf(__buf_->write + __write_idx_,
                       kWriteBufSize - __write_idx_ - 1, format, arg_list);
   if (len >= (kWriteBufSize - __write_idx_ - 1)) {
     return false;
@@ -657,8 +946,13 @@ bool HttpConn::__AddContentRange() {
 }
 
 bool HttpConn::__AddLinger() {
-  return __AddResponse("Connection: %s\r\n",
-                       (__linger_ == true) ? "keep-alive" : "close");
+  if (!__linger_) return __AddResponse("Connection: close\r\n");
+  if (max_requests_ == 0)
+    return __AddResponse("Connection: keep-alive\r\nKeep-Alive: timeout=%d\r\n",
+                         keepalive_timeout_);
+  return __AddResponse(
+      "Connection: keep-alive\r\nKeep-Alive: timeout=%d, max=%d\r\n",
+      keepalive_timeout_, max_requests_ - __requests_);
 }
 
 bool HttpConn::__AddBlankLine() { return __AddResponse("%s", "\r\n"); }
@@ -699,7 +993,7 @@ bool HttpConn::__ProcessWrite(HttpCode_ ret) {
       }
       if (send_file_size != 0) {
         __AddHeaders(send_file_size);
-        __iov_[0].iov_base = __write_buf_;
+        __iov_[0].iov_base = __buf_->write;
         __iov_[0].iov_len = __write_idx_;
         __iov_[1].iov_base = __request_file_->addr_ + __range_start_;
         __iov_[1].iov_len = send_file_size;
@@ -714,48 +1008,172 @@ bool HttpConn::__ProcessWrite(HttpCode_ ret) {
     } break;
     case CGI_REQUEST: {
       __AddStatusLine(200, ok_200_title);
-      int content_length = strlen(__cgiret_buf_);
+      int content_length = strlen(__buf_->cgiret);
       __AddHeaders(content_length);
-      __iov_[0].iov_base = __write_buf_;
+      __iov_[0].iov_base = __buf_->write;
       __iov_[0].iov_len = __write_idx_;
-      __iov_[1].iov_base = __cgiret_buf_;
+      __iov_[1].iov_base = __buf_->cgiret;
       __iov_[1].iov_len = content_length;
       __bytes_to_send_ = __write_idx_ + content_length;
       __iov_cnt_ = 2;
       return true;
       break;
     }
+    case STATS_REQUEST: {
+      __AddStatusLine(200, ok_200_title);
+      __AddResponse("Content-Type: text/plain; version=0.0.4\r\n");
+      __AddHeaders(__stats_buf_.size());
+      __iov_[0].iov_base = __buf_->write;
+      __iov_[0].iov_len = __write_idx_;
+      __iov_[1].iov_base = (void *)__stats_buf_.data();
+      __iov_[1].iov_len = __stats_buf_.size();
+      __bytes_to_send_ = __write_idx_ + __stats_buf_.size();
+      __iov_cnt_ = 2;
+      return true;
+    }
     default:
       return false;
   }
-  __iov_[0].iov_base = __write_buf_;
+  __iov_[0].iov_base = __buf_->write;
   __iov_[0].iov_len = __write_idx_;
   __iov_cnt_ = 1;
   __bytes_to_send_ = __write_idx_;
   return true;
 }
 
-/* 有线程池中的工作线程调用，是处理 HTTP 请求的入口函数 */
+/* 由主线程在读完数据后调用，解析请求并按类别选择处理的通道。
+ * 静态资源都已加载到内存，查找和填充应答很快，直接在主线程中处理，
+ * 可能阻塞的 CGI 和其他请求交给各自的线程池，彼此不会排在对方后面 */
+HttpConn::Lane_ HttpConn::Prepare() {
+  __parse_ret_ = __ProcessRead();
+  if (__parse_ret_ == GET_REQUEST) __parse_ret_ = __Route();
+  __t_parsed_ = NowUs();
+  /* 头部收齐后，消息体改按速率限制；请求完整后按处理超时 */
+  if (__parse_ret_ != NO_REQUEST) {
+    __SetStage(STAGE_BUSY, __t_parsed_ / 1000);
+  } else if (__check_state_ == CHECK_STATE_CONTENT &&
+             stage() == STAGE_HEADER) {
+    __SetStage(STAGE_BODY, __t_parsed_ / 1000);
+  }
+  if (__parse_ret_ != GET_REQUEST) return LANE_INLINE;
+  switch (__route_) {
+    case ROUTE_STATIC:
+      return LANE_INLINE;
+    case ROUTE_CGI:
+      return LANE_CGI;
+    default:
+      return LANE_APP;
+  }
+}
+
+/* 处理 Prepare() 解析好的请求 */
+HttpConn::HttpCode_ HttpConn::__Handle() {
+  __t_dequeued_ = NowUs();
+  if (__parse_ret_ == NO_REQUEST) return NO_REQUEST;
+  /* 请求行或头部出错时不经过 __DoRequest */
+  HttpCode_ ret =
+      __parse_ret_ == GET_REQUEST ? __DoRequest(__content_) : __parse_ret_;
+  __t_handled_ = NowUs();
+  return ret;
+}
+
+/* 由通道的工作线程调用 */
 void HttpConn::Process() {
-  HttpCode_ read_ret = __ProcessRead();
-  if (read_ret == NO_REQUEST) {
+  HttpCode_ ret = __Handle();
+  /* PENDING_REQUEST 时异步处理中，由处理完成的线程调用 __Send() */
+  if (ret == NO_REQUEST || ret == PENDING_REQUEST) return;
+  (this->*__send_)(ret);
+}
+
+/* 由主线程调用，填充应答后由调用者直接写 */
+template <typename Io>
+bool HttpConn::ProcessInline() {
+  HttpCode_ ret = __Handle();
+  if (ret == NO_REQUEST) {
     /* 还没收到完整请求，继续监听 */
-    if (ModFd(epollfd_, __sockfd_, EPOLLIN, __trigger_mode_)) {
+    if (__ModFd<Io>(EPOLLIN) < 0) {
       LOGWARN("ModFd error");
       CloseConn();
     }
-    return;
+    return false;
   }
-  bool write_ret = __ProcessWrite(read_ret);
+  if (ret == PENDING_REQUEST) return false;
+  return __Reply(ret);
+}
+
+/* 根据处理结果填充应答 */
+bool HttpConn::__Reply(HttpCode_ ret) {
+  Metrics::Inc(__code_counter_[ret]);
+  /* 请求有误时缓冲区中剩余的数据不可信，关闭连接；
+   * 不保持连接或达到单连接的请求数上限时也在应答后关闭 */
+  ++__requests_;
+  if (ret == BAD_REQUEST || ret == INTERNAL_ERROR || keepalive_timeout_ == 0 ||
+      (max_requests_ > 0 && __requests_ >= max_requests_))
+    __linger_ = false;
+  bool write_ret = __ProcessWrite(ret);
   if (!write_ret) {
     /* 出错关闭连接 */
     CloseConn();
-    return;
+    return false;
   }
-  /* 监听是否可写 */
-  if (ModFd(epollfd_, __sockfd_, EPOLLOUT, __trigger_mode_) < 0) {
-    LOGWARN("ModFd error");
-    CloseConn();
+  __t_queued_ = NowUs();
+  __RecordPhases();
+  return true;
+}
+
+/* 在主线程以外填充应答后立即写，连接在注册事件之前一直由本线程持有，
+ * 主线程收不到它的事件，不会同时读写。大多数应答一次就能写完，
+ * 省去一次 epoll_ctl、一次事件循环的唤醒和线程间的交接 */
+template <typename Io>
+void HttpConn::__Send(HttpCode_ ret) {
+  if (!__Reply(ret)) return;
+  /* 写不完时 Write() 注册可写事件，剩下的由主线程继续写 */
+  if (!Write<Io>()) CloseConn();
+}
+
+/* 两种触发模式的实现，DummyServer 在启动时选用其中一种 */
+template bool HttpConn::Init<EtPolicy>(int, const sockaddr_in &, uint64_t);
+template bool HttpConn::Init<LtPolicy>(int, const sockaddr_in &, uint64_t);
+template bool HttpConn::Read<EtPolicy>();
+template bool HttpConn::Read<LtPolicy>();
+template bool HttpConn::Write<EtPolicy>();
+template bool HttpConn::Write<LtPolicy>();
+template bool HttpConn::ProcessInline<EtPolicy>();
+template bool HttpConn::ProcessInline<LtPolicy>();
+template void HttpConn::__Send<EtPolicy>(HttpCode_);
+template void HttpConn::__Send<LtPolicy>(HttpCode_);
+
+void HttpConn::InitMetrics() {
+  static const char *code_str[HTTP_CODE_NUM] = {
+      "NO_REQUEST",     "GET_REQUEST",       "BAD_REQUEST",
+      "NO_RESOURCE",    "FORBIDDEN_REQUEST", "FILE_REQUEST",
+      "INTERNAL_ERROR", "CLOSED_CONNECTION", "CGI_REQUEST",
+      "PENDING_REQUEST", "STATS_REQUEST"};
+  for (int i = 0; i < HTTP_CODE_NUM; ++i) {
+    __code_counter_[i] = Metrics::AddCounter(
+        "dummy_requests_total", "Requests answered, by result",
+        string("code=\"") + code_str[i] + "\"");
+  }
+  __bytes_counter_ =
+      Metrics::AddCounter("dummy_bytes_sent_total", "Bytes written to clients");
+  __write_wait_counter_ = Metrics::AddCounter(
+      "dummy_write_would_block_total",
+      "Writes that filled the socket buffer and waited for EPOLLOUT");
+  Metrics::AddGauge("dummy_active_connections", "Connected clients",
+                    [] { return (double)user_cnt_; });
+
+  static const char *route_str[ROUTE_NUM] = {"other", "static",   "login",
+                                             "register", "cgi", "stats"};
+  static const char *phase_str[PHASE_NUM] = {"parse",   "queue", "handle",
+                                             "respond", "write", "total"};
+  for (int i = 0; i < ROUTE_NUM; ++i) {
+    for (int j = 0; j < PHASE_NUM; ++j) {
+      __phase_hist_[i][j] = Metrics::AddHistogram(
+          "dummy_request_phase_microseconds",
+          "Request latency by route and lifecycle phase",
+          string("route=\"") + route_str[i] + "\",phase=\"" + phase_str[j] +
+              "\"");
+    }
   }
 }
 
@@ -763,6 +1181,10 @@ void HttpConn::InitSqlResult() {
   /* 数据库连接资源获取 */
   MYSQL *mysql = nullptr;
   ConnectionRaii conn(mysql);
+  if (mysql == nullptr) {
+    LOGERR("get sql connection error");
+    exit(-1);
+  }
 
   /* 获取数据库中的用户名密码 */
   if (mysql_query(mysql, "SELECT username, passwd FROM user")) {
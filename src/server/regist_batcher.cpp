@@ -0,0 +1,155 @@
+#include "regist_batcher.h"
+
+#include "http_conn.h"
+
+RegistBatcher::RegistBatcher()
+    : __max_rows_(kMaxRows),
+      __flush_ms_(kFlushInterval),
+      __running_(false),
+      __stop_(false),
+      __batches_(0),
+      __rows_(0),
+      __failed_(0),
+      __max_batch_(0),
+      __flush_us_(0),
+      __pending_cnt_(0) {}
+
+RegistBatcher* RegistBatcher::GetInstance() {
+  static RegistBatcher batcher;
+  return &batcher;
+}
+
+void RegistBatcher::__InitImp(int max_rows, int flush_ms) {
+  assert(max_rows > 0 && flush_ms >= 0);
+  __max_rows_ = max_rows;
+  __flush_ms_ = flush_ms;
+  __stop_ = false;
+  if (pthread_create(&__thread_, NULL, __Worker, this) != 0) {
+    LOGERR("pthread_create error");
+    exit(-1);
+  }
+  __running_ = true;
+}
+
+/* 停止写入线程，队列中剩余的请求会在退出前提交 */
+void RegistBatcher::__StopImp() {
+  if (!__running_) return;
+  __stop_ = true;
+  __pending_.Post();
+  if (pthread_join(__thread_, NULL) != 0) LOGERR("pthread_join error");
+  __running_ = false;
+}
+
+void RegistBatcher::__AppendImp(HttpConn* conn, const char* username,
+                                const char* passwd) {
+  __queue_locker_.Lock();
+  __queue_.push_back(RegistRequest{username, passwd, conn});
+  ++__pending_cnt_;
+  __queue_locker_.Unlock();
+  __pending_.Post();
+}
+
+void* RegistBatcher::__Worker(void* arg) {
+  RegistBatcher* batcher = (RegistBatcher*)arg;
+  batcher->__Run();
+  return batcher;
+}
+
+void RegistBatcher::__Run() {
+  vector<RegistRequest> batch;
+  vector<bool> ok;
+  batch.reserve(__max_rows_);
+  while (true) {
+    /* 等待第一条请求到来，之后最多再等 __flush_ms_ 毫秒凑够一批 */
+    __pending_.Wait();
+    int n = 1;
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += __flush_ms_ * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    while (n < __max_rows_ && !__stop_ && __pending_.TimedWait(deadline)) ++n;
+
+    __queue_locker_.Lock();
+    while (!__queue_.empty() && (int)batch.size() < n) {
+      batch.push_back(std::move(__queue_.front()));
+      __queue_.pop_front();
+    }
+    __pending_cnt_ -= batch.size();
+    bool drained = __queue_.empty();
+    __queue_locker_.Unlock();
+
+    if (!batch.empty()) {
+      uint64_t start = NowUs();
+      __Flush(batch, ok);
+      uint64_t cost = NowUs() - start;
+
+      __batches_ += 1;
+      __rows_ += batch.size();
+      __flush_us_ += cost;
+      if (batch.size() > __max_batch_) __max_batch_ = batch.size();
+      LOGINFO("regist batch committed: %d rows in %lu us", (int)batch.size(),
+              (unsigned long)cost);
+
+      for (size_t i = 0; i < batch.size(); ++i) {
+        if (!ok[i]) ++__failed_;
+        batch[i].conn->RegistDone(batch[i].username.c_str(),
+                                  batch[i].passwd.c_str(), ok[i]);
+      }
+      batch.clear();
+    }
+    /* Stop() 会额外 Post 一次，所以退出前要把队列中剩下的请求都提交掉 */
+    if (__stop_ && drained) break;
+  }
+}
+
+void RegistBatcher::__Flush(vector<RegistRequest>& batch, vector<bool>& ok) {
+  ok.assign(batch.size(), false);
+
+  MYSQL* mysql = nullptr;
+  ConnectionRaii conn(mysql);
+  if (mysql == nullptr) {
+    LOGWARN("no sql connection available, drop %d regist requests",
+            (int)batch.size());
+    return;
+  }
+
+  /* 整批请求在同一个事务中写入，只需要一次提交 */
+  if (mysql_autocommit(mysql, 0)) {
+    LOGWARN("mysql_autocommit error: %s", mysql_error(mysql));
+    return;
+  }
+  char username[2 * 50 + 1];
+  char passwd[2 * 30 + 1];
+  char sql_statement[300];
+  for (size_t i = 0; i < batch.size(); ++i) {
+    mysql_real_escape_string(mysql, username, batch[i].username.c_str(),
+                             batch[i].username.size());
+    mysql_real_escape_string(mysql, passwd, batch[i].passwd.c_str(),
+                             batch[i].passwd.size());
+    snprintf(sql_statement, sizeof(sql_statement),
+             "INSERT INTO user(username, passwd) VALUES('%s', '%s')", username,
+             passwd);
+    ok[i] = (mysql_query(mysql, sql_statement) == 0);
+    if (!ok[i]) LOGWARN("mysql_query error: %s", mysql_error(mysql));
+  }
+  if (mysql_commit(mysql)) {
+    LOGWARN("mysql_commit error: %s", mysql_error(mysql));
+    mysql_rollback(mysql);
+    ok.assign(batch.size(), false);
+  }
+  if (mysql_autocommit(mysql, 1)) {
+    LOGWARN("mysql_autocommit error: %s", mysql_error(mysql));
+  }
+}
+
+void RegistBatcher::Init(int max_rows, int flush_ms) {
+  GetInstance()->__InitImp(max_rows, flush_ms);
+}
+
+void RegistBatcher::Stop() { GetInstance()->__StopImp(); }
+
+void RegistBatcher::Append(HttpConn* conn, const char* username,
+                           const char* passwd) {
+  GetInstance()->__AppendImp(conn, username, passwd);
+}
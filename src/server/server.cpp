@@ -7,7 +7,6 @@
 #include "locker.h"
 #include "threadpool.h"
 
-#define MAX_FD 65535
 #define MAX_EVENT_NUM 10000
 
 using std::unique_ptr;
@@ -18,6 +17,7 @@ int main(int argc, char** argv) {
 
   // 初始化 logger
   Logger::Init(kInfo, config.log_path_, config.verbose_);
+  if (!config.capture_file_.empty()) Logger::InitCapture(config.capture_file_);
 
   DummyServer server(config);
 
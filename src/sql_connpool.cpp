@@ -1,8 +1,15 @@
 #include "sql_connpool.h"
 
 SqlConnpool::SqlConnpool() {
+  __max_conn_ = 0;
+  __min_conn_ = 0;
+  __total_conn_ = 0;
   __cur_conn_ = 0;
   __free_conn_ = 0;
+  __port_ = 0;
+  __running_ = false;
+  __stop_ = false;
+  __timeouts_ = 0;
 }
 
 SqlConnpool* SqlConnpool::GetInstance() {
@@ -10,22 +17,76 @@ SqlConnpool* SqlConnpool::GetInstance() {
   return &conn_pool;
 }
 
-/* 获取一个可用连接，更新空闲连接数和已使用连接数 */
-MYSQL* SqlConnpool::__GetConnectionImp() {
-  MYSQL* conn = nullptr;
-
-  if (__conn_list_.size() == 0) return nullptr;
+/* 建立一个新连接，失败返回 nullptr */
+MYSQL* SqlConnpool::__Connect() {
+  MYSQL* conn = mysql_init(nullptr);
+  if (conn == nullptr) {
+    LOGERR("mysql_init error");
+    return nullptr;
+  }
+  if (mysql_real_connect(conn, url_.c_str(), user_.c_str(), passwd_.c_str(),
+                         db_name_.c_str(), __port_, nullptr, 0) == nullptr) {
+    LOGWARN("mysql_real_connect error: %s", mysql_error(conn));
+    mysql_close(conn);
+    return nullptr;
+  }
+  return conn;
+}
 
-  __reserve_.Wait();
+/* 取出一个空闲连接，调用前需已获得 __reserve_ */
+MYSQL* SqlConnpool::__PopFree() {
   __lock_.Lock();
-
-  conn = __conn_list_.front();
+  MYSQL* conn = __conn_list_.front().conn;
   __conn_list_.pop_front();
   --__free_conn_;
   ++__cur_conn_;
+  __lock_.Unlock();
+  return conn;
+}
+
+/* 获取一个可用连接：优先使用空闲连接，其次在未达上限时新建连接，
+ * 否则等待其他线程归还，最多等待 timeout_ms 毫秒 */
+MYSQL* SqlConnpool::__GetConnectionImp(int timeout_ms) {
+  uint64_t start = NowUs();
 
+  if (__reserve_.TryWait()) {
+    MYSQL* conn = __PopFree();
+    __wait_us_.Record(NowUs() - start);
+    return conn;
+  }
+
+  /* 没有空闲连接，扩容 */
+  __lock_.Lock();
+  if (__total_conn_ < __max_conn_) {
+    ++__total_conn_;
+    ++__cur_conn_;
+    __lock_.Unlock();
+    MYSQL* conn = __Connect();
+    if (conn != nullptr) {
+      __wait_us_.Record(NowUs() - start);
+      return conn;
+    }
+    __lock_.Lock();
+    --__total_conn_;
+    --__cur_conn_;
+  }
   __lock_.Unlock();
 
+  /* 已达上限，等待归还 */
+  timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+  deadline.tv_nsec %= 1000000000L;
+  if (!__reserve_.TimedWait(deadline)) {
+    ++__timeouts_;
+    __wait_us_.Record(NowUs() - start);
+    LOGWARN("get sql connection timeout after %d ms", timeout_ms);
+    return nullptr;
+  }
+  MYSQL* conn = __PopFree();
+  __wait_us_.Record(NowUs() - start);
   return conn;
 }
 
@@ -35,7 +96,7 @@ bool SqlConnpool::__ReleaseConnectionImp(MYSQL* conn) {
 
   __lock_.Lock();
 
-  __conn_list_.push_back(conn);
+  __conn_list_.push_front(IdleConn{conn, time(NULL)});
   ++__free_conn_;
   --__cur_conn_;
 
@@ -48,54 +109,172 @@ bool SqlConnpool::__ReleaseConnectionImp(MYSQL* conn) {
 /* 初始化连接 */
 void SqlConnpool::__InitImp(const string& url, const string& user,
                             const string& passwd, const string& database_name,
-                            int port, int max_conn) {
+                            int port, int min_conn, int max_conn) {
   url_ = url;
+  port_ = std::to_string(port);
   user_ = user;
   passwd_ = passwd;
   db_name_ = database_name;
+  __port_ = port;
+  __min_conn_ = min_conn > 0 ? min_conn : 1;
+  __max_conn_ = max_conn > __min_conn_ ? max_conn : __min_conn_;
 
-  for (int i = 0; i < max_conn; ++i) {
-    MYSQL* conn = nullptr;
-    conn = mysql_init(conn);
-
-    if (conn == nullptr) {
-      LOGERR("mysql_init error");
-      exit(-1);
-    }
-
-    conn =
-        mysql_real_connect(conn, url_.c_str(), user_.c_str(), passwd_.c_str(),
-                           db_name_.c_str(), port, nullptr, 0);
+  for (int i = 0; i < __min_conn_; ++i) {
+    MYSQL* conn = __Connect();
     if (conn == nullptr) {
       LOGERR("mysql_real_connect error");
       exit(-1);
     }
-    __conn_list_.push_back(conn);
+    __conn_list_.push_back(IdleConn{conn, time(NULL)});
     ++__free_conn_;
+    ++__total_conn_;
+    __reserve_.Post();
+  }
+
+  __stop_ = false;
+  if (pthread_create(&__keeper_, NULL, __Keeper, this) != 0) {
+    LOGERR("pthread_create error");
+    exit(-1);
+  }
+  __running_ = true;
+}
+
+void* SqlConnpool::__Keeper(void* arg) {
+  SqlConnpool* pool = (SqlConnpool*)arg;
+  pool->__Keep();
+  return pool;
+}
+
+/* 每隔 kPingInterval 秒检查一遍空闲连接 */
+void SqlConnpool::__Keep() {
+  while (!__stop_) {
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += kPingInterval;
+    __keeper_wake_.TimedWait(deadline);
+    if (__stop_) break;
+
+    /* 像普通使用者一样通过 __reserve_ 取出空闲连接，检查完再放回 */
+    list<IdleConn> checked;
+    time_t now = time(NULL);
+    int n = free_conn();
+    for (int i = 0; i < n && __reserve_.TryWait(); ++i) {
+      __lock_.Lock();
+      IdleConn idle = __conn_list_.back();
+      __conn_list_.pop_back();
+      --__free_conn_;
+      bool shrink = __total_conn_ > __min_conn_;
+      if (shrink && now - idle.last_used >= kIdleTimeout) --__total_conn_;
+      __lock_.Unlock();
+
+      if (shrink && now - idle.last_used >= kIdleTimeout) {
+        /* 空闲太久，缩容 */
+        mysql_close(idle.conn);
+        continue;
+      }
+      if (mysql_ping(idle.conn) != 0) {
+        /* 连接已失效，重新连接 */
+        LOGWARN("mysql_ping error: %s, reconnecting", mysql_error(idle.conn));
+        mysql_close(idle.conn);
+        idle.conn = __Connect();
+        if (idle.conn == nullptr) {
+          __lock_.Lock();
+          --__total_conn_;
+          __lock_.Unlock();
+          continue;
+        }
+      }
+      checked.push_front(idle);
+    }
+
+    /* 放回连接池末尾，保持按归还时间排列 */
+    __lock_.Lock();
+    int returned = checked.size();
+    __free_conn_ += returned;
+    __conn_list_.splice(__conn_list_.end(), checked);
+    __lock_.Unlock();
+    for (int i = 0; i < returned; ++i) __reserve_.Post();
+
+    /* 重连失败等原因导致连接数低于下限时补齐 */
+    while (!__stop_) {
+      __lock_.Lock();
+      if (__total_conn_ >= __min_conn_) {
+        __lock_.Unlock();
+        break;
+      }
+      ++__total_conn_;
+      __lock_.Unlock();
+      MYSQL* conn = __Connect();
+      if (conn == nullptr) {
+        __lock_.Lock();
+        --__total_conn_;
+        __lock_.Unlock();
+        break;
+      }
+      __lock_.Lock();
+      __conn_list_.push_back(IdleConn{conn, time(NULL)});
+      ++__free_conn_;
+      __lock_.Unlock();
+      __reserve_.Post();
+    }
+
+    LOGINFO("sql pool: %d total, %d free, wait p50 %lu us, p99 %lu us, %lu "
+            "timeouts",
+            total_conn(), free_conn(),
+            (unsigned long)__wait_us_.Percentile(50),
+            (unsigned long)__wait_us_.Percentile(99),
+            (unsigned long)__timeouts_.load());
   }
-  __reserve_ = Sem(0, __free_conn_);
-  __max_conn_ = __free_conn_;
 }
 
 /* 销毁连接池 */
 void SqlConnpool::__DestroyPoolImp() {
+  if (__running_) {
+    __stop_ = true;
+    __keeper_wake_.Post();
+    if (pthread_join(__keeper_, NULL) != 0) LOGERR("pthread_join error");
+    __running_ = false;
+  }
   __lock_.Lock();
   while (__conn_list_.size() > 0) {
     auto it = __conn_list_.begin();
-    mysql_close(*it);
-    --__cur_conn_;
+    mysql_close(it->conn);
+    --__total_conn_;
     --__free_conn_;
     __conn_list_.erase(it);
   }
   __lock_.Unlock();
 }
 
-int SqlConnpool::free_conn() { return __free_conn_; }
+int SqlConnpool::max_conn() { return __max_conn_; }
+
+int SqlConnpool::min_conn() { return __min_conn_; }
+
+int SqlConnpool::cur_conn() {
+  __lock_.Lock();
+  int ret = __cur_conn_;
+  __lock_.Unlock();
+  return ret;
+}
+
+int SqlConnpool::free_conn() {
+  __lock_.Lock();
+  int ret = __free_conn_;
+  __lock_.Unlock();
+  return ret;
+}
+
+int SqlConnpool::total_conn() {
+  __lock_.Lock();
+  int ret = __total_conn_;
+  __lock_.Unlock();
+  return ret;
+}
 
 SqlConnpool::~SqlConnpool() { __DestroyPoolImp(); }
 
-MYSQL* SqlConnpool::GetConnection() {
-  return GetInstance()->__GetConnectionImp();
+MYSQL* SqlConnpool::GetConnection(int timeout_ms) {
+  return GetInstance()->__GetConnectionImp(timeout_ms);
 }
 
 bool SqlConnpool::ReleaseConnection(MYSQL* conn) {
@@ -106,8 +285,9 @@ void SqlConnpool::DestroyPool() { GetInstance()->__DestroyPoolImp(); }
 
 void SqlConnpool::Init(const string& url, const string& user,
                        const string& passwd, const string& db_name, int port,
-                       int max_conn) {
-  GetInstance()->__InitImp(url, user, passwd, db_name, port, max_conn);
+                       int min_conn, int max_conn) {
+  GetInstance()->__InitImp(url, user, passwd, db_name, port, min_conn,
+                           max_conn);
 }
 
 ConnectionRaii::ConnectionRaii(MYSQL*& conn) {
@@ -115,4 +295,4 @@ ConnectionRaii::ConnectionRaii(MYSQL*& conn) {
   conn_raii = conn;
 }
 
-ConnectionRaii::~ConnectionRaii() { SqlConnpool::ReleaseConnection(conn_raii); }
\ No newline at end of file
+ConnectionRaii::~ConnectionRaii() { SqlConnpool::ReleaseConnection(conn_raii); }
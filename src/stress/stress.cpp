@@ -1,23 +1,145 @@
+#include <getopt.h>
 #include <netdb.h>
 
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "capture.h"
 #include "common.h"
+#include "histogram.h"
+
+using std::deque;
+using std::string;
+using std::vector;
 
-#define BUFSIZE 2048
+#define BUFSIZE 16384
 
-/* 每个客户连接不停地向服务器发送这个请求 */
-static char request[BUFSIZE];
 static char host[BUFSIZE];
+static string path;  // url 中的路径，没有场景文件时所有连接都请求它
+static sockaddr_in server_addr;
+/* 开环模式下的目标总速率（请求/秒），0 表示闭环：收到应答后立即发送下一个 */
+static double rate = 0;
+/* 请求按计划时间发送（开环模式或回放模式） */
+static bool scheduled = false;
 volatile bool stop = false;
-int speed = 0;
-int bytes = 0;
-int failed = 0;
-int conn_num = 1;
+/* 客户端连接的套接字选项，用于对比服务器 --sockopt 各选项的效果 */
+static SockOpts sock_opts;
+static const char* sock_opts_str = NULL;
+
+/** 一种请求模板，场景文件中每行一个：
+ *   权重 名称 方法 路径 [range=起始-结束] [churn] [body=消息体]
+ * 路径和消息体中的 {seq} 替换为本次测试中唯一的序号，{rand} 替换为随机数，
+ * churn 表示每个请求都使用一个新建立的连接 */
+struct Scenario {
+  string name;
+  int weight;
+  string method;
+  string path;
+  string range;
+  string body;
+  bool churn;
+  bool dynamic;    // 含有占位符，每次发送前重新生成请求
+  string request;  // 不含占位符时预先生成的请求
+};
+static vector<Scenario> scenarios;
+static int total_weight = 0;
+static bool has_scenario_file = false;
+static unsigned run_id;  // 区分不同次测试生成的序号
+
+/* 回放模式下抓包文件中的各个连接 */
+static vector<CaptureSession> sessions;
+static bool replay = false;
+static double speed = 1;        // 回放倍速
+static uint64_t replay_requests = 0;  // 抓包中的请求数
+static uint64_t truncated = 0;  // 抓包结束时不完整的请求字节数
+static uint64_t replay_start;   // 开始回放的时间
 
 void alarm_handler(int) { stop = true; }
 
-void build_request(const char* url) {
-  memset(request, '\0', sizeof(request));
-  strcpy(request, "GET ");
+/* 一个客户连接的状态 */
+struct Conn {
+  int fd;              // socket，-1 表示未连接
+  bool connecting;     // 非阻塞 connect 还没有完成
+  bool busy;           // 有请求正在等待应答
+  int scenario;        // 当前请求的场景，-1 表示尚未选择
+  int requests;        // 当前连接上已开始的请求数
+  uint64_t connect_us;  // 当前连接开始建立的时间
+  string buf;           // 含占位符的场景生成的请求
+  const string* request;  // 当前请求
+  size_t sent;         // 当前请求已发送的字节数
+  uint64_t start_us;   // 当前请求实际开始发送的时间
+  uint64_t intended_us;  // 当前请求按计划应当发送的时间
+  string header;       // 已收到的应答头部
+  bool in_body;        // 头部已收完，正在接收消息体
+  long body_left;      // 消息体剩余字节数，-1 表示读到连接关闭为止
+  bool close_after;    // 应答带有 Connection: close
+  int status;          // 应答状态码
+  /* 开环模式 */
+  double next_due;        // 下一个请求的计划发送时间（微秒）
+  double interval;        // 相邻两个请求的计划间隔（微秒）
+  deque<uint64_t> backlog;  // 已到计划时间、但因连接忙而排队的请求
+  /* 回放模式 */
+  const CaptureSession* session;  // 回放的连接
+  size_t next_event;       // 下一个事件在 session->events 中的下标
+  size_t next_send;        // 下一个要发送的请求
+  bool done;               // 回放完毕
+};
+
+/** 时间轮，每格 1 毫秒，按计划发送时间触发各连接的请求
+ * 计划时间超过一圈的连接留在格子里，转到真正到期的那一圈再触发 */
+struct TimerWheel {
+  static const int kSlots = 1024;
+  vector<Conn*> slots[kSlots];
+  uint64_t cur_ms;  // 下一个要处理的格子对应的时刻（毫秒）
+
+  void Add(Conn* c) { slots[(uint64_t)c->next_due / 1000 % kSlots].push_back(c); }
+};
+
+/* 每个线程的统计结果 */
+struct Stats {
+  uint64_t completed;  // 收到完整应答的请求数
+  uint64_t failed;     // 失败的请求数
+  uint64_t connects;   // 建立的连接数
+  uint64_t bytes;      // 收到的字节数
+  uint64_t status[6];  // 按状态码分类，status[2] 为 2xx，status[0] 为无法解析
+  uint64_t unsent;     // 开环模式下测试结束时仍在排队、未发出的请求数
+  Histogram latency;   // 请求延迟（微秒），开环模式下从计划发送时间算起
+  Histogram service;   // 服务时间（微秒），从实际发送时间算起
+
+  Stats()
+      : completed(0), failed(0), connects(0), bytes(0), status{}, unsent(0) {}
+};
+
+/* 每个线程一个 epoll 循环，负责 conns 中的所有连接 */
+struct Worker {
+  pthread_t tid;
+  int epollfd;
+  vector<Conn> conns;
+  vector<Conn*> closed;  // 等待重新建立的连接
+  TimerWheel wheel;      // 开环模式下的发送计划
+  Stats stats;
+  deque<Stats> scenario_stats;  // 按场景分别统计
+  unsigned seed;                // rand_r 的种子
+  int index;                    // 线程编号
+  uint64_t seq;                 // {seq} 的计数
+  size_t live;                  // 回放模式下尚未回放完毕的连接数
+};
+
+/* 合并统计结果 */
+void merge_stats(Stats* into, const Stats& from) {
+  into->completed += from.completed;
+  into->failed += from.failed;
+  into->connects += from.connects;
+  into->bytes += from.bytes;
+  into->unsent += from.unsent;
+  for (int i = 0; i < 6; ++i) into->status[i] += from.status[i];
+  into->latency.Merge(from.latency);
+  into->service.Merge(from.service);
+}
+
+/* 解析 url，得到主机名和路径 */
+void parse_url(const char* url) {
   if (strstr(url, "://") == NULL) {
     printf("Invalid URL: %s\n", url);
     exit(-1);
@@ -29,156 +151,865 @@ void build_request(const char* url) {
   }
 
   strncpy(host, h, strcspn(h, "/"));
-  strcat(request, h + strcspn(h, "/"));
-  strcat(request, " HTTP/1.1");
-  strcat(request, "\r\n");
-  strcat(request, "User-Agent: DummyWebServer\r\n");
-  strcat(request, "Host: ");
-  strcat(request, host);
-  strcat(request, "\r\n");
-  strcat(request, "Connection: keep-alive\r\n\r\n");
-}
-
-/* 向服务器写入 len 字节的数据 */
-bool write_nbytes(int sockfd, const char* buffer, int len) {
-  int bytes_write = 0;
-  // printf("write out %d bytes to socket %d\n", len, sockfd);
-  while (1) {
-    bytes_write = send(sockfd, buffer, len, 0);
-    if (bytes_write < 0 || bytes_write == 0) return false;
-    len -= bytes_write;
-    buffer = buffer + bytes_write;
-    if (len <= 0) {
-      return true;
-    }
-  }
-}
-
-/* 从服务器读取数据 */
-bool read_once(int sockfd, char* buffer, int len) {
-  int bytes_read = 0;
-  memset(buffer, '\0', len);
-  while ((bytes_read = recv(sockfd, buffer, len, 0)) > 0) {
-    // printf("read in %d bytes from socket %d\n", bytes_read, sockfd);
-    if (stop) return true;
-    bytes += bytes_read;
-  }
-  if (bytes_read == -1 && errno != EAGAIN) return false;
+  path = h + strcspn(h, "/");
+}
+
+/* 替换 {seq} 和 {rand} 占位符 */
+string expand(const string& tmpl, Worker* w) {
+  string ret;
+  size_t pos = 0;
+  while (true) {
+    size_t p = tmpl.find('{', pos);
+    if (p == string::npos) break;
+    ret.append(tmpl, pos, p - pos);
+    char num[64];
+    if (tmpl.compare(p, 5, "{seq}") == 0) {
+      snprintf(num, sizeof(num), "%x-%d-%lu", run_id, w->index,
+               (unsigned long)w->seq++);
+      ret += num;
+      pos = p + 5;
+    } else if (tmpl.compare(p, 6, "{rand}") == 0) {
+      snprintf(num, sizeof(num), "%d", rand_r(&w->seed));
+      ret += num;
+      pos = p + 6;
+    } else {
+      ret += '{';
+      pos = p + 1;
+    }
+  }
+  ret.append(tmpl, pos, string::npos);
+  return ret;
+}
+
+/* 生成场景 s 的请求，w 为空时不替换占位符 */
+string build_request(const Scenario& s, Worker* w) {
+  string body = w ? expand(s.body, w) : s.body;
+  string request = s.method + " " + (w ? expand(s.path, w) : s.path);
+  request += " HTTP/1.1\r\n";
+  request += "User-Agent: DummyWebServer\r\n";
+  request += "Host: ";
+  request += host;
+  request += "\r\n";
+  if (!s.range.empty()) request += "Range: bytes=" + s.range + "\r\n";
+  request += s.churn ? "Connection: close\r\n" : "Connection: keep-alive\r\n";
+  if (!body.empty() || s.method == "POST") {
+    request += "Content-Type: application/x-www-form-urlencoded\r\n";
+    request += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+  }
+  request += "\r\n";
+  return request + body;
+}
+
+/* 读取场景文件，出错时退出 */
+void load_scenarios(const char* file) {
+  FILE* fp = fopen(file, "r");
+  if (fp == NULL) {
+    printf("Cannot open scenario file: %s\n", file);
+    exit(-1);
+  }
+  char line[BUFSIZE];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    ++lineno;
+    line[strcspn(line, "\r\n")] = '\0';
+    char* p = line + strspn(line, " \t");
+    if (*p == '\0' || *p == '#') continue;
+
+    Scenario s;
+    s.churn = false;
+    /* 消息体可能含有空格，body= 之后直到行尾都是消息体 */
+    char* body = strstr(p, " body=");
+    if (body) {
+      s.body = body + 6;
+      *body = '\0';
+    }
+    char* saveptr = NULL;
+    char* weight = strtok_r(p, " \t", &saveptr);
+    char* name = strtok_r(NULL, " \t", &saveptr);
+    char* method = strtok_r(NULL, " \t", &saveptr);
+    char* url = strtok_r(NULL, " \t", &saveptr);
+    if (url == NULL || atoi(weight) <= 0 || url[0] != '/') {
+      printf("%s:%d: invalid scenario\n", file, lineno);
+      exit(-1);
+    }
+    s.weight = atoi(weight);
+    s.name = name;
+    s.method = method;
+    s.path = url;
+    for (char* opt = strtok_r(NULL, " \t", &saveptr); opt;
+         opt = strtok_r(NULL, " \t", &saveptr)) {
+      if (strncmp(opt, "range=", 6) == 0) {
+        s.range = opt + 6;
+      } else if (strcmp(opt, "churn") == 0) {
+        s.churn = true;
+      } else {
+        printf("%s:%d: unknown option %s\n", file, lineno, opt);
+        exit(-1);
+      }
+    }
+    scenarios.push_back(s);
+  }
+  fclose(fp);
+  if (scenarios.empty()) {
+    printf("No scenario in %s\n", file);
+    exit(-1);
+  }
+  has_scenario_file = true;
+}
+
+/* 预先生成不含占位符的请求 */
+void prepare_scenarios() {
+  if (scenarios.empty()) {
+    /* 没有场景文件，只有一个请求 url 的场景 */
+    Scenario s;
+    s.name = "default";
+    s.weight = 1;
+    s.method = "GET";
+    s.path = path;
+    s.churn = false;
+    scenarios.push_back(s);
+  }
+  for (auto& s : scenarios) {
+    total_weight += s.weight;
+    s.dynamic = s.path.find('{') != string::npos ||
+                s.body.find('{') != string::npos;
+    if (!s.dynamic) s.request = build_request(s, NULL);
+  }
+}
+
+/* 读取抓包文件，出错时退出 */
+void load_capture(const char* file) {
+  if (!LoadCapture(file, &sessions, &truncated)) {
+    printf("Invalid capture file: %s\n", file);
+    exit(-1);
+  }
+  if (sessions.empty()) {
+    printf("No connection in %s\n", file);
+    exit(-1);
+  }
+  for (auto& session : sessions) replay_requests += session.requests.size();
+  replay = true;
+}
+
+/* 按权重随机选择一个场景 */
+int pick_scenario(Worker* w) {
+  if (scenarios.size() == 1) return 0;
+  int r = rand_r(&w->seed) % total_weight;
+  for (size_t i = 0; i < scenarios.size(); ++i) {
+    r -= scenarios[i].weight;
+    if (r < 0) return i;
+  }
+  return scenarios.size() - 1;
+}
+
+/* 关闭连接 */
+void close_conn(Worker* w, Conn* c) {
+  if (c->fd < 0) return;
+  epoll_ctl(w->epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->fd = -1;
+  w->closed.push_back(c);
+}
+
+/* 发起非阻塞连接，连接完成时会触发 EPOLLOUT */
+bool open_conn(Worker* w, Conn* c) {
+  c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (c->fd < 0) {
+    LOGERR("socket error");
+    exit(-1);
+  }
+  c->busy = false;
+  c->close_after = false;
+  c->connecting = true;
+  c->requests = 0;
+  c->connect_us = NowUs();
+  if (SetSockOpts(c->fd, sock_opts, false) < 0) {
+    LOGERR("SetSockOpts error");
+    exit(-1);
+  }
+  if (connect(c->fd, (sockaddr*)&server_addr, sizeof(server_addr)) < 0 &&
+      errno != EINPROGRESS) {
+    close(c->fd);
+    c->fd = -1;
+    return false;
+  }
+  epoll_event event;
+  event.data.ptr = c;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+  if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, c->fd, &event) < 0) {
+    LOGERR("epoll_ctl error");
+    exit(-1);
+  }
+  ++w->stats.connects;
+  /* 为 churn 场景新建的连接 */
+  if (c->scenario >= 0) ++w->scenario_stats[c->scenario].connects;
   return true;
 }
 
-/* 向服务器发起 num 个 TCP 连接，可以通过 num 来调整测试压力 */
-void start_conn(int epollfd, int num, const char* host, int port) {
-  struct sockaddr_in addr;
-  bzero(&addr, sizeof(addr));
+/* 开始场景 c->scenario 的一个新请求，intended 为其计划发送时间 */
+void start_request(Worker* w, Conn* c, uint64_t intended) {
+  const Scenario& s = scenarios[c->scenario];
+  if (replay) {
+    c->request = &c->session->requests[c->next_send++];
+  } else if (s.dynamic) {
+    c->buf = build_request(s, w);
+    c->request = &c->buf;
+  } else {
+    c->request = &s.request;
+  }
+  c->busy = true;
+  c->sent = 0;
+  /* churn 场景的延迟包括建立连接的时间 */
+  c->start_us = s.churn ? c->connect_us : NowUs();
+  c->intended_us = scheduled ? intended : c->start_us;
+  c->header.clear();
+  c->in_body = false;
+  c->body_left = 0;
+  c->close_after = s.churn;
+  c->status = 0;
+  ++c->requests;
+}
 
-  addr.sin_port = htons(port);
-  addr.sin_family = AF_INET;
+/* 当前请求失败 */
+void fail_request(Worker* w, Conn* c) {
+  ++w->stats.failed;
+  if (c->scenario >= 0) ++w->scenario_stats[c->scenario].failed;
+  c->scenario = -1;
+  c->busy = false;
+}
 
-  struct hostent* he = gethostbyname(host);
-  memcpy(&(addr.sin_addr), he->h_addr_list[0], sizeof(in_addr));
+/* 尽可能多地发送当前请求，出错返回 false */
+bool send_request(Conn* c) {
+  const string& request = *c->request;
+  while (c->sent < request.size()) {
+    int ret = send(c->fd, request.data() + c->sent, request.size() - c->sent,
+                   MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EAGAIN) return true;
+      return false;
+    }
+    c->sent += ret;
+  }
+  return true;
+}
+
+/* 一个请求收到完整应答 */
+void finish_request(Worker* w, Conn* c) {
+  uint64_t now = NowUs();
+  int cls = c->status / 100;
+  for (Stats* stats : {&w->stats, &w->scenario_stats[c->scenario]}) {
+    /* 从计划时间算起，服务器卡顿时排队等待的时间也计入延迟，
+     * 避免客户端随服务器一起变慢而掩盖卡顿（coordinated omission） */
+    stats->latency.Record(now - c->intended_us);
+    stats->service.Record(now - c->start_us);
+    ++stats->completed;
+    ++stats->status[(cls >= 1 && cls <= 5) ? cls : 0];
+  }
+  c->scenario = -1;
+  c->busy = false;
+}
+
+/* 解析应答头部，header 以 "\r\n\r\n" 结尾 */
+bool parse_header(Conn* c) {
+  const char* h = c->header.c_str();
+  if (strncmp(h, "HTTP/1.", 7) != 0) return false;
+  c->status = atoi(h + 9);
+  c->body_left = -1;
+  if (c->status == 204 || c->status == 304 || c->status / 100 == 1) {
+    c->body_left = 0;
+  }
+  const char* line = strstr(h, "\r\n");
+  while (line && line[2] != '\r') {
+    line += 2;
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      c->body_left = atol(line + 15);
+    } else if (strncasecmp(line, "Connection:", 11) == 0) {
+      const char* v = line + 11;
+      v += strspn(v, " \t");
+      if (strncasecmp(v, "close", 5) == 0) c->close_after = true;
+    }
+    line = strstr(line, "\r\n");
+  }
+  return true;
+}
+
+/* 处理收到的应答数据，应答不合法时返回 false */
+bool on_data(Worker* w, Conn* c, const char* data, int len) {
+  w->stats.bytes += len;
+  if (!c->busy) return false;  // 没有请求却收到了数据
+  w->scenario_stats[c->scenario].bytes += len;
+  if (!c->in_body) {
+    size_t old = c->header.size();
+    c->header.append(data, len);
+    size_t end = c->header.find("\r\n\r\n", old >= 3 ? old - 3 : 0);
+    if (end == string::npos) return c->header.size() < BUFSIZE;
+    size_t body = end + 4 - old;  // 消息体在 data 中的起始位置
+    c->header.resize(end + 4);
+    if (!parse_header(c)) return false;
+    c->in_body = true;
+    data += body;
+    len -= body;
+  }
+  if (c->body_left < 0) return true;  // 读到连接关闭为止
+  if (len > c->body_left) return false;  // 不支持 pipeline，不应有多余数据
+  c->body_left -= len;
+  if (c->body_left == 0) finish_request(w, c);
+  return true;
+}
+
+/* 连接空闲时开始下一个请求：闭环模式立即开始，开环模式取出排队的请求
+ * 选中的 churn 场景需要新连接时关闭当前连接，待重新连接后再发送 */
+void next_request(Worker* w, Conn* c) {
+  if (scheduled && c->backlog.empty()) return;
+  if (c->scenario < 0) c->scenario = pick_scenario(w);
+  if (scenarios[c->scenario].churn && c->requests > 0) {
+    close_conn(w, c);
+    return;
+  }
+  uint64_t intended = 0;
+  if (scheduled) {
+    intended = c->backlog.front();
+    c->backlog.pop_front();
+  }
+  start_request(w, c, intended);
+}
+
+/* 处理连接上的事件 */
+void handle_event(Worker* w, Conn* c, uint32_t events) {
+  char buf[BUFSIZE];
+  if (c->connecting) {
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+    if (err != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+      fail_request(w, c);
+      close_conn(w, c);
+      return;
+    }
+    c->connecting = false;
+  }
+
+  /* 读取应答 */
+  bool closed = false;
+  while (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+    int ret = recv(c->fd, buf, sizeof(buf), 0);
+    if (ret > 0) {
+      if (!on_data(w, c, buf, ret)) {
+        fail_request(w, c);
+        closed = true;
+        break;
+      }
+      continue;
+    }
+    if (ret < 0 && errno == EAGAIN) break;
+    /* 对方关闭连接或出错 */
+    if (c->busy) {
+      if (c->in_body && c->body_left < 0) {
+        finish_request(w, c);
+      } else {
+        fail_request(w, c);
+      }
+    }
+    closed = true;
+    break;
+  }
+  if (!closed && !c->busy && c->close_after) closed = true;
+  if (closed) {
+    close_conn(w, c);
+    return;
+  }
+
+  /* 上一个请求已完成，发送下一个 */
+  if (!c->busy && !stop) next_request(w, c);
+  if (c->busy && !send_request(c)) {
+    fail_request(w, c);
+    close_conn(w, c);
+  }
+}
+
+/* 开环模式下一个请求到了计划发送时间，连接空闲时立即发送，否则排队 */
+void on_arrival(Worker* w, Conn* c, uint64_t intended) {
+  c->backlog.push_back(intended);
+  if (c->fd < 0 || c->connecting || c->busy) return;
+  next_request(w, c);
+  if (c->busy && !send_request(c)) {
+    fail_request(w, c);
+    close_conn(w, c);
+  }
+}
+
+/* 回放模式下连接的所有事件都已触发，且请求都已完成或无法再发送时，
+ * 关闭连接，该连接回放完毕 */
+void replay_check(Worker* w, Conn* c) {
+  if (c->done || c->next_event < c->session->events.size()) return;
+  if (c->fd >= 0 && (c->connecting || c->busy || !c->backlog.empty())) return;
+  c->done = true;
+  --w->live;
+  close_conn(w, c);
+}
 
-  int sockfd[num];
-  for (int i = 0; i < num; ++i) {
-    sockfd[i] = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd[i] < 0) {
-      LOGERR("socket error");
+/* 回放连接 c 上计划时间早于 end 的事件，还有后续事件时返回 true */
+bool replay_events(Worker* w, Conn* c, double end) {
+  const vector<uint64_t>& events = c->session->events;
+  size_t n = c->session->requests.size();
+  while (c->next_due < end) {
+    size_t k = c->next_event++;
+    if (k == 0) {
+      if (!open_conn(w, c)) fail_request(w, c);
+    } else if (k <= n) {
+      on_arrival(w, c, (uint64_t)c->next_due);
+    }
+    /* 关闭事件不需要处理，请求都完成后由 replay_check 关闭 */
+    if (c->next_event == events.size()) {
+      replay_check(w, c);
+      return false;
+    }
+    c->next_due = replay_start + events[c->next_event] / speed;
+  }
+  return true;
+}
+
+/* 触发连接 c 上计划时间早于 end 的事件，还有后续事件时返回 true */
+bool fire(Worker* w, Conn* c, double end) {
+  if (replay) return replay_events(w, c, end);
+  while (c->next_due < end) {
+    on_arrival(w, c, (uint64_t)c->next_due);
+    c->next_due += c->interval;
+  }
+  return true;
+}
+
+/* 触发时间轮上所有已经过去的格子中到期的请求 */
+void tick(Worker* w) {
+  TimerWheel& wheel = w->wheel;
+  uint64_t now_ms = NowUs() / 1000;
+  while (wheel.cur_ms < now_ms) {
+    double end = (wheel.cur_ms + 1) * 1000.0;  // 该格子的结束时刻
+    vector<Conn*>& slot = wheel.slots[wheel.cur_ms % TimerWheel::kSlots];
+    vector<Conn*> due;
+    due.swap(slot);
+    for (Conn* c : due) {
+      if (c->next_due >= end) {
+        slot.push_back(c);  // 还要再转若干圈
+        continue;
+      }
+      if (fire(w, c, end)) wheel.Add(c);
+    }
+    ++wheel.cur_ms;
+  }
+}
+
+void* run_worker(void* arg) {
+  Worker* w = (Worker*)arg;
+  epoll_event events[1024];
+  /* 回放模式下按抓包中的时间建立连接 */
+  for (auto& c : w->conns) {
+    if (!replay && !open_conn(w, &c)) {
+      fail_request(w, &c);
+      w->closed.push_back(&c);
+    }
+  }
+  if (scheduled) {
+    for (auto& c : w->conns) w->wheel.Add(&c);
+  }
+  while (!stop && !(replay && w->live == 0)) {
+    /* 开环和回放模式下每毫秒检查一次时间轮 */
+    int n = epoll_wait(w->epollfd, events, 1024, scheduled ? 1 : 100);
+    if (n < 0 && errno != EINTR) {
+      LOGERR("epoll_wait error");
       exit(-1);
     }
-    if (connect(sockfd[i], (sockaddr*)&addr, sizeof(addr)) < 0) {
-      ++failed;
+    for (int i = 0; i < n; ++i) {
+      Conn* c = (Conn*)events[i].data.ptr;
+      handle_event(w, c, events[i].events);
+      if (replay) replay_check(w, c);
     }
-    printf("connected %d of %d\n", i + 1, num);
-    epoll_event event;
-    event.data.fd = sockfd[i];
-    event.events = EPOLLOUT | EPOLLET | EPOLLERR;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd[i], &event) < 0) {
-      LOGERR("epoll_ctl error");
+    if (scheduled && !stop) tick(w);
+    /* 回放模式下保持抓包中的连接结构，不重新建立连接 */
+    if (replay) w->closed.clear();
+    /* 重新建立被关闭的连接 */
+    vector<Conn*> closed;
+    closed.swap(w->closed);
+    for (Conn* c : closed) {
+      if (!stop && !open_conn(w, c)) {
+        fail_request(w, c);
+        w->closed.push_back(c);
+      }
+    }
+  }
+  for (auto& c : w->conns) {
+    w->stats.unsent += c.backlog.size();
+    close_conn(w, &c);
+  }
+  return w;
+}
+
+void usage(const char* name) {
+  printf(
+      "Usage: %s [option]... url port connection_number time(sec)\n"
+      "   -t|--threads N         number of client threads (default 1)\n"
+      "   -r|--rate RPS          open loop: send at a constant total rate\n"
+      "   -R|--ramp START:STEP:END\n"
+      "                          open loop: raise the rate step by step, each\n"
+      "                          step lasts time(sec), report the knee\n"
+      "   -s|--scenario FILE     send the weighted request mix in FILE\n"
+      "   -C|--replay FILE       replay a capture recorded by server --capture,\n"
+      "                          connection_number is ignored and time(sec),\n"
+      "                          if given, limits the replay\n"
+      "   -x|--speed X           replay X times faster (default 1)\n"
+      "   -o|--sockopt LIST      TCP options of client sockets: a comma\n"
+      "                          separated list of nodelay, fastopen, lowat=N,\n"
+      "                          sndbuf=N, rcvbuf=N or the profiles none,\n"
+      "                          latency and throughput (cork is ignored)\n"
+      "   -j|--json              print the result in JSON\n",
+      name);
+}
+
+/* 一轮测试的结果 */
+struct Result {
+  double target;   // 目标速率，0 表示闭环
+  double elapsed;  // 实际持续时间（秒）
+  Stats total;
+  deque<Stats> scenario_stats;  // 按场景分别统计
+
+  double rps() const { return total.completed / elapsed; }
+  /* 实际速率达到目标的 95% 且失败不超过 1% 视为未饱和 */
+  bool saturated() const {
+    return rps() < target * 0.95 ||
+           total.failed > (total.completed + total.failed) / 100;
+  }
+};
+
+/* 以 target 的总速率（0 为闭环）测试 duration 秒 */
+void run_test(double target, int threads, int num, int duration,
+              Result* result) {
+  rate = target;
+  stop = false;
+
+  /* 连接平均分给各个线程 */
+  vector<Worker> workers(threads);
+  for (int i = 0; i < threads; ++i) {
+    workers[i].epollfd = epoll_create(5);
+    if (workers[i].epollfd < 0) {
+      LOGERR("epoll_create error");
       exit(-1);
     }
-    if (SetNonBlocking(sockfd[i]) < 0) {
-      LOGERR("SetNonBlocking error");
+    workers[i].conns.resize(num / threads + (i < num % threads ? 1 : 0));
+    for (auto& conn : workers[i].conns) {
+      conn.fd = -1;
+      conn.scenario = -1;
+    }
+    workers[i].scenario_stats.resize(scenarios.size());
+    workers[i].seed = run_id + i;
+    workers[i].index = i;
+    workers[i].seq = 0;
+  }
+
+  uint64_t start = NowUs();
+  scheduled = rate > 0 || replay;
+  if (replay) {
+    /* 抓包中的连接依次分给各个线程 */
+    replay_start = start;
+    size_t k = 0;
+    for (auto& w : workers) {
+      w.wheel.cur_ms = start / 1000;
+      w.live = w.conns.size();
+      for (auto& conn : w.conns) {
+        conn.session = &sessions[k++];
+        conn.next_event = 0;
+        conn.next_send = 0;
+        conn.done = false;
+        conn.next_due = start + conn.session->events[0] / speed;
+      }
+    }
+  } else if (rate > 0) {
+    /* 每个连接以 rate / num 的速率发送，各连接的发送时刻均匀错开 */
+    double gap = 1e6 / rate;
+    int k = 0;
+    for (auto& w : workers) {
+      w.wheel.cur_ms = start / 1000;
+      for (auto& conn : w.conns) {
+        conn.interval = gap * num;
+        conn.next_due = start + gap * k++;
+      }
+    }
+  }
+
+  alarm(duration);
+  for (auto& w : workers) {
+    if (pthread_create(&w.tid, NULL, run_worker, &w) != 0) {
+      LOGERR("pthread_create error");
       exit(-1);
     }
   }
+  for (auto& w : workers) pthread_join(w.tid, NULL);
+
+  result->target = target;
+  result->elapsed = (NowUs() - start) / 1e6;
+  result->scenario_stats.resize(scenarios.size());
+  for (auto& w : workers) {
+    merge_stats(&result->total, w.stats);
+    for (size_t i = 0; i < scenarios.size(); ++i) {
+      merge_stats(&result->scenario_stats[i], w.scenario_stats[i]);
+    }
+    close(w.epollfd);
+  }
 }
 
+static const double ps[] = {50, 90, 99, 99.9};
+
+/* 以 JSON 格式输出延迟分布 */
+void json_histogram(const char* name, const Histogram& h) {
+  printf("\"%s\": {\"mean\": %.1f, \"p50\": %lu, \"p90\": %lu, ", name,
+         h.mean(), (unsigned long)h.Percentile(ps[0]),
+         (unsigned long)h.Percentile(ps[1]));
+  printf("\"p99\": %lu, \"p999\": %lu, \"max\": %lu}",
+         (unsigned long)h.Percentile(ps[2]),
+         (unsigned long)h.Percentile(ps[3]), (unsigned long)h.max());
+}
+
+/* 输出延迟分布 */
+void print_histogram(const char* name, const Histogram& h) {
+  printf("%s mean %.1f us, p50 %lu us, p90 %lu us, p99 %lu us, "
+         "p99.9 %lu us, max %lu us\n",
+         name, h.mean(), (unsigned long)h.Percentile(ps[0]),
+         (unsigned long)h.Percentile(ps[1]),
+         (unsigned long)h.Percentile(ps[2]),
+         (unsigned long)h.Percentile(ps[3]), (unsigned long)h.max());
+}
+
+/* 以 JSON 格式输出统计结果中的各项计数和延迟分布 */
+void json_stats(const Stats& total, double elapsed, bool service) {
+  printf("\"completed\": %lu, \"failed\": %lu, \"connects\": %lu, ",
+         (unsigned long)total.completed, (unsigned long)total.failed,
+         (unsigned long)total.connects);
+  printf("\"requests_per_sec\": %.2f, \"bytes_per_sec\": %.2f, ",
+         total.completed / elapsed, total.bytes / elapsed);
+  printf("\"status\": {\"1xx\": %lu, \"2xx\": %lu, \"3xx\": %lu, ",
+         (unsigned long)total.status[1], (unsigned long)total.status[2],
+         (unsigned long)total.status[3]);
+  printf("\"4xx\": %lu, \"5xx\": %lu, \"other\": %lu}, ",
+         (unsigned long)total.status[4], (unsigned long)total.status[5],
+         (unsigned long)total.status[0]);
+  json_histogram("latency_us", total.latency);
+  if (service) {
+    printf(", ");
+    json_histogram("service_us", total.service);
+  }
+}
+
+/* 输出一轮测试的结果 */
+void report(const Result& r, int threads, int conns, bool json) {
+  const Stats& total = r.total;
+  if (json) {
+    printf("{\"threads\": %d, \"connections\": %d, \"duration_sec\": %.3f, ",
+           threads, conns, r.elapsed);
+    if (sock_opts_str) printf("\"sockopt\": \"%s\", ", sock_opts_str);
+    if (r.target > 0) {
+      printf("\"target_rps\": %.2f, \"unsent\": %lu, ", r.target,
+             (unsigned long)total.unsent);
+    }
+    if (replay) {
+      printf("\"replay\": {\"requests\": %lu, \"speed\": %.2f, "
+             "\"truncated_bytes\": %lu}, \"unsent\": %lu, ",
+             (unsigned long)replay_requests, speed, (unsigned long)truncated,
+             (unsigned long)total.unsent);
+    }
+    json_stats(total, r.elapsed, scheduled);
+    if (has_scenario_file) {
+      printf(", \"scenarios\": [");
+      for (size_t i = 0; i < scenarios.size(); ++i) {
+        printf("%s{\"name\": \"%s\", \"weight\": %d, ", i ? ", " : "",
+               scenarios[i].name.c_str(), scenarios[i].weight);
+        json_stats(r.scenario_stats[i], r.elapsed, scheduled);
+        printf("}");
+      }
+      printf("]");
+    }
+    printf("}");
+    return;
+  }
+  printf("\n%d threads, %d connections, %.2f sec", threads, conns, r.elapsed);
+  if (r.target > 0) printf(", target %.2f requests/sec", r.target);
+  if (sock_opts_str) printf(", sockopt %s", sock_opts_str);
+  if (replay) {
+    printf(", replay %lu requests at %.2fx", (unsigned long)replay_requests,
+           speed);
+  }
+  printf("\nRequests: %lu completed, %lu failed, %lu connects",
+         (unsigned long)total.completed, (unsigned long)total.failed,
+         (unsigned long)total.connects);
+  if (r.target > 0 || replay) {
+    printf(", %lu unsent", (unsigned long)total.unsent);
+  }
+  printf("\nStatus:   2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, other %lu\n",
+         (unsigned long)total.status[2], (unsigned long)total.status[3],
+         (unsigned long)total.status[4], (unsigned long)total.status[5],
+         (unsigned long)(total.status[0] + total.status[1]));
+  printf("Speed:    %.2f requests/sec, %.2f KB/sec\n", r.rps(),
+         total.bytes / r.elapsed / 1024);
+  print_histogram("Latency: ", total.latency);
+  /* 开环和回放模式下延迟从计划发送时间算起，另外给出从实际发送算起的服务时间 */
+  if (scheduled) print_histogram("Service: ", total.service);
+  if (!has_scenario_file) return;
+
+  printf("\n%-16s %10s %8s %8s %12s %10s %10s %10s %8s\n", "scenario",
+         "completed", "failed", "connects", "requests/s", "p50(us)", "p99(us)",
+         "p99.9(us)", "non-2xx");
+  for (size_t i = 0; i < scenarios.size(); ++i) {
+    const Stats& s = r.scenario_stats[i];
+    printf("%-16s %10lu %8lu %8lu %12.2f %10lu %10lu %10lu %8lu\n",
+           scenarios[i].name.c_str(), (unsigned long)s.completed,
+           (unsigned long)s.failed, (unsigned long)s.connects,
+           s.completed / r.elapsed, (unsigned long)s.latency.Percentile(50),
+           (unsigned long)s.latency.Percentile(99),
+           (unsigned long)s.latency.Percentile(99.9),
+           (unsigned long)(s.completed - s.status[2]));
+  }
+}
+
+static struct option long_options[] = {
+    {"threads", required_argument, NULL, 't'},
+    {"rate", required_argument, NULL, 'r'},
+    {"ramp", required_argument, NULL, 'R'},
+    {"scenario", required_argument, NULL, 's'},
+    {"replay", required_argument, NULL, 'C'},
+    {"speed", required_argument, NULL, 'x'},
+    {"sockopt", required_argument, NULL, 'o'},
+    {"json", no_argument, NULL, 'j'},
+    {NULL, 0, NULL, 0}};
+
 int main(int argc, char** argv) {
-  if (argc < 5) {
-    printf("Usage: %s host port connection_number time(sec)\n",
-           basename(argv[0]));
+  int threads = 1;
+  bool json = false;
+  double target = 0;
+  double ramp_start = 0, ramp_step = 0, ramp_end = 0;
+  const char* scenario_file = NULL;
+  const char* replay_file = NULL;
+  int c = 0;
+  while ((c = getopt_long(argc, argv, "t:r:R:s:C:x:o:j", long_options,
+                          NULL)) != EOF) {
+    switch (c) {
+      case 't':
+        threads = atoi(optarg);
+        break;
+      case 'r':
+        target = atof(optarg);
+        break;
+      case 'R':
+        if (sscanf(optarg, "%lf:%lf:%lf", &ramp_start, &ramp_step,
+                   &ramp_end) != 3 ||
+            ramp_start <= 0 || ramp_step <= 0 || ramp_end < ramp_start) {
+          printf("Invalid ramp: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 's':
+        scenario_file = optarg;
+        break;
+      case 'C':
+        replay_file = optarg;
+        break;
+      case 'x':
+        speed = atof(optarg);
+        break;
+      case 'o':
+        if (ParseSockOpts(optarg, &sock_opts) < 0) {
+          printf("Invalid socket options: %s\n", optarg);
+          return 1;
+        }
+        sock_opts_str = optarg;
+        break;
+      case 'j':
+        json = true;
+        break;
+      default:
+        usage(basename(argv[0]));
+        return 1;
+    }
+  }
+  if (argc - optind < (replay_file ? 2 : 4) || threads <= 0 || target < 0 ||
+      speed <= 0) {
+    usage(basename(argv[0]));
+    return 1;
+  }
+  if (replay_file && (scenario_file || target > 0 || ramp_step > 0)) {
+    printf("--replay cannot be used with --rate, --ramp or --scenario\n");
     return 1;
   }
 
-  int epollfd = epoll_create(5);
-  if (epollfd < 0) {
-    LOGERR("epoll_create error");
-    exit(-1);
+  parse_url(argv[optind]);
+  if (scenario_file) load_scenarios(scenario_file);
+  if (replay_file) load_capture(replay_file);
+  prepare_scenarios();
+  run_id = time(NULL);
+  int port = atoi(argv[optind + 1]);
+  int num = replay ? sessions.size() : atoi(argv[optind + 2]);
+  /* 回放模式下不限时间时，回放完所有连接即结束 */
+  int duration = argc - optind >= 4 ? atoi(argv[optind + 3]) : 0;
+  if (num <= 0) {
+    usage(basename(argv[0]));
+    return 1;
   }
-  epoll_event events[100000];
-  char buffer[BUFSIZE];
+  if (threads > num) threads = num;
 
-  int num = atoi(argv[3]);
-  build_request(argv[1]);
-  start_conn(epollfd, num, host, atoi(argv[2]));
+  struct hostent* he = gethostbyname(host);
+  if (he == NULL) {
+    printf("Unknown host: %s\n", host);
+    return 1;
+  }
+  bzero(&server_addr, sizeof(server_addr));
+  server_addr.sin_port = htons(port);
+  server_addr.sin_family = AF_INET;
+  memcpy(&(server_addr.sin_addr), he->h_addr_list[0], sizeof(in_addr));
 
   struct sigaction sa;
+  bzero(&sa, sizeof(sa));
   sa.sa_handler = alarm_handler;
-  sa.sa_flags = 0;
   sigaction(SIGALRM, &sa, NULL);
-  alarm(atoi(argv[4]));
-
-  while (!stop) {
-    int n = epoll_wait(epollfd, events, 100000, 2000);
-    if (n < 0 && (errno != EINTR)) {
-      LOGERR("epoll_wait error");
-      exit(-1);
-    }
-    for (int i = 0; i < n; ++i) {
-      int sockfd = events[i].data.fd;
-      if (events[i].events & EPOLLIN) {
-        if (!read_once(sockfd, buffer, BUFSIZE)) {
-          // RemoveFd(epollfd, sockfd);
-          ++failed;
-          // printf("have %d socket left\n", num);
-          continue;
-        }
+  signal(SIGPIPE, SIG_IGN);
 
-        epoll_event event;
-        event.data.fd = sockfd;
-        event.events = EPOLLOUT | EPOLLET | EPOLLERR;
-        if (epoll_ctl(epollfd, EPOLL_CTL_MOD, sockfd, &event) < 0) {
-          LOGERR("epoll_ctl error");
-          exit(-1);
-        }
-      } else if (events[i].events & EPOLLOUT) {
-        if (!write_nbytes(sockfd, request, strlen(request))) {
-          // RemoveFd(epollfd, sockfd);
-          ++failed;
-          // printf("have %d socket left\n", num);
-          continue;
-        }
+  if (ramp_step <= 0) {
+    Result result;
+    run_test(target, threads, num, duration, &result);
+    report(result, threads, num, json);
+    if (json) printf("\n");
+    return 0;
+  }
 
-        ++speed;
-        epoll_event event;
-        event.data.fd = sockfd;
-        event.events = EPOLLIN | EPOLLET | EPOLLERR;
-        if (epoll_ctl(epollfd, EPOLL_CTL_MOD, sockfd, &event) < 0) {
-          LOGERR("epoll_ctl error");
-          exit(-1);
-        }
-      } else {
-        // RemoveFd(epollfd, sockfd);
-        ++failed;
-      }
+  /* 逐级提高速率，第一个未达到目标速率的级别即为饱和点 */
+  deque<Result> results;  // Histogram 不可复制，用 deque 避免扩容时移动
+  double knee = 0;
+  if (json) printf("{\"steps\": [");
+  for (double r = ramp_start; r <= ramp_end + 1e-9; r += ramp_step) {
+    results.emplace_back();
+    run_test(r, threads, num, duration, &results.back());
+    if (json && results.size() > 1) printf(", ");
+    report(results.back(), threads, num, json);
+    fflush(stdout);
+    if (results.back().saturated()) {
+      knee = r;
+      break;
     }
   }
+  if (json) {
+    printf("], \"knee_rps\": %.2f}\n", knee);
+    return 0;
+  }
 
-  int duration = atoi(argv[4]);
-  printf(
-      "\nSpeed=%d pages/min, %.2f KB/sec. Requests: %d succeed, %d failed.\n",
-      (int)((speed + failed) / (duration / 60.0f)),
-      (float)(bytes / (float)duration / 1024.0f), speed, failed);
-
+  printf("\n%12s %12s %10s %10s %10s %10s\n", "target/s", "actual/s",
+         "p50(us)", "p99(us)", "p99.9(us)", "failed");
+  for (auto& r : results) {
+    printf("%12.2f %12.2f %10lu %10lu %10lu %10lu\n", r.target, r.rps(),
+           (unsigned long)r.total.latency.Percentile(50),
+           (unsigned long)r.total.latency.Percentile(99),
+           (unsigned long)r.total.latency.Percentile(99.9),
+           (unsigned long)r.total.failed);
+  }
+  if (knee > 0) {
+    printf("Saturated at %.2f requests/sec\n", knee);
+  } else {
+    printf("Not saturated up to %.2f requests/sec\n", results.back().target);
+  }
   return 0;
 }
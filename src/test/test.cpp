@@ -0,0 +1,169 @@
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+
+#include "common.h"
+#include "http_conn.h"
+#include "logger.h"
+
+using std::string;
+
+/** 请求解析的回归测试
+ * 通过 socketpair 像主线程那样驱动一个连接：读请求、解析、填充并写出应答，
+ * 再从另一端读出应答检查状态码与连接是否保持 */
+
+static int failures = 0;
+
+#define EXPECT(cond)                                                  \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                     \
+    }                                                                 \
+  } while (0)
+
+/* 访问 HttpConn 的私有成员，在不经过连接表的情况下使用一个 socketpair */
+class HttpConnTest {
+ public:
+  HttpConnTest() : __conn_(new HttpConn()) {
+    __epollfd_ = epoll_create(5);
+    if (__epollfd_ < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, __sv_) < 0) {
+      perror("HttpConnTest");
+      exit(1);
+    }
+    HttpConn::epollfd_ = __epollfd_;
+    SetNonBlocking(__sv_[0]);
+    /* 服务器一端没有应答或没有关闭时，读超时失败而不是一直阻塞 */
+    timeval timeout = {2, 0};
+    setsockopt(__sv_[1], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (AddFd<LtPolicy>(__epollfd_, __sv_[0], true, 1) < 0) exit(1);
+    __conn_->__sockfd_ = __sv_[0];
+    __conn_->__token_ = 1;
+    __conn_->__Init();
+  }
+  ~HttpConnTest() {
+    __conn_->__DetachBuf();
+    close(__sv_[0]);
+    close(__sv_[1]);
+    close(__epollfd_);
+  }
+
+  /* 发送 request，像主线程那样处理，返回应答的状态码，
+   * alive 为写完应答后连接是否保持 */
+  int RoundTrip(const string& request, bool* alive) {
+    if (write(__sv_[1], request.data(), request.size()) !=
+        (ssize_t)request.size())
+      return -1;
+    *alive = false;
+    if (!__conn_->Read<LtPolicy>()) return -1;
+    if (__conn_->Prepare() != HttpConn::LANE_INLINE) return -1;
+    if (!__conn_->ProcessInline<LtPolicy>()) return -1;
+    *alive = __conn_->Write<LtPolicy>();
+    return ReadStatus();
+  }
+
+  /* 对端是否已经读到结束 */
+  bool PeerClosed() {
+    char c;
+    return read(__sv_[1], &c, 1) == 0;
+  }
+
+ private:
+  /* 读出一个完整的应答，返回状态码 */
+  int ReadStatus() {
+    string response;
+    char buf[4096];
+    size_t header_end = string::npos;
+    long body = -1;
+    for (;;) {
+      if (header_end == string::npos) {
+        header_end = response.find("\r\n\r\n");
+        if (header_end != string::npos) {
+          size_t pos = response.find("Content-Length:");
+          body = pos == string::npos ? 0 : atol(response.c_str() + pos + 15);
+        }
+      }
+      if (header_end != string::npos &&
+          response.size() >= header_end + 4 + body)
+        break;
+      ssize_t n = read(__sv_[1], buf, sizeof(buf));
+      if (n <= 0) return -1;
+      response.append(buf, n);
+    }
+    return atoi(response.c_str() + strlen("HTTP/1.1 "));
+  }
+
+  std::unique_ptr<HttpConn> __conn_;
+  int __sv_[2];
+  int __epollfd_;
+};
+
+/* 合法的消息体不影响同一连接上的下一个请求 */
+static void TestKeepAliveBody() {
+  HttpConnTest conn;
+  bool alive;
+  EXPECT(conn.RoundTrip("POST /nothere HTTP/1.1\r\n"
+                        "Connection: keep-alive\r\n"
+                        "Content-Length: 5\r\n"
+                        "\r\n"
+                        "hello",
+                        &alive) == 404);
+  EXPECT(alive);
+  EXPECT(conn.RoundTrip("GET /nothere HTTP/1.1\r\n"
+                        "Connection: keep-alive\r\n"
+                        "\r\n",
+                        &alive) == 404);
+  EXPECT(alive);
+}
+
+/* 不合法的 Content-Length 以 400 应答并关闭连接，即使请求要求保持连接 */
+static void TestBadContentLength(const char* value) {
+  HttpConnTest conn;
+  bool alive;
+  string request = string("POST /nothere HTTP/1.1\r\n"
+                          "Connection: keep-alive\r\n"
+                          "Content-Length: ") +
+                   value + "\r\n\r\nhello";
+  EXPECT(conn.RoundTrip(request, &alive) == 400);
+  EXPECT(!alive);
+  EXPECT(conn.PeerClosed());
+}
+
+/* 消息体超过读缓冲区的剩余空间 */
+static void TestContentLengthOverBuffer() {
+  HttpConnTest conn;
+  bool alive;
+  string request =
+      "POST /nothere HTTP/1.1\r\n"
+      "Connection: keep-alive\r\n"
+      "Content-Length: " +
+      std::to_string(HttpConn::kReadBufSize_ - 10) + "\r\n\r\n";
+  EXPECT(conn.RoundTrip(request, &alive) == 400);
+  EXPECT(!alive);
+  EXPECT(conn.PeerClosed());
+}
+
+int main() {
+  Logger::Init(kWarning, "/tmp", false);
+  HttpConn::InitMetrics();
+
+  TestKeepAliveBody();
+  TestBadContentLength("-5");
+  TestBadContentLength("-1");
+  TestBadContentLength("100000");
+  TestBadContentLength("4294967301");
+  TestBadContentLength("12abc");
+  TestBadContentLength("");
+  TestContentLengthOverBuffer();
+
+  if (failures > 0) {
+    fprintf(stderr, "%d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("all tests passed\n");
+  return 0;
+}
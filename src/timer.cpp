@@ -1,20 +1,34 @@
 #include "timer.h"
 
-Timer::Timer(int delay) : expire_(time(NULL) + delay) {}
+Timer::Timer(int delay_ms)
+    : expire_(NowMs() + delay_ms),
+      cb_func_(nullptr),
+      user_data_(0),
+      __index_(-1) {}
 
 TimerHeap::TimerHeap(size_t capacity) { __heap_.reserve(capacity); }
 
-TimerHeap::TimerHeap(const std::vector<TimerPtr>& heap) : __heap_(heap) {}
-
 void TimerHeap::AddTimer(const TimerPtr& timer) {
+  if (timer->__index_ >= 0) return;
   __heap_.push_back(timer);
-  std::push_heap(__heap_.begin(), __heap_.end(), __compare);
+  timer->__index_ = __heap_.size() - 1;
+  __SiftUp(timer->__index_);
 }
 
 void TimerHeap::DelTimer(const TimerPtr& timer) {
-  if (timer == nullptr) return;
-  // lazy delete
-  timer->cb_func_ = nullptr;
+  if (timer == nullptr || timer->__index_ < 0) return;
+  __Remove(timer->__index_);
+}
+
+void TimerHeap::AdjustTimer(const TimerPtr& timer, int delay_ms) {
+  timer->expire_ = NowMs() + delay_ms;
+  if (timer->__index_ < 0) {
+    AddTimer(timer);
+    return;
+  }
+  /* 到期时间只会推后或提前，向两个方向各调整一次即可 */
+  __SiftUp(timer->__index_);
+  __SiftDown(timer->__index_);
 }
 
 const TimerHeap::TimerPtr TimerHeap::Top() const {
@@ -24,24 +38,53 @@ const TimerHeap::TimerPtr TimerHeap::Top() const {
 
 void TimerHeap::PopTimer() {
   if (__heap_.empty()) return;
-  std::pop_heap(__heap_.begin(), __heap_.end(), __compare);
-  __heap_.pop_back();
+  __Remove(0);
 }
 
 void TimerHeap::Tick() {
-  auto it = __heap_.begin();
-  time_t cur = time(NULL);
-  while (!__heap_.empty()) {
-    if (it == __heap_.end() || (*it)->expire_ > cur) break;
-
-    if ((*it)->cb_func_ != nullptr) {
-      (*it)->cb_func_((*it)->user_data_);
-    }
-    PopTimer();
-    it = __heap_.begin();
+  uint64_t cur = NowMs();
+  while (!__heap_.empty() && __heap_[0]->expire_ <= cur) {
+    /* 先出堆再回调，回调中可以重新加入该定时器 */
+    TimerPtr timer = __heap_[0];
+    __Remove(0);
+    if (timer->cb_func_ != nullptr) timer->cb_func_(timer->user_data_);
   }
 }
 
-bool TimerHeap::__compare(const TimerPtr& lhs, const TimerPtr& rhs) {
-  return lhs->expire_ > rhs->expire_;
+void TimerHeap::__Remove(int index) {
+  __heap_[index]->__index_ = -1;
+  int last = __heap_.size() - 1;
+  if (index != last) {
+    __Place(index, std::move(__heap_[last]));
+    __heap_.pop_back();
+    __SiftUp(index);
+    __SiftDown(index);
+  } else {
+    __heap_.pop_back();
+  }
+}
+
+void TimerHeap::__SiftUp(int index) {
+  TimerPtr timer = std::move(__heap_[index]);
+  while (index > 0) {
+    int parent = (index - 1) / 2;
+    if (__heap_[parent]->expire_ <= timer->expire_) break;
+    __Place(index, std::move(__heap_[parent]));
+    index = parent;
+  }
+  __Place(index, std::move(timer));
+}
+
+void TimerHeap::__SiftDown(int index) {
+  TimerPtr timer = std::move(__heap_[index]);
+  int n = __heap_.size();
+  while (2 * index + 1 < n) {
+    int child = 2 * index + 1;
+    if (child + 1 < n && __heap_[child + 1]->expire_ < __heap_[child]->expire_)
+      ++child;
+    if (timer->expire_ <= __heap_[child]->expire_) break;
+    __Place(index, std::move(__heap_[child]));
+    index = child;
+  }
+  __Place(index, std::move(timer));
 }
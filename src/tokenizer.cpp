@@ -0,0 +1,142 @@
+#include "tokenizer.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOKENIZER_X86
+#endif
+
+static const char* FindLineEndScalar(const char* p, const char* end,
+                                     const char** colon) {
+  if (colon && *colon == nullptr) {
+    for (; p < end; ++p) {
+      if (*p == '\r' || *p == '\n') return p;
+      if (*p == ':') {
+        *colon = p++;
+        break;
+      }
+    }
+  }
+  for (; p < end; ++p) {
+    if (*p == '\r' || *p == '\n') return p;
+  }
+  return end;
+}
+
+static const char* FindSpaceScalar(const char* p, const char* end) {
+  for (; p < end; ++p) {
+    if (*p == ' ' || *p == '\t') return p;
+  }
+  return end;
+}
+
+#ifdef TOKENIZER_X86
+
+static const int kCmpMode =
+    _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT;
+
+__attribute__((target("sse4.2"))) static const char* FindLineEndSse42(
+    const char* p, const char* end, const char** colon) {
+  /* 前 needle_len 个字节为要查找的字符，找到 ':' 后只再查找行尾 */
+  const __m128i needle = _mm_setr_epi8('\r', '\n', ':', 0, 0, 0, 0, 0, 0, 0,
+                                       0, 0, 0, 0, 0, 0);
+  int needle_len = colon && *colon == nullptr ? 3 : 2;
+  while (end - p >= 16) {
+    __m128i data = _mm_loadu_si128((const __m128i*)p);
+    int i = _mm_cmpestri(needle, needle_len, data, 16, kCmpMode);
+    if (i == 16) {
+      p += 16;
+    } else if (p[i] != ':') {
+      return p + i;
+    } else {
+      *colon = p + i;
+      needle_len = 2;
+      p += i + 1;
+    }
+  }
+  return FindLineEndScalar(p, end, colon);
+}
+
+__attribute__((target("sse4.2"))) static const char* FindSpaceSse42(
+    const char* p, const char* end) {
+  const __m128i needle =
+      _mm_setr_epi8(' ', '\t', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  while (end - p >= 16) {
+    __m128i data = _mm_loadu_si128((const __m128i*)p);
+    int i = _mm_cmpestri(needle, 2, data, 16, kCmpMode);
+    if (i < 16) return p + i;
+    p += 16;
+  }
+  return FindSpaceScalar(p, end);
+}
+
+__attribute__((target("avx2"))) static const char* FindLineEndAvx2(
+    const char* p, const char* end, const char** colon) {
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  const __m256i col = _mm256_set1_epi8(':');
+  bool want_colon = colon && *colon == nullptr;
+  while (end - p >= 32) {
+    __m256i data = _mm256_loadu_si256((const __m256i*)p);
+    unsigned eol = _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(data, cr), _mm256_cmpeq_epi8(data, lf)));
+    if (want_colon) {
+      unsigned colons = _mm256_movemask_epi8(_mm256_cmpeq_epi8(data, col));
+      /* 只记录行尾之前的 ':' */
+      if (eol) colons &= (1u << __builtin_ctz(eol)) - 1;
+      if (colons) {
+        *colon = p + __builtin_ctz(colons);
+        want_colon = false;
+      }
+    }
+    if (eol) return p + __builtin_ctz(eol);
+    p += 32;
+  }
+  return FindLineEndScalar(p, end, colon);
+}
+
+__attribute__((target("avx2"))) static const char* FindSpaceAvx2(
+    const char* p, const char* end) {
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  while (end - p >= 32) {
+    __m256i data = _mm256_loadu_si256((const __m256i*)p);
+    unsigned found = _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(data, space), _mm256_cmpeq_epi8(data, tab)));
+    if (found) return p + __builtin_ctz(found);
+    p += 32;
+  }
+  return FindSpaceScalar(p, end);
+}
+
+#endif  // TOKENIZER_X86
+
+static const Tokenizer kScalar = {"scalar", FindLineEndScalar,
+                                  FindSpaceScalar};
+#ifdef TOKENIZER_X86
+static const Tokenizer kSse42 = {"sse4.2", FindLineEndSse42, FindSpaceSse42};
+static const Tokenizer kAvx2 = {"avx2", FindLineEndAvx2, FindSpaceAvx2};
+#endif
+
+const Tokenizer* GetTokenizer(const char* name) {
+#ifdef TOKENIZER_X86
+  __builtin_cpu_init();  // 可能在其他全局对象的构造函数中调用
+  if (strcmp(name, "avx2") == 0) {
+    return __builtin_cpu_supports("avx2") ? &kAvx2 : nullptr;
+  }
+  if (strcmp(name, "sse4.2") == 0) {
+    return __builtin_cpu_supports("sse4.2") ? &kSse42 : nullptr;
+  }
+#endif
+  return strcmp(name, "scalar") == 0 ? &kScalar : nullptr;
+}
+
+/* 选择 CPU 支持的最快实现 */
+static const Tokenizer* ChooseTokenizer() {
+  const Tokenizer* tokenizer = GetTokenizer("avx2");
+  if (tokenizer == nullptr) tokenizer = GetTokenizer("sse4.2");
+  return tokenizer ? tokenizer : &kScalar;
+}
+
+const Tokenizer* g_tokenizer = ChooseTokenizer();